@@ -0,0 +1,692 @@
+/* 
+ * File:    catalog.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Repository catalog. Tested under FreeBSD 11.2.
+ *
+ *          The catalog of a package repository is made of archives
+ *          holding a single text file, plus an optional signature.
+ *          In 'packagesite.txz', each line of 'packagesite.yaml' is a
+ *          JSON object describing one package, its 'repopath' being
+ *          relative to the repository directory.  In 'digests.txz',
+ *          each line starts with the package origin followed by ':'.
+ *
+ *          Trimming rewrites both archives of a repository directory
+ *          so that they only describe the packages found in the cache.
+ *          The upstream signature can't survive the trimming, so the
+ *          archives are signed with the local RSA key if one is given,
+ *          the same way 'pkg repo' does it.  'meta.txz' describes the
+ *          archive formats only and is kept as is.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "catalog.h"
+#include "common.h"
+#include "snapshot.h"
+
+
+/*
+ *  Constants
+ */
+
+#define LNCATALOGBLOCK              65536
+
+#define PKGCACHE_CATALOG_SIGNATURE  "signature"
+
+// DER DigestInfo header of a SHA-1 digest, as RSA_sign(NID_sha1) puts
+// in front of the signed data
+#define PKGCACHE_CATALOG_SHA1INFO   "\x30\x21\x30\x09\x06\x05\x2b\x0e" \
+                                    "\x03\x02\x1a\x05\x00\x04\x14"
+#define LNCATALOGSHA1INFO           15
+#define PKGCACHE_CATALOG_TEMP       ".pkgcachetemp"
+
+
+/*
+ *  Types
+ */
+
+typedef struct
+{
+   const char  *szDir;
+   int         iDropped,
+               iKept,
+               iRepopath;
+   BUFFER      sData;
+   STRSET      sOrigins;
+} TRIM;
+
+typedef struct
+{
+   const char  *szKeyFilename,
+               *szPkgcachePathname;
+} TRIMALL;
+
+
+/*
+ *  CatalogFindInternal
+ *
+ *  Return: a pointer to the value of szKey in the JSON object starting
+ *          at pObject, or NULL if not found.  Nested objects are not
+ *          searched.
+ */
+
+const char *
+CatalogFindInternal(const char *pObject, const char *szKey)
+{
+   int         iDepth = 0,
+               iIsKey = 0,
+               l;
+   const char  *p,
+               *pStart,
+               *pValue = NULL;
+
+
+   l = strlen(szKey);
+   p = pObject;
+   while (*p && !pValue && iDepth >= 0)
+   {
+      if (*p == '"')
+      {
+         pStart = p + 1;
+         do
+         {
+            p++;
+            if (*p == '\\' && *(p+1))
+               p++;
+         }
+         while (*p && *p != '"') ;
+
+         if (iDepth == 1 && iIsKey && p - pStart == l
+             && !strncmp(pStart, szKey, l))
+         {
+            pStart = p + 1;
+            while (isspace(*pStart))
+               pStart++;
+            if (*pStart == ':')
+            {
+               pStart++;
+               while (isspace(*pStart))
+                  pStart++;
+               pValue = pStart;
+            }
+         }
+         iIsKey = 0;
+         if (!*p)
+            p--;
+      }
+      else if (*p == '{' || *p == '[')
+      {
+         iDepth++;
+         iIsKey = (*p == '{');
+      }
+      else if (*p == '}' || *p == ']')
+      {
+         iDepth--;
+         if (!iDepth)
+            iDepth = -1;   // End of the object
+      }
+      else if (*p == ',')
+         iIsKey = 1;
+
+      p++;
+   }
+
+   return(pValue);
+}
+
+
+/*
+ *  CatalogGetValue
+ *
+ *  Get a string or scalar value of a catalog line.  Strings are
+ *  unescaped, other values are copied as is.
+ *
+ *  Return: TRUE if found.
+ */
+
+int
+CatalogGetValue(const char *pLine, const char *szKey,
+                   char *szValue, const int l)
+{
+   int         i = 0;
+   const char  *p;
+
+
+   p = strchr(pLine, '{');
+   if (p)
+      p = CatalogFindInternal(p, szKey);
+   if (p)
+   {
+      if (*p == '"')
+      {
+         p++;
+         while (*p && *p != '"' && i < l-1)
+         {
+            if (*p == '\\' && *(p+1))
+               p++;
+            szValue[i] = *p;
+            i++;
+            p++;
+         }
+      }
+      else
+      {
+         while (*p && *p != ',' && *p != '}' && !isspace(*p) && i < l-1)
+         {
+            szValue[i] = *p;
+            i++;
+            p++;
+         }
+      }
+   }
+   szValue[i] = 0;
+
+   return(p != NULL);
+}
+
+
+/*
+ *  CatalogIsDataInternal
+ *
+ *  Return: TRUE if the archive entry isn't a signature or a key.
+ */
+
+int
+CatalogIsDataInternal(const char *szEntry)
+{
+   int i;
+
+
+   i = strlen(szEntry);
+
+   return(strcmp(szEntry, PKGCACHE_CATALOG_SIGNATURE)
+          && !(i > 4 && (!strcmp(szEntry + i - 4, ".sig")
+                         || !strcmp(szEntry + i - 4, ".pub"))));
+}
+
+
+/*
+ *  CatalogReadInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz, or pFunc's non-zero result.
+ */
+
+int
+CatalogReadInternal(const char *szArchive,     char *szEntry,
+                       CATALOGFUNC pFunc, void *pData)
+{
+   int         iErr = 0,
+               iFound = 0;
+   char        *p,
+               *pEnd;
+   la_ssize_t  iCountR;
+   BUFFER      sLine = {NULL, 0, 0};
+   struct archive *pArc;
+   struct archive_entry *pArcEntry;
+
+
+   pArc = archive_read_new();
+   if (!pArc)
+      iErr = ERROR_PKGCACHE_MEM;
+   if (!iErr)
+   {
+      if (archive_read_support_filter_all(pArc)
+          || archive_read_support_format_all(pArc)
+          || archive_read_open_filename(pArc, szArchive, LNCATALOGBLOCK))
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   while (!iErr && !iFound)
+   {
+      iErr = archive_read_next_header(pArc,     &pArcEntry);
+      if (iErr == ARCHIVE_WARN)
+         iErr = 0;
+      if (!iErr)
+      {
+         iFound = CatalogIsDataInternal(archive_entry_pathname(pArcEntry));
+         if (!iFound)
+            archive_read_data_skip(pArc);
+      }
+      else
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   if (!iErr)
+   {
+      StrnCopy(szEntry, archive_entry_pathname(pArcEntry), LNFILENAME);
+
+      // Split the data in lines
+      do
+      {
+         if (BufferReserve(&sLine, LNCATALOGBLOCK))
+         {
+            iErr = ERROR_PKGCACHE_MEM;
+            iCountR = 0;
+         }
+         else
+         {
+            iCountR = archive_read_data(pArc, sLine.p + sLine.iLength,
+                                        LNCATALOGBLOCK);
+            if (iCountR < 0)
+               iErr = ERROR_PKGCACHE_FILE_R;
+            else
+            {
+               sLine.iLength += iCountR;
+               sLine.p[sLine.iLength] = 0;
+            }
+         }
+
+         // Pass along the complete lines, keep the remaining for later
+         p = sLine.p;
+         while (!iErr && p && (pEnd = strchr(p, '\n')))
+         {
+            *pEnd = 0;
+            if (pEnd > p)
+               iErr = pFunc(p, pEnd - p, pData);
+            p = pEnd + 1;
+         }
+         if (p && p > sLine.p)
+         {
+            sLine.iLength -= p - sLine.p;
+            memmove(sLine.p, p, sLine.iLength + 1);
+         }
+      }
+      while (!iErr && iCountR > 0) ;
+
+      // Last line without its '\n'
+      if (!iErr && sLine.iLength)
+         iErr = pFunc(sLine.p, sLine.iLength, pData);
+   }
+
+   if (pArc)
+      archive_read_free(pArc);
+   BufferFree(&sLine);
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogRead
+ *
+ *  Call pFunc for each line of the catalog archive's data file.
+ *
+ *  Return: ERROR_PKGCACHE_xyz, or pFunc's non-zero result.
+ */
+
+int
+CatalogRead(const char *szArchive, CATALOGFUNC pFunc, void *pData)
+{
+   FILENAME szEntry;
+
+
+   return(CatalogReadInternal(szArchive,     szEntry, pFunc, pData));
+}
+
+
+/*
+ *  CatalogSignInternal
+ *
+ *  Sign the SHA256 hex digest of the data with an RSA private key,
+ *  like pkg(8) does for its 'signature' archive entry:  PKCS#1 padding
+ *  of a SHA-1 DigestInfo holding the hex digest and its NUL.  The
+ *  DigestInfo is built here, since EVP_PKEY_sign with a SHA-1
+ *  signature digest only takes 20 bytes.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogSignInternal(const char *szKeyFilename, BUFFER *pData,
+                       BUFFER *pSignature)
+{
+   int            iErr;
+   char           szInfo[LNCATALOGSHA1INFO + LNSHA256SUM];
+   size_t         iSignature;
+   FILE           *pFile;
+   EVP_PKEY       *pKey = NULL;
+   EVP_PKEY_CTX   *pCtx = NULL;
+   SHA256SUM      sSum;
+
+
+   memcpy(szInfo, PKGCACHE_CATALOG_SHA1INFO, LNCATALOGSHA1INFO);
+   iErr = Sha256Init(&sSum);
+   if (!iErr)
+      iErr = Sha256Update(&sSum, pData->p, pData->iLength);
+   if (Sha256Final(&sSum,     szInfo + LNCATALOGSHA1INFO) && !iErr)
+      iErr = ERROR_PKGCACHE_MEM;
+
+   if (!iErr)
+   {
+      pFile = fopen(szKeyFilename, "r");
+      if (pFile)
+      {
+         pKey = PEM_read_PrivateKey(pFile, NULL, NULL, NULL);
+         fclose(pFile);
+      }
+      if (pKey && EVP_PKEY_base_id(pKey) == EVP_PKEY_RSA)
+         pCtx = EVP_PKEY_CTX_new(pKey, NULL);
+      if (!pCtx || EVP_PKEY_sign_init(pCtx) <= 0
+          || EVP_PKEY_CTX_set_rsa_padding(pCtx, RSA_PKCS1_PADDING) <= 0)
+         iErr = ERROR_PKGCACHE_KEY;
+   }
+
+   if (!iErr)
+   {
+      pSignature->iLength = 0;
+      iSignature = EVP_PKEY_size(pKey);
+      iErr = BufferReserve(pSignature, iSignature);
+   }
+   if (!iErr)
+   {
+      if (EVP_PKEY_sign(pCtx, (unsigned char *)pSignature->p, &iSignature,
+                        (unsigned char *)szInfo, sizeof(szInfo)) > 0)
+      {
+         // The trailing NUL is part of the entry, as with pkg(8)
+         pSignature->p[iSignature] = 0;
+         pSignature->iLength = iSignature + 1;
+      }
+      else
+         iErr = ERROR_PKGCACHE_KEY;
+   }
+
+   if (pCtx)
+      EVP_PKEY_CTX_free(pCtx);
+   if (pKey)
+      EVP_PKEY_free(pKey);
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogWriteEntryInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogWriteEntryInternal(struct archive *pArc, const char *szEntry,
+                             BUFFER *pData)
+{
+   int   iErr = 0;
+   struct archive_entry *pArcEntry;
+
+
+   pArcEntry = archive_entry_new();
+   if (pArcEntry)
+   {
+      archive_entry_set_pathname(pArcEntry, szEntry);
+      archive_entry_set_size(pArcEntry, pData->iLength);
+      archive_entry_set_filetype(pArcEntry, AE_IFREG);
+      archive_entry_set_perm(pArcEntry, 0644);
+      archive_entry_set_mtime(pArcEntry, time(NULL), 0);
+
+      if (archive_write_header(pArc, pArcEntry)
+          || (pData->iLength && archive_write_data(pArc, pData->p,
+                                                  pData->iLength)
+                                  != (la_ssize_t)pData->iLength))
+         iErr = ERROR_PKGCACHE_FILE_W;
+
+      archive_entry_free(pArcEntry);
+   }
+   else
+      iErr = ERROR_PKGCACHE_MEM;
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogWriteInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogWriteInternal(const char *szArchive, const char *szEntry,
+                        BUFFER *pData, const char *szKeyFilename)
+{
+   int      iErr = 0;
+   BUFFER   sSignature = {NULL, 0, 0};
+   FILENAME szTempname;
+   struct archive *pArc = NULL;
+
+
+   if (strlen(szArchive) + strlen(PKGCACHE_CATALOG_TEMP) < LNFILENAME)
+      sprintf(szTempname, "%s%s", szArchive, PKGCACHE_CATALOG_TEMP);
+   else
+      iErr = ERROR_PKGCACHE_MEM;
+
+   if (!iErr && szKeyFilename && *szKeyFilename)
+      iErr = CatalogSignInternal(szKeyFilename, pData,     &sSignature);
+   if (!iErr)
+   {
+      pArc = archive_write_new();
+      if (!pArc)
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+   if (!iErr)
+   {
+      if (archive_write_add_filter_xz(pArc)
+          || archive_write_set_format_ustar(pArc)
+          || archive_write_open_filename(pArc, szTempname))
+         iErr = ERROR_PKGCACHE_FILE_W;
+   }
+   if (!iErr && sSignature.iLength)
+      iErr = CatalogWriteEntryInternal(pArc, PKGCACHE_CATALOG_SIGNATURE,
+                                       &sSignature);
+   if (!iErr)
+      iErr = CatalogWriteEntryInternal(pArc, szEntry, pData);
+   if (pArc)
+   {
+      if (archive_write_close(pArc) && !iErr)
+         iErr = ERROR_PKGCACHE_FILE_W;
+      archive_write_free(pArc);
+   }
+
+   // Replace the archive atomically, clients may be reading it
+   if (!iErr)
+   {
+      if (rename(szTempname, szArchive))
+         iErr = ERROR_PKGCACHE_FILE_W;
+   }
+   if (iErr)
+      remove(szTempname);
+
+   BufferFree(&sSignature);
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogTrimDigestsInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogTrimDigestsInternal(char *pLine, const int iLength, void *pData)
+{
+   int   iErr = 0;
+   char  *p;
+   TRIM  *pTrim = pData;
+
+
+   p = strchr(pLine, ':');
+   if (p)
+   {
+      *p = 0;
+      if (StrSetIsFound(&(pTrim->sOrigins), pLine))
+      {
+         *p = ':';
+         iErr = BufferAppend(&(pTrim->sData), pLine, iLength);
+         if (!iErr)
+            iErr = BufferAppend(&(pTrim->sData), "\n", 1);
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogTrimSiteInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogTrimSiteInternal(char *pLine, const int iLength, void *pData)
+{
+   int      iErr = 0;
+   char     szRepopath[LNSZ];
+   FILENAME sz;
+   TRIM     *pTrim = pData;
+
+
+   if (CatalogGetValue(pLine, "repopath", szRepopath, LNSZ))
+   {
+      pTrim->iRepopath++;
+      if (strlen(pTrim->szDir) + strlen(szRepopath) < LNFILENAME)
+      {
+         sprintf(sz, "%s%s", pTrim->szDir, szRepopath);
+         if (Exist(sz, PKGCACHE_EXIST_FILE))
+         {
+            pTrim->iKept++;
+            iErr = BufferAppend(&(pTrim->sData), pLine, iLength);
+            if (!iErr)
+               iErr = BufferAppend(&(pTrim->sData), "\n", 1);
+            if (!iErr && CatalogGetValue(pLine, "origin", sz, LNFILENAME))
+               iErr = StrSetAdd(&(pTrim->sOrigins), sz);
+         }
+         else
+            pTrim->iDropped++;
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogTrimInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogTrimInternal(const char *szPathname, const int iPathType, void *pData)
+{
+   int      iErr = 0;
+   FILENAME szArchive,
+            szEntry;
+   TRIM     sTrim;
+   TRIMALL  *pTrimAll = pData;
+
+
+   // A snapshot keeps its catalog as it was
+   if (iPathType == PKGCACHE_EXIST_DIR
+       && SnapshotIsDir(pTrimAll->szPkgcachePathname, szPathname))
+      iErr = PKGCACHE_WALK_PRUNE;
+   else if (iPathType == PKGCACHE_EXIST_DIR
+            && strlen(szPathname) + strlen(PKGCACHE_CATALOG_SITE)
+               < LNFILENAME)
+   {
+      sprintf(szArchive, "%s%s", szPathname, PKGCACHE_CATALOG_SITE);
+      if (Exist(szArchive, PKGCACHE_EXIST_FILE))
+      {
+         memset(&sTrim, 0, sizeof(sTrim));
+         sTrim.szDir = szPathname;
+
+         iErr = CatalogReadInternal(szArchive,     szEntry,
+                                    CatalogTrimSiteInternal, &sTrim);
+         if (iErr == ERROR_PKGCACHE_FILE_R || (!iErr && !sTrim.iRepopath))
+         {
+            printf("WARNING: Skipping %s, unknown catalog format!\n",
+                   szArchive);
+            iErr = 0;
+         }
+         else if (!iErr)
+         {
+            printf("Trimming %s: %d package", szPathname, sTrim.iKept);
+            if (sTrim.iKept > 1)
+               printf("s");
+            printf(" kept, %d dropped.\n", sTrim.iDropped);
+
+            iErr = CatalogWriteInternal(szArchive, szEntry, &(sTrim.sData),
+                                        pTrimAll->szKeyFilename);
+            sprintf(szArchive, "%s%s", szPathname, PKGCACHE_CATALOG_DIGESTS);
+            if (!iErr && strlen(szArchive) < LNFILENAME - 1
+                && Exist(szArchive, PKGCACHE_EXIST_FILE))
+            {
+               sTrim.sData.iLength = 0;
+               iErr = CatalogReadInternal(szArchive,     szEntry,
+                                          CatalogTrimDigestsInternal, &sTrim);
+               if (!iErr)
+                  iErr = CatalogWriteInternal(szArchive, szEntry,
+                                              &(sTrim.sData),
+                                              pTrimAll->szKeyFilename);
+               else if (iErr == ERROR_PKGCACHE_FILE_R)
+                  iErr = 0;
+            }
+         }
+
+         BufferFree(&(sTrim.sData));
+         StrSetClear(&(sTrim.sOrigins));
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  CatalogTrimAll
+ *
+ *  Trim the catalog of every repository directory of the cache.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CatalogTrimAll(const char *szPkgcachePathname, const char *szKeyFilename)
+{
+   TRIMALL  sTrimAll;
+
+
+   sTrimAll.szKeyFilename = szKeyFilename;
+   sTrimAll.szPkgcachePathname = szPkgcachePathname;
+
+   return(DirWalk(szPkgcachePathname, CatalogTrimInternal, &sTrimAll));
+}
@@ -0,0 +1,60 @@
+/* 
+ * File:    catalog.h
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Repository catalog header file. Tested under FreeBSD 11.2.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef PKGCACHE_CATALOG_H
+#define PKGCACHE_CATALOG_H
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_CATALOG_DIGESTS    "digests.txz"
+#define PKGCACHE_CATALOG_SITE       "packagesite.txz"
+
+
+/*
+ *  Types
+ */
+
+// Catalog line callback, the line is NUL terminated without its '\n'.
+// Returning non-zero stops the reading and becomes its result.
+typedef int (*CATALOGFUNC)(char *pLine, const int iLength, void *pData);
+
+
+/*
+ *  Prototypes
+ */
+
+int  CatalogGetValue(const char *pLine, const char *szKey,
+                        char *szValue, const int l);
+int  CatalogRead(const char *szArchive, CATALOGFUNC pFunc, void *pData);
+int  CatalogTrimAll(const char *szPkgcachePathname, const char *szKeyFilename);
+
+
+#endif  // PKGCACHE_CATALOG_H
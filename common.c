@@ -27,12 +27,362 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <sys/stat.h>
 
+#include <openssl/evp.h>
+
 #include "common.h"
 
 
+/*
+ *  Constants
+ */
+
+// Sorted, for bsearch()
+#define LNPKGCACHE_DOWNLOAD_ALWAYS  6
+char *PKGCACHE_DOWNLOAD_ALWAYS[LNPKGCACHE_DOWNLOAD_ALWAYS]
+   = {"digests.txz", "meta.txz", "packagesite.txz", "pkg-devel.txz", "pkg.txz", "pkg.txz.sig"};
+
+
+/*
+ *  ArenaAlloc
+ *
+ *  Return: the allocated memory, or NULL.
+ */
+
+void *
+ArenaAlloc(ARENA *pArena, const size_t l)
+{
+   size_t      i,
+               iAligned;
+   void        *p = NULL;
+   ARENABLOCK  *pBlock;
+
+
+   iAligned = (l + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+   pBlock = pArena->pBlocks;
+   if (!pBlock || pBlock->iUsed + iAligned > pBlock->iSize)
+   {
+      // New block, large requests get their own
+      i = MAX(iAligned, LNARENABLOCK - sizeof(ARENABLOCK));
+      pBlock = malloc(sizeof(ARENABLOCK) + i);
+      if (pBlock)
+      {
+         pBlock->iSize = i;
+         pBlock->iUsed = 0;
+         pBlock->pNext = pArena->pBlocks;
+         pArena->pBlocks = pBlock;
+      }
+   }
+   if (pBlock)
+   {
+      p = (char *)(pBlock + 1) + pBlock->iUsed;
+      pBlock->iUsed += iAligned;
+   }
+
+   return(p);
+}
+
+
+/*
+ *  ArenaFree
+ */
+
+void
+ArenaFree(ARENA *pArena)
+{
+   ARENABLOCK *pBlock;
+
+
+   while (pArena->pBlocks)
+   {
+      pBlock = pArena->pBlocks;
+      pArena->pBlocks = pBlock->pNext;
+      free(pBlock);
+   }
+}
+
+
+/*
+ *  BufferAppend
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+BufferAppend(BUFFER *pBuffer, const void *pData, const size_t l)
+{
+   int iErr;
+
+
+   iErr = BufferReserve(pBuffer, l);
+   if (!iErr)
+   {
+      memcpy(pBuffer->p + pBuffer->iLength, pData, l);
+      pBuffer->iLength += l;
+      pBuffer->p[pBuffer->iLength] = 0;   // Always a valid string
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  BufferAppendStr
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+BufferAppendStr(BUFFER *pBuffer, const char *sz)
+{
+   return(BufferAppend(pBuffer, sz, strlen(sz)));
+}
+
+
+/*
+ *  BufferFree
+ */
+
+void
+BufferFree(BUFFER *pBuffer)
+{
+   if (pBuffer->p)
+      free(pBuffer->p);
+
+   pBuffer->p = NULL;
+   pBuffer->iLength = 0;
+   pBuffer->iSize = 0;
+}
+
+
+/*
+ *  BufferReserve
+ *
+ *  Make room for l more bytes, plus a NUL.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+BufferReserve(BUFFER *pBuffer, const size_t l)
+{
+   int      iErr = 0;
+   char     *p;
+   size_t   i;
+
+
+   if (pBuffer->iLength + l + 1 > pBuffer->iSize)
+   {
+      i = pBuffer->iSize ? pBuffer->iSize : LNSZ;
+      while (pBuffer->iLength + l + 1 > i)
+         i *= 2;
+      p = realloc(pBuffer->p, i);
+      if (p)
+      {
+         pBuffer->p = p;
+         pBuffer->iSize = i;
+      }
+      else
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  CopyFd
+ *
+ *  Copy from the current offset of iFdR up to its end.  The kernel
+ *  does the copy when it can, otherwise a large aligned buffer is used.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CopyFd(const int iFdR, const int iFdW,     off_t *piCount)
+{
+   int      iErr = 0;
+   ssize_t  iCountR = 1,
+            iCountW;
+   char     *pBlock = NULL;
+
+
+   *piCount = 0;
+
+#ifdef PKGCACHE_COPY_FILE_RANGE
+   do
+   {
+      iCountR = copy_file_range(iFdR, NULL, iFdW, NULL, SSIZE_MAX, 0);
+      if (iCountR > 0)
+         *piCount += iCountR;
+   }
+   while (iCountR > 0) ;
+
+   // Fall back to read() and write() if the file systems don't support it
+   if (iCountR < 0)
+   {
+      if (!*piCount && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                        || errno == EBADF))
+         iCountR = 1;
+      else
+         iErr = ERROR_PKGCACHE_FILE_W;
+   }
+#endif
+
+   if (iCountR > 0)
+   {
+      if (posix_memalign((void **)&pBlock, getpagesize(), LNIOBLOCK))
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+   while (pBlock && !iErr && iCountR > 0)
+   {
+      iCountR = read(iFdR, pBlock, LNIOBLOCK);
+      if (iCountR > 0)
+      {
+         iCountW = write(iFdW, pBlock, iCountR);
+         if (iCountW == iCountR)
+            *piCount += iCountR;
+         else
+            iErr = ERROR_PKGCACHE_FILE_W;
+      }
+      else if (iCountR < 0)
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+
+   if (pBlock)
+      free(pBlock);
+
+   return(iErr);
+}
+
+
+/*
+ *  DirRemove
+ *
+ *  Remove a directory and everything below it.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DirRemove(const char *szPathname)
+{
+   int            iErr = 0;
+   DIR            *pDir;
+   FILENAME       sz;
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   pDir = opendir(szPathname);
+   if (pDir)
+   {
+      while (!iErr && (pEntry = readdir(pDir)))
+      {
+         if (strcmp(pEntry->d_name, ".") && strcmp(pEntry->d_name, ".."))
+         {
+            if (strlen(szPathname) + strlen(pEntry->d_name) + 2 > LNFILENAME)
+               iErr = ERROR_PKGCACHE_MEM;
+            else
+            {
+               sprintf(sz, "%s/%s", szPathname, pEntry->d_name);
+
+               // lstat() so that a link is removed, never followed
+               if (lstat(sz, &sPathStats))
+                  sPathStats.st_mode = 0;    // Already gone
+               if (S_ISDIR(sPathStats.st_mode))
+                  iErr = DirRemove(sz);
+               else if (unlink(sz) && errno != ENOENT)
+                  iErr = ERROR_PKGCACHE_FILE_W;
+            }
+         }
+      }
+      closedir(pDir);
+   }
+   if (!iErr && rmdir(szPathname) && errno != ENOENT)
+      iErr = ERROR_PKGCACHE_FILE_W;
+
+   return(iErr);
+}
+
+
+/*
+ *  DirWalk
+ *
+ *  Walk a directory tree, calling pFunc for each directory (before its
+ *  content) and each regular file.  Hidden entries are skipped since
+ *  they hold pkgcache's own files.  A directory for which pFunc returns
+ *  PKGCACHE_WALK_PRUNE is skipped.
+ *
+ *  Return: ERROR_PKGCACHE_xyz, or pFunc's non-zero result.
+ */
+
+int
+DirWalk(const char *szPathname, WALKFUNC pFunc, void *pData)
+{
+   int            i,
+                  iErr;
+   DIR            *pDir = NULL;
+   FILENAME       sz;
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   iErr = pFunc(szPathname, PKGCACHE_EXIST_DIR, pData);
+   if (!iErr)
+   {
+      pDir = opendir(szPathname);
+      if (!pDir)
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+   else if (iErr == PKGCACHE_WALK_PRUNE)
+      iErr = 0;
+   if (pDir)
+   {
+      i = strlen(szPathname);
+      while (!iErr && (pEntry = readdir(pDir)))
+      {
+         if (*(pEntry->d_name) != '.')
+         {
+            if (i + strlen(pEntry->d_name) + 2 > LNFILENAME)
+               iErr = ERROR_PKGCACHE_MEM;
+            else
+            {
+               if (i && szPathname[i-1] == '/')
+                  sprintf(sz, "%s%s", szPathname, pEntry->d_name);
+               else
+                  sprintf(sz, "%s/%s", szPathname, pEntry->d_name);
+
+               // stat() follows symbolic links on purpose
+               if (!stat(sz, &sPathStats))
+               {
+                  if (S_ISDIR(sPathStats.st_mode))
+                  {
+                     strcat(sz, "/");
+                     iErr = DirWalk(sz, pFunc, pData);
+                  }
+                  else if (S_ISREG(sPathStats.st_mode))
+                     iErr = pFunc(sz, PKGCACHE_EXIST_FILE, pData);
+               }
+            }
+         }
+      }
+
+      closedir(pDir);
+   }
+
+   return(iErr);
+}
+
+
 /*
  *  Exist
  *
@@ -63,6 +413,172 @@ printf("Exist(%s, %d) iBool=%d\n", szPathname, iPathType, iBool);
 }
 
 
+/*
+ *  IsDownloadAlwaysCmpInternal
+ *
+ *  Return: the strcmp() result.
+ */
+
+int
+IsDownloadAlwaysCmpInternal(const void *pFilename, const void *pEntry)
+{
+   return(strcmp(pFilename, *(char * const *)pEntry));
+}
+
+
+/*
+ *  IsDownloadAlways
+ *
+ *  Return: TRUE if identified.
+ */
+
+int
+IsDownloadAlways(const char *pFilename)
+{
+   return(bsearch(pFilename, PKGCACHE_DOWNLOAD_ALWAYS,
+                  LNPKGCACHE_DOWNLOAD_ALWAYS, sizeof(char *),
+                  IsDownloadAlwaysCmpInternal) != NULL);
+}
+
+
+/*
+ *  IsFilterMatchInt
+ *
+ *  Return: TRUE if match.
+ */
+
+int
+IsFilterMatchInt(const char *pUrl, const char *pFilter,     int *pI)
+{
+   int      i,
+            iBool = 0,
+            iBool2;
+   FILENAME sz;
+
+
+#ifdef PKGCACHE_VERBOSE
+printf("--> (%s %s %d)\n", pUrl, pFilter, *pI);
+#endif
+   if (!(pFilter[*pI]) || pFilter[*pI] == ')' || pFilter[*pI] == '&'
+       || pFilter[*pI] == '|')
+   {
+      // Error: Invalid expression
+      (*pI) = strlen(pFilter);
+   }
+   else if (pFilter[*pI] == '!')
+   {
+      // '!' operator handler (lower priority than '&' and '|')
+      (*pI)++;
+
+      i = 0;
+      iBool = !IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
+      (*pI) += i;
+   }
+   else if (pFilter[*pI] == '(')
+   {
+      // '( )' operator handler
+      (*pI)++;
+
+      i = 0;
+      iBool = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
+      (*pI) += i;
+      if (pFilter[*pI] == ')')
+      {
+         (*pI)++;
+
+         if (pFilter[*pI] == '&')
+         {
+            (*pI)++;
+
+            i = 0;
+            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
+            iBool = iBool && iBool2;
+            (*pI) += i;
+         }
+         else if (pFilter[*pI] == '|')
+         {
+            (*pI)++;
+
+            i = 0;
+            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
+            iBool = iBool || iBool2;
+            (*pI) += i;
+         }
+      }
+      else
+      {
+         // Error: Invalid expression
+         (*pI) = strlen(pFilter);
+      }
+   }
+   else
+   {
+      // String filter handler
+      i = 0;
+      while (pFilter[*pI] && pFilter[*pI] != '(' && pFilter[*pI] != ')'
+             && pFilter[*pI] != '!' && pFilter[*pI] != '&' && pFilter[*pI] != '|')
+      {
+         sz[i] = pFilter[*pI];
+         i++;
+         (*pI)++;
+      }
+      sz[i] = 0;
+      if (i)
+      {
+         iBool = strstr(pUrl, sz) != NULL;
+
+         if (pFilter[*pI] == '&')
+         {
+            (*pI)++;
+
+            i = 0;
+            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
+            iBool = iBool && iBool2;
+            (*pI) += i;
+         }
+         else if (pFilter[*pI] == '|')
+         {
+            (*pI)++;
+
+            i = 0;
+            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
+            iBool = iBool || iBool2;
+            (*pI) += i;
+         }
+      }
+   }
+#ifdef PKGCACHE_VERBOSE
+printf("<-- (%d) %d\n", *pI, iBool);
+#endif
+
+   return(iBool);
+}
+
+
+/*
+ *  IsFilterMatch
+ *
+ *  Return: TRUE if match.
+ */
+
+int
+IsFilterMatch(const char *pUrl, const char *pFilter)
+{
+   int   i = 0,
+         iBool = 1;
+
+
+   if (strlen(pFilter))
+   {
+      iBool = IsFilterMatchInt(pUrl, pFilter,     &i);
+      if (iBool)
+         iBool = !(pFilter[i]);
+   }
+
+   return(iBool);
+}
+
+
 /*
  *  MakePath
  *
@@ -73,37 +589,50 @@ int
 MakePath(const char *szPathname)
 {
    int      i,
-            iErr = 0;
-   char     *p;
+            iErr = 0,
+            iExist;
+   char     c,
+            *p;
    FILENAME szSubPath;
 
 
    if (!Exist(szPathname, PKGCACHE_EXIST_DIR))
    {
       i = strlen(szPathname);
-      if (i > 1 && i < LNSZ)
+      if (i > 1 && i < LNFILENAME)
       {
+         // Go up to the deepest existing directory...
          strcpy(szSubPath, szPathname);
-         p = szSubPath + i - 1;
-         i--;   // To skip the last '/'
+         p = szSubPath + i - 1;   // To skip the last '/'
          do
          {
-            i--;
-            p--;
+            do
+               p--;
+            while (*p != '/' && p > szSubPath) ;
+
+            c = *(p + 1);
+            *(p + 1) = 0;
+            iExist = (*p != '/' || p == szSubPath
+                      || Exist(szSubPath, PKGCACHE_EXIST_DIR));
+            *(p + 1) = c;
          }
-         while (*p != '/' && i) ;
+         while (!iExist) ;
 
+         // ...then create the missing ones going down.
          if (*p == '/')
          {
-            p++;
-            *p = 0;
-            
-            iErr = MakePath(szSubPath);
-            if (!iErr)
+            while (!iErr && (p = strchr(p + 1, '/')) && *(p + 1))
             {
-               if (mkdir(szPathname, 0775))
+               c = *(p + 1);
+               *(p + 1) = 0;
+
+               // Another thread may have just created it
+               if (mkdir(szSubPath, 0775) && errno != EEXIST)
                   iErr = ERROR_PKGCACHE_ACCESS;
+               *(p + 1) = c;
             }
+            if (!iErr && mkdir(szPathname, 0775) && errno != EEXIST)
+               iErr = ERROR_PKGCACHE_ACCESS;
          }
          else
             iErr = ERROR_PKGCACHE_ACCESS;
@@ -116,6 +645,76 @@ MakePath(const char *szPathname)
 }
 
 
+/*
+ *  Sha256Final
+ *
+ *  Finish the digest as a hex string, and free it.  Called once for
+ *  each Sha256Init, even after an error.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+Sha256Final(SHA256SUM *pSum,     char *szSum)
+{
+   int            i,
+                  iErr = ERROR_PKGCACHE_MEM;
+   unsigned int   iDigest;
+   unsigned char  digest[EVP_MAX_MD_SIZE];
+
+
+   *szSum = 0;
+   if (pSum->pCtx)
+   {
+      if (EVP_DigestFinal_ex(pSum->pCtx, digest, &iDigest)
+          && iDigest * 2 < LNSHA256SUM)
+      {
+         for (i = 0 ; i < iDigest ; i++)
+            sprintf(szSum + i * 2, "%02x", digest[i]);
+         iErr = 0;
+      }
+      EVP_MD_CTX_free(pSum->pCtx);
+      pSum->pCtx = NULL;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  Sha256Init
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+Sha256Init(SHA256SUM *pSum)
+{
+   int iErr = 0;
+
+
+   pSum->pCtx = EVP_MD_CTX_new();
+   if (!(pSum->pCtx) || !EVP_DigestInit_ex(pSum->pCtx, EVP_sha256(), NULL))
+      iErr = ERROR_PKGCACHE_MEM;
+
+   return(iErr);
+}
+
+
+/*
+ *  Sha256Update
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+Sha256Update(SHA256SUM *pSum, const void *pData, const size_t l)
+{
+   return((pSum->pCtx && EVP_DigestUpdate(pSum->pCtx, pData, l))
+          ? 0 : ERROR_PKGCACHE_MEM);
+}
+
+
 /*
  *  StrnCopy
  */
@@ -167,3 +766,265 @@ StrReplace(char *dst, const char *before, const char after)
    dst[iWrite] = 0;
 }
 
+
+
+/*
+ *  StrSetFindInternal
+ *
+ *  Return: TRUE if found.  pIndex receives the position where the
+ *          string is, or where it should be inserted.
+ */
+
+int
+StrSetFindInternal(STRSET *pSet, const char *sz,     int *pIndex)
+{
+   int   iBool = 0,
+         iCmp,
+         iMax,
+         iMid,
+         iMin = 0;
+
+
+   iMax = pSet->iCount - 1;
+   while (iMin <= iMax && !iBool)
+   {
+      iMid = (iMin + iMax) / 2;
+      iCmp = strcmp(pSet->ppStr[iMid], sz);
+      if (iCmp < 0)
+         iMin = iMid + 1;
+      else if (iCmp > 0)
+         iMax = iMid - 1;
+      else
+      {
+         iMin = iMid;
+         iBool = 1;
+      }
+   }
+
+   *pIndex = iMin;
+
+   return(iBool);
+}
+
+
+/*
+ *  StrSetAdd
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+StrSetAdd(STRSET *pSet, const char *sz)
+{
+   int   i,
+         iErr = 0,
+         iIndex;
+   char  *p,
+         **pp;
+
+
+   if (!StrSetFindInternal(pSet, sz,     &iIndex))
+   {
+      // Enough space?
+      if (pSet->iCount == pSet->iSize)
+      {
+         i = pSet->iSize ? pSet->iSize * 2 : 64;
+         pp = realloc(pSet->ppStr, sizeof(char *) * i);
+         if (pp)
+         {
+            pSet->ppStr = pp;
+            pSet->iSize = i;
+         }
+         else
+            iErr = ERROR_PKGCACHE_MEM;
+      }
+
+      if (!iErr)
+      {
+         p = strdup(sz);
+         if (p)
+         {
+            memmove(pSet->ppStr + iIndex + 1, pSet->ppStr + iIndex,
+                    sizeof(char *) * (pSet->iCount - iIndex));
+            pSet->ppStr[iIndex] = p;
+            pSet->iCount++;
+         }
+         else
+            iErr = ERROR_PKGCACHE_MEM;
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  StrSetClear
+ */
+
+void
+StrSetClear(STRSET *pSet)
+{
+   int i;
+
+
+   for (i = 0 ; i < pSet->iCount ; i++)
+      free(pSet->ppStr[i]);
+   if (pSet->ppStr)
+      free(pSet->ppStr);
+
+   pSet->iCount = 0;
+   pSet->iSize = 0;
+   pSet->ppStr = NULL;
+}
+
+
+/*
+ *  StrSetIsFound
+ *
+ *  Return: TRUE if found.
+ */
+
+int
+StrSetIsFound(STRSET *pSet, const char *sz)
+{
+   int iIndex;
+
+
+   return(StrSetFindInternal(pSet, sz,     &iIndex));
+}
+
+
+/*
+ *  VersionComponentInternal
+ *
+ *  Parse a component of a version: a number, or a letter or word with
+ *  an optional number, like "rc1".  A letter right after a number
+ *  starts a new component, so "1.0a" is 1.0.a.  The missing parts are
+ *  -1, so a component is newer than none, except the pre-release
+ *  words: 1.0a > 1.0 > 1.0rc1 > 1.0beta2.
+ *
+ *  Return: The position after the component and its separators.
+ */
+
+const char *
+VersionComponentInternal(const char *p, const char *pEnd,
+                            long long *piNumber, int *piAlpha,
+                            long long *piPatch)
+{
+   int         i;
+   static const char *szWords[] = {"alpha", "beta", "pl", "pre", "rc"};
+   static const int  iWords[] = {-4, -3, 27, -2, -1};
+
+
+   *piNumber = -1;
+   *piAlpha = 0;
+   *piPatch = -1;
+
+   if (p < pEnd && isdigit(*p))
+   {
+      *piNumber = 0;
+      while (p < pEnd && isdigit(*p))
+         *piNumber = *piNumber * 10 + (*p++ - '0');
+   }
+   else if (p < pEnd && *p == '*')
+   {
+      *piNumber = -2;
+      p++;
+   }
+   else if (p < pEnd && isalpha(*p))
+   {
+      for (i = 0 ; i < 5 ; i++)
+      {
+         if (!strncasecmp(p, szWords[i], strlen(szWords[i]))
+             && !isalpha(p[strlen(szWords[i])]))
+            break;
+      }
+      if (i < 5)
+      {
+         *piAlpha = iWords[i];
+         p += strlen(szWords[i]);
+      }
+      else
+      {
+         *piAlpha = tolower(*p) - 'a' + 1;
+         while (p < pEnd && isalpha(*p))
+            p++;
+      }
+
+      if (p < pEnd && isdigit(*p))
+      {
+         *piPatch = 0;
+         while (p < pEnd && isdigit(*p))
+            *piPatch = *piPatch * 10 + (*p++ - '0');
+      }
+   }
+
+   while (p < pEnd && !isalnum(*p) && *p != '*')
+      p++;
+
+   return(p);
+}
+
+
+/*
+ *  VersionCompare
+ *
+ *  Compare two package versions the way pkg does: the epoch after the
+ *  ',' first, then the dot separated components, then the port
+ *  revision after the '_'.  For instance, 1.10 > 1.9, 2.0 > 2.0rc1,
+ *  1.0_1 > 1.0 and 1.0,1 > 2.0.
+ *
+ *  Return: < 0, 0 or > 0 like strcmp().
+ */
+
+int
+VersionCompare(const char *szVersion1, const char *szVersion2)
+{
+   int         i,
+               iAlpha[2],
+               iRet = 0;
+   long long   iNumber[2],
+               iPatch[2];
+   long        iEpoch[2],
+               iRevision[2];
+   const char  *p,
+               *pEnd[2],
+               *pVersion[2];
+
+
+   pVersion[0] = szVersion1;
+   pVersion[1] = szVersion2;
+   for (i = 0 ; i < 2 ; i++)
+   {
+      pEnd[i] = pVersion[i] + strlen(pVersion[i]);
+      p = strrchr(pVersion[i], '_');
+      iRevision[i] = p ? strtol(p + 1, NULL, 10) : 0;
+      if (p)
+         pEnd[i] = p;
+      p = strrchr(p ? p : pVersion[i], ',');
+      iEpoch[i] = p ? strtol(p + 1, NULL, 10) : 0;
+      if (p && p < pEnd[i])
+         pEnd[i] = p;
+   }
+
+   if (iEpoch[0] != iEpoch[1])
+      iRet = (iEpoch[0] < iEpoch[1]) ? -1 : 1;
+   while (!iRet && (pVersion[0] < pEnd[0] || pVersion[1] < pEnd[1]))
+   {
+      for (i = 0 ; i < 2 ; i++)
+         pVersion[i] = VersionComponentInternal(pVersion[i], pEnd[i],
+                                                   iNumber + i, iAlpha + i,
+                                                   iPatch + i);
+      if (iNumber[0] != iNumber[1])
+         iRet = (iNumber[0] < iNumber[1]) ? -1 : 1;
+      else if (iAlpha[0] != iAlpha[1])
+         iRet = (iAlpha[0] < iAlpha[1]) ? -1 : 1;
+      else if (iPatch[0] != iPatch[1])
+         iRet = (iPatch[0] < iPatch[1]) ? -1 : 1;
+   }
+   if (!iRet && iRevision[0] != iRevision[1])
+      iRet = (iRevision[0] < iRevision[1]) ? -1 : 1;
+
+   return(iRet);
+}
@@ -29,18 +29,25 @@
 #ifndef PKGCACHE_COMMON_H
 #define PKGCACHE_COMMON_H
 
+#include <sys/param.h>
+#include <sys/types.h>
+
 
 /*
  *  Constants
  */
 
 #define LNFILENAME               1028
+#define LNIOBLOCK                (256*1024)
+#define LNIOCHUNK                (16*1024)      // Of a network read
 #define LNSZ                     500
 
 #define PKGCACHE_EXIST_ANY       0
 #define PKGCACHE_EXIST_FILE      1
 #define PKGCACHE_EXIST_DIR       2
 
+#define PKGCACHE_WALK_PRUNE      (-1)
+
 #define ERROR_PKGCACHE_ACCESS    1
 #define ERROR_PKGCACHE_CMD       2
 #define ERROR_PKGCACHE_FILE_R    3
@@ -50,10 +57,23 @@
 #define ERROR_PKGCACHE_NO_EOH    7
 #define ERROR_PKGCACHE_REPO      8
 #define ERROR_PKGCACHE_TEMP      9
+#define ERROR_PKGCACHE_KEY       10
+#define ERROR_PKGCACHE_SERVE     11
+#define ERROR_PKGCACHE_VERIFY    12
+#define ERROR_PKGCACHE_SNAPSHOT  13
 
 // Remove comment to PKGCACHE_VERBOSE to have verbose debug output
 // #define PKGCACHE_VERBOSE         1
 
+// copy_file_range() first appeared in FreeBSD 13.0
+#if defined(__FreeBSD_version) && __FreeBSD_version >= 1300037
+#define PKGCACHE_COPY_FILE_RANGE 1
+#endif
+
+#define LNARENABLOCK             (64*1024)
+
+#define LNSHA256SUM              65       // Hex digest and NUL
+
 
 /*
  *  Types
@@ -61,15 +81,72 @@
 
 typedef char FILENAME[LNFILENAME];
 
+// Allocations freed all at once, the data follows each block header.
+typedef struct ARENABLOCK
+{
+   size_t            iSize,
+                     iUsed;
+   struct ARENABLOCK *pNext;
+} ARENABLOCK;
+
+typedef struct
+{
+   ARENABLOCK  *pBlocks;
+} ARENA;
+
+typedef struct
+{
+   char     *p;
+   size_t   iLength,
+            iSize;
+} BUFFER;
+
+typedef struct
+{
+   int   iCount,
+         iSize;
+   char  **ppStr;
+} STRSET;
+
+// SHA-256 digest in progress, an EVP_MD_CTX
+typedef struct
+{
+   void  *pCtx;
+} SHA256SUM;
+
+// Directory walk callback, iPathType is PKGCACHE_EXIST_FILE or _DIR.
+// Returning non-zero stops the walk and becomes the walk's result,
+// except PKGCACHE_WALK_PRUNE which only skips a directory's content.
+typedef int (*WALKFUNC)(const char *szPathname, const int iPathType,
+                        void *pData);
+
 
 /*
  *  Prototypes
  */
 
+void *ArenaAlloc(ARENA *pArena, const size_t l);
+void ArenaFree(ARENA *pArena);
+int  BufferAppend(BUFFER *pBuffer, const void *pData, const size_t l);
+int  BufferAppendStr(BUFFER *pBuffer, const char *sz);
+void BufferFree(BUFFER *pBuffer);
+int  BufferReserve(BUFFER *pBuffer, const size_t l);
+int  CopyFd(const int iFdR, const int iFdW,     off_t *piCount);
+int  DirRemove(const char *szPathname);
+int  DirWalk(const char *szPathname, WALKFUNC pFunc, void *pData);
 int  Exist(const char *szPathname, const int iPathType);
+int  IsDownloadAlways(const char *pFilename);
+int  IsFilterMatch(const char *pUrl, const char *pFilter);
 int  MakePath(const char *szPathname);
+int  Sha256Final(SHA256SUM *pSum,     char *szSum);
+int  Sha256Init(SHA256SUM *pSum);
+int  Sha256Update(SHA256SUM *pSum, const void *pData, const size_t l);
 void StrnCopy(char *dst, const char *src, const int l);
 void StrReplace(char *dst, const char *before, const char after);
+int  StrSetAdd(STRSET *pSet, const char *sz);
+void StrSetClear(STRSET *pSet);
+int  StrSetIsFound(STRSET *pSet, const char *sz);
+int  VersionCompare(const char *szVersion1, const char *szVersion2);
 
 
 #endif  // PKGCACHE_COMMON_H
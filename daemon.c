@@ -0,0 +1,450 @@
+/* 
+ * File:    daemon.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Daemon mode. Tested under FreeBSD 11.2.
+ *
+ *          The daemon keeps the process, and what it holds in memory,
+ *          from one synchronization to the next: the package list, the
+ *          packages whose dependencies were checked, the directory
+ *          listings...  A synchronization runs every -interval minutes,
+ *          and when asked for on the control socket, a Unix domain
+ *          socket taking one request per connection, one line each:
+ *            sync             : Synchronize now, or once the running
+ *                               synchronization is over.
+ *            add <name>...    : Add package names to the package list.
+ *            status           : The state, last and next
+ *                               synchronizations.
+ *            quit             : Quit, once the running synchronization
+ *                               is over.
+ *          The reply's first line starts with OK or ERROR.  For
+ *          example: echo sync | nc -U .pkgcachectl
+ *          The synchronizations run in their own thread, so the control
+ *          socket keeps answering meanwhile.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "daemon.h"
+#include "list.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_DAEMON_BACKLOG     8
+#define PKGCACHE_DAEMON_TIMEOUT     5       // Sec., to send a request
+#define PKGCACHE_DAEMON_TIMER       1       // kevent idents
+#define PKGCACHE_DAEMON_USER        1
+
+#define LNDAEMONEVENTS              8
+
+
+/*
+ *  Object variables
+ */
+
+// Set by the synchronization thread, read once it's joined
+int         giDaemonKq = -1,
+            giDaemonThreadErr = 0;
+time_t      giDaemonThreadLast = 0;
+
+// Only used by the main thread, which copies the thread's results so
+// that a status request never reads them while they're written
+int         giDaemonAgain = 0,
+            giDaemonErr = 0,
+            giDaemonInterval = 0,
+            giDaemonRunning = 0,
+            giDaemonSyncs = 0;
+time_t      giDaemonLast = 0,
+            giDaemonNext = 0,
+            giDaemonStart = 0;
+void        *gpDaemonData = NULL;
+DAEMONFUNC  gpDaemonSync = NULL;
+pthread_t   gsDaemonThread;
+
+
+/*
+ *  DaemonThreadInternal
+ *
+ *  Run one synchronization, then wake the main thread up.
+ */
+
+void *
+DaemonThreadInternal(void *pData)
+{
+   struct kevent  sEvent;
+
+
+   giDaemonThreadErr = gpDaemonSync(gpDaemonData);
+   giDaemonThreadLast = time(NULL);
+
+   EV_SET(&sEvent, PKGCACHE_DAEMON_USER, EVFILT_USER, 0, NOTE_TRIGGER, 0,
+          NULL);
+   kevent(giDaemonKq, &sEvent, 1, NULL, 0, NULL);
+
+   return(NULL);
+}
+
+
+/*
+ *  DaemonSyncInternal
+ *
+ *  Start a synchronization, or another one once the running one is
+ *  over.
+ *
+ *  Return: TRUE if started now
+ */
+
+int
+DaemonSyncInternal(void)
+{
+   int   iRet = 0;
+
+
+   if (giDaemonRunning)
+      giDaemonAgain = 1;
+   else if (!pthread_create(&gsDaemonThread, NULL, DaemonThreadInternal,
+                            NULL))
+   {
+      giDaemonAgain = 0;
+      giDaemonRunning = 1;
+      giDaemonStart = time(NULL);
+      iRet = 1;
+   }
+   else
+      printf("ERROR: Can't start the synchronization!\n");
+
+   return(iRet);
+}
+
+
+/*
+ *  DaemonRequestInternal
+ *
+ *  Answer the request of a control connection.
+ *
+ *  Return: TRUE if asked to quit
+ */
+
+int
+DaemonRequestInternal(const int iFd, const char *szPkglistFilename)
+{
+   int            iErr = 0,
+                  iNew,
+                  iQuit = 0;
+   char           *p,
+                  *pName,
+                  sz[LNSZ];
+   ssize_t        l = 0,
+                  lRead;
+   struct timeval sTimeout;
+   BUFFER         sReply = {NULL, 0, 0};
+
+
+   // One line, with a short timeout since the daemon waits for it
+   sTimeout.tv_sec = PKGCACHE_DAEMON_TIMEOUT;
+   sTimeout.tv_usec = 0;
+   setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+   setsockopt(iFd, SOL_SOCKET, SO_SNDTIMEO, &sTimeout, sizeof(sTimeout));
+   do
+   {
+      lRead = read(iFd, sz + l, LNSZ - 1 - l);
+      if (lRead > 0)
+         l += lRead;
+      sz[l] = 0;
+   }
+   while (lRead > 0 && !strchr(sz, '\n') && l < LNSZ - 1) ;
+   p = strpbrk(sz, "\r\n");
+   if (p)
+      *p = 0;
+   p = sz;
+   pName = strsep(&p, " \t");
+
+   if (!strcmp(pName, "sync"))
+   {
+      if (DaemonSyncInternal())
+         iErr = BufferAppendStr(&sReply, "OK Synchronization started.\n");
+      else if (giDaemonRunning)
+         iErr = BufferAppendStr(&sReply, "OK Synchronization queued.\n");
+      else
+         iErr = BufferAppendStr(&sReply, "ERROR Can't synchronize.\n");
+   }
+   else if (!strcmp(pName, "add"))
+   {
+      iNew = ListGetStatNew();
+      while (!iErr && p && (pName = strsep(&p, " \t")))
+      {
+         if (*pName)
+            iErr = ListAdd(pName);
+      }
+
+      // A running synchronization saves the list once it's over
+      if (!iErr && !giDaemonRunning)
+         iErr = ListSave((char *)szPkglistFilename);
+      if (iErr)
+         sprintf(sz, "ERROR # %d\n", iErr);
+      else
+         sprintf(sz, "OK %d package(s) added.\n", ListGetStatNew() - iNew);
+      iErr = BufferAppendStr(&sReply, sz);
+   }
+   else if (!strcmp(pName, "status"))
+   {
+      if (giDaemonRunning)
+      {
+         strftime(sz, LNSZ, "OK Synchronizing since %Y-%m-%d %H:%M:%S.\n",
+                  localtime(&giDaemonStart));
+         iErr = BufferAppendStr(&sReply, sz);
+      }
+      else
+         iErr = BufferAppendStr(&sReply, "OK Idle.\n");
+      if (!iErr && giDaemonSyncs)
+      {
+         strftime(sz, LNSZ, "Last synchronization: %Y-%m-%d %H:%M:%S",
+                  localtime(&giDaemonLast));
+         iErr = BufferAppendStr(&sReply, sz);
+         sprintf(sz, giDaemonErr ? ", ERROR # %d.\n" : ", OK.\n",
+                 giDaemonErr);
+         if (!iErr)
+            iErr = BufferAppendStr(&sReply, sz);
+      }
+      if (!iErr && giDaemonInterval)
+      {
+         strftime(sz, LNSZ, "Next synchronization: %Y-%m-%d %H:%M:%S.\n",
+                  localtime(&giDaemonNext));
+         iErr = BufferAppendStr(&sReply, sz);
+      }
+      if (!iErr)
+      {
+         sprintf(sz, "Synchronizations: %d, packages: %d new, %d existing.\n",
+                 giDaemonSyncs, ListGetStatNew(), ListGetStatExisting());
+         iErr = BufferAppendStr(&sReply, sz);
+      }
+   }
+   else if (!strcmp(pName, "quit"))
+   {
+      iErr = BufferAppendStr(&sReply, giDaemonRunning
+                             ? "OK Quitting once synchronized.\n"
+                             : "OK Quitting.\n");
+      iQuit = 1;
+   }
+   else
+      iErr = BufferAppendStr(&sReply, "ERROR Unknown request.\n");
+
+   if (!iErr && write(iFd, sReply.p, sReply.iLength) < 0)
+      iErr = ERROR_PKGCACHE_FILE_W;
+   BufferFree(&sReply);
+
+#ifdef PKGCACHE_VERBOSE
+printf("DaemonRequestInternal(%s): iErr=%d\n", sz, iErr);
+#endif
+
+   return(iQuit);
+}
+
+
+/*
+ *  DaemonListenInternal
+ *
+ *  Return: the socket, or -1.
+ */
+
+int
+DaemonListenInternal(const char *szControlPathname)
+{
+   int                  iFd = -1;
+   struct sockaddr_un   sAddress;
+
+
+   memset(&sAddress, 0, sizeof(sAddress));
+   sAddress.sun_family = AF_UNIX;
+   if (strlen(szControlPathname) < sizeof(sAddress.sun_path))
+   {
+      strcpy(sAddress.sun_path, szControlPathname);
+      iFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   }
+   if (iFd >= 0)
+   {
+      // Left behind by a daemon that didn't quit
+      unlink(szControlPathname);
+      if (bind(iFd, (struct sockaddr *)&sAddress, sizeof(sAddress))
+          || chmod(szControlPathname, 0600)
+          || listen(iFd, PKGCACHE_DAEMON_BACKLOG))
+      {
+         close(iFd);
+         iFd = -1;
+      }
+   }
+
+   return(iFd);
+}
+
+
+/*
+ *  DaemonRun
+ *
+ *  Run pSync now, then every iInterval minutes, 0 for never, and when
+ *  asked for on the control socket, until SIGINT, SIGTERM or a quit
+ *  request.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DaemonRun(const char *szControlPathname, const char *szPkglistFilename,
+          const int iInterval, DAEMONFUNC pSync, void *pData)
+{
+   int            i,
+                  iCount,
+                  iErr = 0,
+                  iFd,
+                  iFdListen = -1,
+                  iStop = 0;
+   struct kevent  sEvent,
+                  events[LNDAEMONEVENTS];
+
+
+   signal(SIGPIPE, SIG_IGN);
+   signal(SIGINT, SIG_IGN);
+   signal(SIGTERM, SIG_IGN);
+
+   gpDaemonSync = pSync;
+   gpDaemonData = pData;
+   giDaemonInterval = iInterval;
+
+   iFdListen = DaemonListenInternal(szControlPathname);
+   if (iFdListen < 0)
+      iErr = ERROR_PKGCACHE_SERVE;
+   if (!iErr)
+   {
+      giDaemonKq = kqueue();
+      if (giDaemonKq < 0)
+         iErr = ERROR_PKGCACHE_SERVE;
+   }
+   if (!iErr)
+   {
+      EV_SET(&sEvent, iFdListen, EVFILT_READ, EV_ADD, 0, 0, NULL);
+      iCount = kevent(giDaemonKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      iCount |= kevent(giDaemonKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      iCount |= kevent(giDaemonKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, PKGCACHE_DAEMON_USER, EVFILT_USER, EV_ADD | EV_CLEAR,
+             0, 0, NULL);
+      iCount |= kevent(giDaemonKq, &sEvent, 1, NULL, 0, NULL);
+      if (iInterval)
+      {
+         // In milliseconds
+         EV_SET(&sEvent, PKGCACHE_DAEMON_TIMER, EVFILT_TIMER, EV_ADD, 0,
+                (int64_t)iInterval * 60000, NULL);
+         iCount |= kevent(giDaemonKq, &sEvent, 1, NULL, 0, NULL);
+      }
+      if (iCount < 0)
+         iErr = ERROR_PKGCACHE_SERVE;
+   }
+
+   if (!iErr)
+   {
+      printf("Daemon controlled by %s, interrupt to quit.\n",
+             szControlPathname);
+      giDaemonNext = time(NULL) + iInterval * 60;
+      DaemonSyncInternal();
+   }
+   while (!iErr && !iStop)
+   {
+      iCount = kevent(giDaemonKq, NULL, 0, events, LNDAEMONEVENTS, NULL);
+      if (iCount < 0 && errno != EINTR)
+         iErr = ERROR_PKGCACHE_SERVE;
+      for (i = 0 ; i < iCount ; i++)
+      {
+         if (events[i].filter == EVFILT_SIGNAL)
+            iStop = 1;
+         else if (events[i].filter == EVFILT_TIMER)
+         {
+            // A synchronization still running is enough
+            giDaemonNext = time(NULL) + iInterval * 60;
+            if (!giDaemonRunning)
+               DaemonSyncInternal();
+         }
+         else if (events[i].filter == EVFILT_USER)
+         {
+            pthread_join(gsDaemonThread, NULL);
+            giDaemonRunning = 0;
+            giDaemonErr = giDaemonThreadErr;
+            giDaemonLast = giDaemonThreadLast;
+            giDaemonSyncs++;
+            if (giDaemonErr)
+               printf("ERROR # %d, synchronization failed.\n\n", giDaemonErr);
+            if (giDaemonAgain)
+               DaemonSyncInternal();
+         }
+         else
+         {
+            iFd = accept(iFdListen, NULL, NULL);
+            if (iFd >= 0)
+            {
+               if (DaemonRequestInternal(iFd, szPkglistFilename))
+                  iStop = 1;
+               close(iFd);
+            }
+         }
+      }
+   }
+
+   // Done!  The synchronization in progress is never interrupted.
+   if (giDaemonRunning)
+   {
+      printf("Waiting for the synchronization in progress...\n");
+      pthread_join(gsDaemonThread, NULL);
+      giDaemonRunning = 0;
+   }
+   if (giDaemonKq >= 0)
+      close(giDaemonKq);
+   giDaemonKq = -1;
+   if (iFdListen >= 0)
+   {
+      close(iFdListen);
+      unlink(szControlPathname);
+   }
+
+   signal(SIGINT, SIG_DFL);
+   signal(SIGTERM, SIG_DFL);
+
+   return(iErr);
+}
@@ -0,0 +1,2388 @@
+/* 
+ * File:    download.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Repository download. Tested under FreeBSD 11.2.
+ *
+ *          The repository is browsed one directory listing at a time.
+ *          The matching subdirectories found in a listing are queued as
+ *          jobs, which are handled by a pool of threads, so that the
+ *          trees matched by the navigation filter (several ABIs,
+ *          branches, releases...) are synchronized concurrently.  The
+ *          package list and the set of packages whose dependencies
+ *          were already checked are shared by all the jobs.
+ *
+ *          When a listing holds the 'packagesite.txz' catalog, the
+ *          package files are taken from the "repopath" of its entries
+ *          and queued as jobs directly, and the directories they are in
+ *          are not browsed.  The other directories are still browsed.
+ *
+ *          The metadata files of a listing are downloaded right away,
+ *          its package files are queued.  The queue is a priority heap:
+ *          the listings come first, then the package files by
+ *          decreasing catalog "pkgsize", then the files of unknown
+ *          size in the order they were found.
+ *
+ *          The jobs only hold a relative path, linked to the path of
+ *          its parent directory and made of interned segments.  The
+ *          paths, segments and jobs are allocated from an arena freed
+ *          at the end of the run.
+ *
+ *          The files are written relative to the descriptor of their
+ *          directory, with openat(2) and renameat(2).  A directory is
+ *          created and opened once, below its parent's descriptor, and
+ *          its descriptor is kept in a hash table until the end of the
+ *          run, so the pathnames aren't looked up again for each file.
+ *
+ *          The listings are asked for compressed, see http.c.  With a
+ *          file:// URL, the listings are made from the local
+ *          directories, and the files are copied by the kernel, or
+ *          hard linked by an IMPORT.
+ *
+ *          A file already in the cache is only transferred again if
+ *          modified since, with an If-Modified-Since request, and a
+ *          downloaded file gets the modification time of the server's.
+ *          With DownloadListings, the listings are kept in memory from
+ *          one run to the next, so an unchanged listing is read from
+ *          there.
+ *
+ *          The RESCAN command doesn't use the network: the manifests of
+ *          the cached packages are checked by one thread per CPU.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fetch.h>
+
+#include "catalog.h"
+#include "common.h"
+#include "download.h"
+#include "http.h"
+#include "journal.h"
+#include "list.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "throttle.h"
+#include "watch.h"
+
+
+/*
+ *  Constants
+ */
+
+#define LNBLOCK                     2048
+
+#define PKGCACHE_URL_FILE           "file://"
+#define LNPKGCACHE_URL_FILE         7
+
+#define PKGCACHE_TEMP_FILENAME      ".pkgcachetemp"
+
+#define PKGCACHE_DOWNLOAD_UNCHANGED (-1)    // Not an error, nothing fetched
+
+#define PKGCACHE_DOWNLOAD_SEGMENTS  1024    // Hash buckets, a power of 2
+
+#define PKGCACHE_DEPS_DEFAULT       0b000000
+#define PKGCACHE_DEPS_QUOTE         0b000001
+
+#define PKGCACHE_HTML_DEFAULT       0b0000000
+#define PKGCACHE_HTML_QUOTE         0b0000001
+#define PKGCACHE_HTML_TAG           0b0000010
+#define PKGCACHE_HTML_TAGQUOTE      0b0000011
+#define PKGCACHE_HTML_HREF          0b0000111
+#define PKGCACHE_HTML_ATAG          0b0001010
+#define PKGCACHE_HTML_ATAGQUOTE     0b0001011
+#define PKGCACHE_HTML_BEGINTAG      0b0010010
+#define PKGCACHE_HTML_CLOSETAG      0b0100010
+#define PKGCACHE_HTML_EOH           0b1000000
+
+
+/*
+ *  Types
+ */
+
+// Relative path, shared by the paths below it.  Both the URL and the
+// local pathname are made of the same relative path.
+typedef struct PATH
+{
+   int               iLength;       // Of the whole relative path
+   const char        *szSegment;    // Interned
+   const struct PATH *pParent;
+} PATH;
+
+typedef struct SEGMENT
+{
+   struct SEGMENT    *pNext;
+   char              sz[];
+} SEGMENT;
+
+typedef struct DIRFD
+{
+   struct DIRFD      *pNext;
+   int               iFd;
+   char              sz[];          // Relative path of the directory
+} DIRFD;
+
+// Directory listing kept from one run to the next
+typedef struct LISTING
+{
+   struct LISTING    *pNext;
+   time_t            iModified;
+   BUFFER            sBody;
+   char              szUrl[];
+} LISTING;
+
+typedef struct JOB
+{
+   int         iFile,         // Else a directory listing
+               iSequence;     // Queue order, among equals
+   off_t       iSize;         // Of the file, -1 if unknown
+   const PATH  *pPath;
+} JOB;
+
+typedef struct PLANFILE
+{
+   off_t       iSize;         // -1 if unknown
+   char        *szRepopath;
+} PLANFILE;
+
+typedef struct PLAN
+{
+   STRSET      sDirs;         // Directories described by the catalog
+   BUFFER      sFiles;        // PLANFILEs of the package files to download
+} PLAN;
+
+
+/*
+ *  Object variables
+ */
+
+int               giDownloadBusy = 0,
+                  giDownloadErr = 0,
+                  giDownloadKeep = PKGCACHE_DOWNLOAD_KEEP,
+                  giDownloadLink = 0,     // See DownloadImport
+                  giDownloadNext = 0;    // Next package to rescan
+const char        *gszDownloadNavFilter = "",
+                  *gszDownloadPathFilter = "";
+JOB               **gppDownloadJobs = NULL;   // Heap, see DownloadJobInternal
+int               giDownloadJobs = 0,
+                  giDownloadJobsSize = 0,
+                  giDownloadSequence = 0;
+STRSET            gsDownloadChecked = {0, 0, NULL};
+pthread_cond_t    gsDownloadCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t   gsDownloadMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Paths, segments, directories and jobs of the run, protected by
+// gsDownloadMutex
+const char        *gszDownloadPathname = "",
+                  *gszDownloadUrl = "";
+int               giDownloadDirFd = -1;
+ARENA             gsDownloadArena = {NULL};
+DIRFD             *gpDownloadDirs[PKGCACHE_DOWNLOAD_SEGMENTS];
+SEGMENT           *gpDownloadSegments[PKGCACHE_DOWNLOAD_SEGMENTS];
+
+// Listings kept by DownloadListings, protected by gsDownloadListingMutex
+int               giDownloadListings = 0;
+LISTING           *gpDownloadListings[PKGCACHE_DOWNLOAD_SEGMENTS];
+pthread_mutex_t   gsDownloadListingMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ *  GetDepsEntry
+ *
+ *  Return: TRUE if found
+ */
+
+int
+GetDepsString(const la_ssize_t iCountR, char *pBlock,
+                  int *piBlock, int *piState, int *pLevel, char *pSz)
+{
+   int   iBool = 0,
+         iOut;
+   char  *pIn,
+         *pOut;
+
+
+   pIn = pBlock + *piBlock;
+   iOut = strlen(pSz);
+   pOut = pSz + iOut;
+   while (*piBlock < iCountR && !iBool)
+   {
+      if (*piState == PKGCACHE_DEPS_QUOTE)
+      {
+         if (*pIn == '"')     // This is the end-quote
+         {
+            iBool = 1;
+            *piState = PKGCACHE_DEPS_DEFAULT;
+         }
+         else
+         {
+            *pOut = *pIn;
+            iOut++;
+            pOut++;
+            if (iOut >= LNSZ-1)
+               iBool = 1;     // Too long!  Trunk and return it!
+         }
+      }
+      else if (*pIn == '"')
+         *piState = PKGCACHE_DEPS_QUOTE;
+      else if (*pIn == '{')
+         (*pLevel)++;
+      else if (*pIn == '}')
+         (*pLevel)--;
+
+      pIn++;
+      (*piBlock)++;
+   }
+
+   if (*piBlock >= iCountR)
+      *piBlock = 0;
+
+   *pOut = 0;
+
+   return(iBool);
+}
+
+
+/*
+ *  AddDependancy
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+AddDependancy(char *szPkgName)
+{
+   int   iErr = ERROR_PKGCACHE_MEM,
+         iNew = 0;
+   LIST  *pList;
+
+
+   pList = ListGetDefault();
+   if (pList)
+      iErr = ListCtxAdd(pList, szPkgName,     &iNew);
+   if (!iErr && iNew)
+      iErr = JournalName(szPkgName);
+
+   return(iErr);
+}
+
+
+/*
+ *  CheckDependancies
+ *
+ *  Add the dependencies of the package pFilename, relative to the
+ *  directory iFdDir, to the package list.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+CheckDependancies(const int iFdDir, const char *pFilename)
+{
+   int         iBlock,
+               iErr = 0,
+               iFd = -1,
+               iDeps,
+               iDepsCount,
+               iDepsLevel,
+               iLevel,
+               iState;
+   la_ssize_t  iCountR;
+   char        block[LNBLOCK],
+               szDeps[LNSZ],
+               szKey[LNSZ];
+   const char  *p;
+   struct stat sPathStats;
+   struct archive *pArc = NULL;
+   struct archive_entry *pArcEntry = NULL;
+
+
+   // Patch to only check TXZ files
+   iBlock = strlen(pFilename);
+   if (iBlock > 4)
+   {
+      if (strcasecmp(pFilename + iBlock - 4, ".txz"))
+         iErr = ERROR_PKGCACHE_TEMP;
+   }
+   else
+      iErr = ERROR_PKGCACHE_TEMP;
+
+   // Same package file in another tree or pass?  The daemon keeps the
+   // set between runs, so a file replaced under the same name, with
+   // another size or modification time, is checked again.
+   if (!iErr && !fstatat(iFdDir, pFilename, &sPathStats, 0))
+   {
+      p = strrchr(pFilename, '/');
+      p = p ? p + 1 : pFilename;
+      snprintf(szKey, LNSZ, "%lld %lld %s", (long long)sPathStats.st_size,
+               (long long)sPathStats.st_mtime, p);
+      pthread_mutex_lock(&gsDownloadMutex);
+      if (StrSetIsFound(&gsDownloadChecked, szKey))
+         iErr = ERROR_PKGCACHE_TEMP;
+      else
+         iErr = StrSetAdd(&gsDownloadChecked, szKey);
+      pthread_mutex_unlock(&gsDownloadMutex);
+   }
+   
+   if (!iErr)
+   {
+      pArc = archive_read_new();
+      pArcEntry = archive_entry_new();
+      if (!(pArc && pArcEntry))
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+   if (!iErr)
+   {
+      iErr = archive_read_support_filter_all(pArc);
+      if (!iErr)
+         iErr = archive_read_support_format_all(pArc);
+      if (!iErr)
+      {
+         iFd = openat(iFdDir, pFilename, O_RDONLY);
+         if (iFd < 0)
+            iErr = ERROR_PKGCACHE_TEMP;
+      }
+      if (!iErr)
+         iErr = archive_read_open_fd(pArc, iFd, LNBLOCK);
+   }
+   if (!iErr)
+   {
+      do
+      {
+         iErr = archive_read_next_header2(pArc,     pArcEntry);
+         if (iErr == ARCHIVE_WARN)
+            iErr = 0;
+         if (!iErr)
+         {
+#ifdef PKGCACHE_VERBOSE
+printf("CheckDependancies(%s): archive_entry_pathname=%s\n", pFilename,
+        archive_entry_pathname(pArcEntry));
+#endif
+            if (strcmp(archive_entry_pathname(pArcEntry), "+MANIFEST"))
+               archive_read_data_skip(pArc);
+            else
+            {
+               iBlock = 0;
+               iDeps = 0;
+               iLevel = 0;
+               iState = PKGCACHE_DEPS_DEFAULT;
+               *szDeps = 0;
+               do
+               {
+                  iCountR = archive_read_data(pArc, block, LNBLOCK);
+                  if (iCountR < 0)
+                  {
+                     iErr = iCountR;
+                     iCountR = 0;
+                  }
+                  if (iCountR)
+                  {
+                     do
+                     {
+                        if (GetDepsString(iCountR, block,
+                                 &iBlock, &iState, &iLevel, szDeps))
+                        {
+#ifdef PKGCACHE_VERBOSE
+printf("CheckDependancies(%s): GetDepsString=%s\n", pFilename, szDeps);
+#endif
+                           if (iDeps)
+                           {
+                              if (iLevel == iDepsLevel && !iDepsCount)
+                              {
+                                 iErr = AddDependancy(szDeps);
+                                 if (!iErr)
+                                    iErr = ARCHIVE_EOF;
+                              }
+                              else if (iLevel == iDepsLevel + 1)
+                              {
+                                 iErr = AddDependancy(szDeps);
+                                 if (!iErr)
+                                    iDepsCount++;
+                              }
+                              else if (iLevel <= iDepsLevel)
+                                 iErr = ARCHIVE_EOF;
+                           }
+                           else if (!strcmp(szDeps, "deps"))
+                           {
+                              iDeps++;
+                              iDepsCount = 0;
+                              iDepsLevel = iLevel;
+                           }
+
+                           *szDeps = 0;
+                        }
+                     }
+                     while (iBlock && !iErr) ;
+                  }
+               }
+               while (iCountR == LNBLOCK && !iErr) ;
+
+               if (!iErr)
+                  iErr = ARCHIVE_EOF;
+            }
+         }
+      }
+      while (!iErr) ;
+
+      if (iErr == ARCHIVE_EOF)
+         iErr = 0;
+   }
+
+   if (pArcEntry)      
+      archive_entry_free(pArcEntry);
+   if (pArc)      
+      archive_read_free(pArc);
+   if (iFd >= 0)
+      close(iFd);
+
+   // Carry on to the next task if an error occured in the archive
+   if (iErr == ERROR_PKGCACHE_TEMP || iErr < 0)
+      iErr = 0;
+   
+   return(iErr);
+}
+
+
+/*
+ *  DownloadFetchInternal
+ *
+ *  Fetch pUrl into iFdW once, under the watchdog.  *piModified is the
+ *  time of the copy already there, 0 if none, and it's replaced by the
+ *  modification time of the fetched file, 0 if unknown.
+ *
+ *  Return: ERROR_PKGCACHE_xyz, ERROR_PKGCACHE_FILE_R if worth retrying,
+ *          PKGCACHE_DOWNLOAD_UNCHANGED if the copy is still current
+ */
+
+int
+DownloadFetchInternal(const char *pUrl, const int iFdW, char *pBlock,
+                         off_t *piCount, time_t *piModified)
+{
+   int               iErr = 0,
+                     iListing,
+                     iMissing = 0,
+                     iSlot,
+                     iStatus,
+                     iUnchanged = 0;
+   int64_t           iStart,
+                     iTtfb;
+   size_t            iCountB = 0,
+                     iCountR;
+   ssize_t           iCountW;
+   time_t            iModified;
+   FILE              *pFileR;
+   struct url_stat   sStat;
+
+
+   *piCount = 0;
+   iModified = *piModified;
+   *piModified = 0;
+   memset(&sStat, 0, sizeof(sStat));
+
+   // The listings, the URLs of directories, are asked for compressed.
+   // If-Modified-Since, a 304 fails with FETCH_UNCHANGED.
+   iListing = (*pUrl && pUrl[strlen(pUrl) - 1] == '/');
+   iSlot = WatchBegin();
+   iStart = ThrottleClock();
+   if (ReplayIsPlayback())
+      pFileR = ReplayGetURL(pUrl, &sStat,     &iStatus);
+   else if (iListing)
+      pFileR = HttpGetURL(pUrl, &sStat, iModified,     &iStatus);
+   else
+      pFileR = HttpFetchURL(pUrl, &sStat, iModified,     &iStatus);
+   iTtfb = ThrottleClock() - iStart;
+   if (pFileR)
+   {
+#ifdef PKGCACHE_VERBOSE
+printf("DownloadFile: fetchXGetURL(%s) OK\n", pUrl);
+#endif
+      WatchFirstByte(iSlot);
+      setvbuf(pFileR, NULL, _IOFBF, LNIOBLOCK);
+      do
+      {
+         // The watchdog and the throttling see the bytes as they come,
+         // a slow transfer would wait long for a whole block.  The
+         // file is still written by whole blocks.
+         iCountR = fread(pBlock + iCountB, 1, LNIOCHUNK, pFileR);
+         if (iCountR)
+         {
+            *piCount += iCountR;
+            iCountB += iCountR;
+            WatchBytes(iSlot, iCountR);
+            WatchThrottle(iSlot, 1);
+            ThrottleTake(iCountR);
+            WatchThrottle(iSlot, 0);
+         }
+         if (iCountB && (iCountB == LNIOBLOCK || iCountR < LNIOCHUNK))
+         {
+            iCountW = write(iFdW, pBlock, iCountB);
+            if (iCountW < 0 || (size_t)iCountW != iCountB)
+               iErr = ERROR_PKGCACHE_FILE_W;
+            iCountB = 0;
+         }
+      }
+      while (iCountR == LNIOCHUNK && !iErr) ;
+
+      // Check for a successful download
+      if (iCountR < LNIOCHUNK && !iErr)
+      {
+         if (!feof(pFileR) || ferror(pFileR))
+            iErr = ERROR_PKGCACHE_FILE_R;
+      }
+      fclose(pFileR);
+      ThrottleReport(iTtfb, *piCount, iErr == ERROR_PKGCACHE_FILE_R);
+      if (!iErr && sStat.mtime > 0)
+         *piModified = sStat.mtime;
+   }
+
+   // Nor is an unchanged file
+   else if (iStatus == FETCH_UNCHANGED)
+   {
+      ThrottleReport(iTtfb, 0, 0);
+      iUnchanged = 1;
+      *piModified = iModified;
+   }
+
+   // A missing file isn't a sign of congestion, nor worth retrying
+   else if (iStatus != FETCH_UNAVAIL)
+   {
+      ThrottleReport(iTtfb, 0, 1);
+      iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   else
+   {
+      ThrottleReport(iTtfb, 0, 0);
+      iMissing = 1;
+   }
+
+   if (WatchEnd(iSlot))
+   {
+      printf("  Warning: %s stalled, aborted.\n", pUrl);
+      iErr = ERROR_PKGCACHE_FILE_R;
+   }
+
+   // Only captured if -capture is used.  A capture missing a transfer
+   // can't be played back, but the download itself is fine.
+   if (iErr != ERROR_PKGCACHE_FILE_W
+       && ReplayRecord(pUrl, &sStat, iFdW, iErr ? 'E' : (iUnchanged ? 'U'
+                       : (iMissing ? 'M' : 'O')), iTtfb,
+                       ThrottleClock() - iStart))
+      printf("  Warning: %s not captured!\n", pUrl);
+   if (!iErr && iUnchanged)
+      iErr = PKGCACHE_DOWNLOAD_UNCHANGED;
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadRetryInternal
+ *
+ *  Fetch pUrl into iFdW, a failed or stalled transfer starting over
+ *  after a pause.  See DownloadFetchInternal for *piModified.
+ *
+ *  Return: ERROR_PKGCACHE_xyz, PKGCACHE_DOWNLOAD_UNCHANGED
+ */
+
+int
+DownloadRetryInternal(const char *pUrl, const int iFdW, char *pBlock,
+                         off_t *piCount, time_t *piModified)
+{
+   int      i = 0,
+            iErr;
+   time_t   iModified;
+
+
+   iModified = *piModified;
+   do
+   {
+      iErr = 0;
+      if (i)
+      {
+         printf("  Retrying %s\n", pUrl);
+         sleep(i);
+         if (ftruncate(iFdW, 0) || lseek(iFdW, 0, SEEK_SET))
+            iErr = ERROR_PKGCACHE_FILE_W;
+      }
+      if (!iErr)
+      {
+         *piModified = iModified;
+         iErr = DownloadFetchInternal(pUrl, iFdW, pBlock,     piCount,
+                                         piModified);
+      }
+      i++;
+   }
+   while (iErr == ERROR_PKGCACHE_FILE_R && i < WatchAttempts()) ;
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadLocalInternal
+ *
+ *  Put the local file szSrc in szTempname, relative to the directory
+ *  iFdDir.  pPathStats is the copy already there, NULL if none.
+ *
+ *  Return: ERROR_PKGCACHE_xyz, PKGCACHE_DOWNLOAD_UNCHANGED
+ */
+
+int
+DownloadLocalInternal(const char *szSrc, const int iFdDir,
+                      const char *szTempname,
+                      const struct stat *pPathStats,     int *piEmpty)
+{
+   int      iErr = 0,
+            iFdR,
+            iFdW;
+   off_t    iCount;
+   struct stat sSrcStats;
+   struct timespec sTimes[2];
+
+
+   *piEmpty = 1;
+   iFdR = open(szSrc, O_RDONLY);
+   if (iFdR >= 0 && !fstat(iFdR, &sSrcStats))
+   {
+      if (pPathStats && ((pPathStats->st_dev == sSrcStats.st_dev
+                          && pPathStats->st_ino == sSrcStats.st_ino)
+                         || (pPathStats->st_mtime == sSrcStats.st_mtime
+                             && pPathStats->st_size == sSrcStats.st_size)))
+         iErr = PKGCACHE_DOWNLOAD_UNCHANGED;
+      else
+      {
+         // When importing, the same file if on the same file system.
+         // Neither pkgcache nor the mirroring tools write a file in
+         // place, they replace it.
+         unlinkat(iFdDir, szTempname, 0);
+         if (giDownloadLink
+             && !linkat(AT_FDCWD, szSrc, iFdDir, szTempname, 0))
+            *piEmpty = !(sSrcStats.st_size);
+
+         // Otherwise, let the kernel do the copy
+         else
+         {
+            iFdW = openat(iFdDir, szTempname, O_WRONLY | O_CREAT | O_TRUNC,
+                          0644);
+            if (iFdW >= 0)
+            {
+               iErr = CopyFd(iFdR, iFdW,     &iCount);
+               *piEmpty = !iCount;
+               sTimes[0].tv_sec = 0;
+               sTimes[0].tv_nsec = UTIME_OMIT;
+               sTimes[1].tv_sec = sSrcStats.st_mtime;
+               sTimes[1].tv_nsec = 0;
+               futimens(iFdW, sTimes);
+               close(iFdW);
+            }
+            else
+               iErr = ERROR_PKGCACHE_FILE_W;
+         }
+      }
+   }
+   if (iFdR >= 0)
+      close(iFdR);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadFile
+ *
+ *  Download pUrl into pFilename, relative to the directory iFdDir.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadFile(const char *pUrl, const int iFdDir, const char *pFilename)
+{
+   int      iEmpty = 1,
+            iErr = 0,
+            iFdW = -1,
+            iTemp = 0;
+   char     *pBlock = NULL;
+   const char *p;
+   off_t    iCount;
+   time_t   iModified = 0;
+   FILENAME szTempname;
+   struct stat sPathStats;
+   struct timespec sTimes[2];
+
+
+   p = strrchr(pFilename, '/');
+   p = p ? p + 1 : pFilename;
+
+   // Archives often change while still keeping the same file name and
+   // version, so they're always asked for, but only if modified since
+   // the copy already there.  The copy has the modification time of
+   // the server's file.  The repository metadata is always fetched in
+   // full:  TRIM rewrites the catalog, so the copy there may not be the
+   // server's, whatever its modification time.
+   if (!IsDownloadAlways(p) && !fstatat(iFdDir, pFilename, &sPathStats, 0)
+       && S_ISREG(sPathStats.st_mode))
+      iModified = sPathStats.st_mtime;
+
+   // The file is written in a hidden temporary file, then renamed, so
+   // that a file still linked to the published generation is replaced,
+   // never overwritten.
+   if (strlen(pFilename) + strlen(PKGCACHE_TEMP_FILENAME) + 2 <= LNFILENAME)
+   {
+      sprintf(szTempname, "%.*s.%s" PKGCACHE_TEMP_FILENAME,
+              (int)(p - pFilename), pFilename, p);
+      iTemp = 1;
+   }
+
+   // Local mirror
+   if (iTemp && !strncasecmp(pUrl, PKGCACHE_URL_FILE, LNPKGCACHE_URL_FILE))
+      iErr = DownloadLocalInternal(pUrl + LNPKGCACHE_URL_FILE, iFdDir,
+                                   szTempname, iModified ? &sPathStats : NULL,
+                                   &iEmpty);
+   else if (iTemp)
+   {
+      // The file is written with write(2) by whole blocks of a large
+      // aligned buffer: no stdio buffer on the writing side, and one
+      // system call per block.  The reading side still copies from
+      // fetch's buffer to the stdio one, then to the block, and fetch
+      // decides how many reads it takes.
+      iFdW = openat(iFdDir, szTempname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (iFdW < 0)
+      {
+         iTemp = 0;
+#ifdef PKGCACHE_VERBOSE
+printf("DownloadFile: open(%s) errno=%d\n", pFilename, errno);
+#endif
+      }
+      else if (posix_memalign((void **)&pBlock, getpagesize(), LNIOBLOCK))
+         iErr = ERROR_PKGCACHE_MEM;
+      else
+      {
+#ifdef PKGCACHE_VERBOSE
+printf("DownloadFile: open(%s) OK\n", pFilename);
+#endif
+         iErr = DownloadRetryInternal(pUrl, iFdW, pBlock,     &iCount,
+                                         &iModified);
+         iEmpty = !iCount;
+         if (!iErr && !iEmpty && iModified > 0)
+         {
+            sTimes[0].tv_sec = 0;
+            sTimes[0].tv_nsec = UTIME_OMIT;
+            sTimes[1].tv_sec = iModified;
+            sTimes[1].tv_nsec = 0;
+            futimens(iFdW, sTimes);
+         }
+      }
+   }
+
+   if (pBlock)
+      free(pBlock);
+   if (iFdW >= 0)
+      close(iFdW);
+
+   if (iTemp)
+   {
+      if (iErr == PKGCACHE_DOWNLOAD_UNCHANGED)
+      {
+         // Keep the copy already there
+         unlinkat(iFdDir, szTempname, 0);
+         iErr = 0;
+      }
+      else if (iErr || iEmpty)
+      {
+         // Cleanup if incomplete or no download, but make sure it's a
+         // file.  An incomplete download keeps the previous file.
+         unlinkat(iFdDir, szTempname, 0);
+         if (!iErr && !fstatat(iFdDir, pFilename, &sPathStats, 0)
+             && S_ISREG(sPathStats.st_mode))
+            unlinkat(iFdDir, pFilename, 0);
+         if (!iErr)
+            printf("  Warning: %s missing!\n", pUrl);
+      }
+      else if (renameat(iFdDir, szTempname, iFdDir, pFilename))
+      {
+         unlinkat(iFdDir, szTempname, 0);
+         iErr = ERROR_PKGCACHE_FILE_W;
+      }
+   }
+
+#ifdef PKGCACHE_VERBOSE
+if (iErr)
+   printf("DownloadFile: iErr=%d\n", iErr);
+#endif
+
+   return(iErr);
+}
+
+
+/*
+ *  GetHrefLink
+ *
+ *  Return: TRUE if link found
+ */
+
+int
+GetHrefLink(const int iCountR, char *pBlock,
+                  int *piBlock, int *piState, char *pszHref)
+{
+   int   iBool = 0,
+         iOut;
+   char  *pIn,
+         *pOut;
+
+
+   pIn = pBlock + *piBlock;
+   iOut = strlen(pszHref);
+   pOut = pszHref + iOut;
+   while (*piBlock < iCountR && !iBool && *piState != PKGCACHE_HTML_EOH)
+   {
+      // Handeling quoted text
+      if (*piState & PKGCACHE_HTML_QUOTE)
+      {
+         if (*pIn == '"')  // This is the end-quote
+         {
+            if (*piState == PKGCACHE_HTML_HREF)
+            {
+               iBool = 1;
+               *piState = PKGCACHE_HTML_TAG;
+            }
+            else
+               *piState &= PKGCACHE_HTML_ATAG; // & with implicit PKGCACHE_HTML_TAG
+         }
+         else
+         {
+            if (*piState == PKGCACHE_HTML_HREF)
+            {
+               if (iOut >= LNSZ-1)
+               {
+                  // Too long, skip it!
+                  *piState = PKGCACHE_HTML_TAGQUOTE;
+               }
+               else
+               {
+                  *pOut = *pIn;
+                  iOut++;
+                  pOut++;
+               }
+            }
+         }
+      }
+
+      // Handeling tags
+      else if (*piState & PKGCACHE_HTML_TAG)
+      {
+         if (*pIn == '>')  // This is the end-tag
+         {
+            if (*piState == PKGCACHE_HTML_CLOSETAG)
+            {
+               *pOut = 0;
+               if (strcasecmp(pszHref, "/html"))
+                  *piState = PKGCACHE_HTML_DEFAULT;
+               else
+                  *piState = PKGCACHE_HTML_EOH;
+            }
+            else
+               *piState = PKGCACHE_HTML_DEFAULT;
+         }
+         else if (*piState == PKGCACHE_HTML_BEGINTAG)
+         {
+            if (isspace(*pIn))
+            {
+               *pOut = 0;
+               if (strcasecmp(pszHref, "a"))
+                  *piState = PKGCACHE_HTML_TAG;
+               else
+               {
+                  pOut = pszHref;
+                  iOut = 0;
+                  *piState = PKGCACHE_HTML_ATAG;
+               }
+            }
+            else if (*pIn == '"')
+            {
+               *piState = PKGCACHE_HTML_TAGQUOTE;
+            }
+            else if (*pIn == '/')
+            {
+               pOut = pszHref;
+               *pOut = '/';
+               pOut++;
+               iOut = 1;
+               *piState = PKGCACHE_HTML_CLOSETAG;
+            }
+            else
+            {
+               *pOut = *pIn;
+               iOut++;
+               pOut++;
+            }
+         }
+         else if (*piState == PKGCACHE_HTML_ATAG)
+         {
+            if (isspace(*pIn))
+            {
+               // Tolerate a space before and after the '=' sign only.
+               *pOut = 0;
+               if (strcasecmp(pszHref, "href") && strcasecmp(pszHref, "href="))
+               {
+                  pOut = pszHref;
+                  iOut = 0;
+               }
+            }
+            else if (*pIn == '"')
+            {
+               *pOut = 0;
+               if (strcasecmp(pszHref, "href="))
+                  *piState = PKGCACHE_HTML_ATAGQUOTE;
+               else
+                  *piState = PKGCACHE_HTML_HREF;
+
+               pOut = pszHref;
+               iOut = 0;
+            }
+            else
+            {
+               *pOut = *pIn;
+               iOut++;
+               pOut++;
+            }
+         }
+         else if (*piState == PKGCACHE_HTML_CLOSETAG)
+         {
+            *pOut = *pIn;
+            iOut++;
+            pOut++;
+         }
+      }
+
+      // Waiting for tags
+      else
+      {
+         if (*pIn == '<')  // This is the begin-tag
+         {
+            pOut = pszHref;
+            iOut = 0;
+            *piState = PKGCACHE_HTML_BEGINTAG;
+         }
+      }
+
+      pIn++;
+      (*piBlock)++;
+   }
+
+   if (*piBlock >= iCountR)
+      *piBlock = 0;
+
+   *pOut = 0;
+
+   return(iBool);
+}
+
+
+/*
+ *  DownloadHashInternal
+ *
+ *  Return: the hash bucket of the l characters of sz.
+ */
+
+unsigned int
+DownloadHashInternal(const char *sz, const int l)
+{
+   int            i;
+   unsigned int   iHash = 2166136261U;
+
+
+   // FNV-1a
+   for (i = 0 ; i < l ; i++)
+      iHash = (iHash ^ (unsigned char)sz[i]) * 16777619U;
+
+   return(iHash & (PKGCACHE_DOWNLOAD_SEGMENTS - 1));
+}
+
+
+/*
+ *  DownloadInternInternal
+ *
+ *  Called with gsDownloadMutex locked.
+ *
+ *  Return: the unique copy of the segment, or NULL.
+ */
+
+const char *
+DownloadInternInternal(const char *sz, const int l)
+{
+   unsigned int   iHash;
+   SEGMENT        *pSegment;
+
+
+   iHash = DownloadHashInternal(sz, l);
+   pSegment = gpDownloadSegments[iHash];
+   while (pSegment && (strncmp(pSegment->sz, sz, l) || pSegment->sz[l]))
+      pSegment = pSegment->pNext;
+   if (!pSegment)
+   {
+      pSegment = ArenaAlloc(&gsDownloadArena, sizeof(SEGMENT) + l + 1);
+      if (pSegment)
+      {
+         memcpy(pSegment->sz, sz, l);
+         pSegment->sz[l] = 0;
+         pSegment->pNext = gpDownloadSegments[iHash];
+         gpDownloadSegments[iHash] = pSegment;
+      }
+   }
+
+   return(pSegment ? pSegment->sz : NULL);
+}
+
+
+/*
+ *  DownloadPathAddInternal
+ *
+ *  Add szRelative below pParent, one segment per directory.
+ *
+ *  Return: the path, or NULL.
+ */
+
+const PATH *
+DownloadPathAddInternal(const PATH *pParent, const char *szRelative)
+{
+   int         l;
+   const char  *p;
+   PATH        *pPath;
+
+
+   pthread_mutex_lock(&gsDownloadMutex);
+   while (pParent && *szRelative)
+   {
+      p = strchr(szRelative, '/');
+      l = p ? p + 1 - szRelative : strlen(szRelative);
+
+      pPath = ArenaAlloc(&gsDownloadArena, sizeof(PATH));
+      if (pPath)
+      {
+         pPath->szSegment = DownloadInternInternal(szRelative, l);
+         pPath->iLength = pParent->iLength + l;
+         pPath->pParent = pParent;
+         if (!pPath->szSegment)
+            pPath = NULL;
+      }
+      pParent = pPath;
+      szRelative += l;
+   }
+   pthread_mutex_unlock(&gsDownloadMutex);
+
+   return(pParent);
+}
+
+
+/*
+ *  DownloadPathInternal
+ *
+ *  Make the URL or pathname of pPath.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadPathInternal(const PATH *pPath, const char *szBase,     char *sz)
+{
+   int   iErr = 0,
+         l;
+   char  *p;
+
+
+   l = strlen(szBase);
+   if (l + pPath->iLength < LNFILENAME)
+   {
+      strcpy(sz, szBase);
+      p = sz + l + pPath->iLength;
+      *p = 0;
+
+      // From the end, the segments being linked to their parent
+      for ( ; pPath && pPath->szSegment ; pPath = pPath->pParent)
+      {
+         l = strlen(pPath->szSegment);
+         p -= l;
+         memcpy(p, pPath->szSegment, l);
+      }
+   }
+   else
+      iErr = ERROR_PKGCACHE_TEMP;
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadDirOpenInternal
+ *
+ *  Called with gsDownloadMutex locked.
+ *
+ *  Return: The descriptor of the directory pDir, -1 on error.
+ */
+
+int
+DownloadDirOpenInternal(const PATH *pDir)
+{
+   int            i,
+                  iFd = -1,
+                  iFdParent;
+   unsigned int   iHash;
+   DIRFD          *pDirFd;
+   FILENAME       sz,
+                  szSegment;
+
+
+   if (!pDir->szSegment)
+      iFd = giDownloadDirFd;     // The root of the run
+   else if (!DownloadPathInternal(pDir, "",     sz))
+   {
+      iHash = DownloadHashInternal(sz, pDir->iLength);
+      for (pDirFd = gpDownloadDirs[iHash] ; pDirFd ; pDirFd = pDirFd->pNext)
+      {
+         if (!strcmp(pDirFd->sz, sz))
+         {
+            iFd = pDirFd->iFd;
+            break;
+         }
+      }
+
+      if (!pDirFd)
+      {
+         iFdParent = DownloadDirOpenInternal(pDir->pParent);
+         StrnCopy(szSegment, pDir->szSegment, LNFILENAME);
+         i = strlen(szSegment);
+         if (i && szSegment[i - 1] == '/')
+            szSegment[i - 1] = 0;
+         if (iFdParent >= 0
+             && (!mkdirat(iFdParent, szSegment, 0775) || errno == EEXIST))
+            iFd = openat(iFdParent, szSegment, O_RDONLY | O_DIRECTORY);
+         if (iFd >= 0)
+         {
+            pDirFd = ArenaAlloc(&gsDownloadArena,
+                                sizeof(DIRFD) + pDir->iLength + 1);
+            if (pDirFd)
+            {
+               strcpy(pDirFd->sz, sz);
+               pDirFd->iFd = iFd;
+               pDirFd->pNext = gpDownloadDirs[iHash];
+               gpDownloadDirs[iHash] = pDirFd;
+            }
+            else
+            {
+               close(iFd);
+               iFd = -1;
+            }
+         }
+      }
+   }
+
+   return(iFd);
+}
+
+
+/*
+ *  DownloadDirInternal
+ *
+ *  Open the directory pDir of the run, creating it and its parents if
+ *  needed.  The descriptor stays open until the end of the run.
+ *
+ *  Return: The descriptor of the directory, -1 on error.
+ */
+
+int
+DownloadDirInternal(const PATH *pDir)
+{
+   int   iFd;
+
+
+   pthread_mutex_lock(&gsDownloadMutex);
+   iFd = DownloadDirOpenInternal(pDir);
+   pthread_mutex_unlock(&gsDownloadMutex);
+
+   return(iFd);
+}
+
+
+/*
+ *  DownloadJobFirstInternal
+ *
+ *  The listings come first, since they fetch the metadata of their
+ *  directory and find more work.  Then the largest files, so that the
+ *  run doesn't end with a single long transfer.
+ *
+ *  Return: TRUE if pJob1 is to be handled before pJob2
+ */
+
+int
+DownloadJobFirstInternal(const JOB *pJob1, const JOB *pJob2)
+{
+   int   iRet;
+
+
+   if (pJob1->iFile != pJob2->iFile)
+      iRet = !pJob1->iFile;
+   else if (pJob1->iSize != pJob2->iSize)
+      iRet = (pJob1->iSize > pJob2->iSize);
+   else
+      iRet = (pJob1->iSequence < pJob2->iSequence);
+
+   return(iRet);
+}
+
+
+/*
+ *  DownloadJobInternal
+ *
+ *  Take the first job out of the queue, a binary heap.  The caller
+ *  holds gsDownloadMutex.
+ *
+ *  Return: The job, NULL if none
+ */
+
+JOB *
+DownloadJobInternal(void)
+{
+   int   i,
+         iChild;
+   JOB   *pJob = NULL,
+         *pLast;
+
+
+   if (giDownloadJobs)
+   {
+      pJob = gppDownloadJobs[0];
+      giDownloadJobs--;
+      pLast = gppDownloadJobs[giDownloadJobs];
+
+      // Sift the last job down from the top
+      i = 0;
+      while ((iChild = i * 2 + 1) < giDownloadJobs)
+      {
+         if (iChild + 1 < giDownloadJobs
+             && DownloadJobFirstInternal(gppDownloadJobs[iChild + 1],
+                                         gppDownloadJobs[iChild]))
+            iChild++;
+         if (!DownloadJobFirstInternal(gppDownloadJobs[iChild], pLast))
+            break;
+         gppDownloadJobs[i] = gppDownloadJobs[iChild];
+         i = iChild;
+      }
+      gppDownloadJobs[i] = pLast;
+   }
+
+   return(pJob);
+}
+
+
+/*
+ *  DownloadQueueInternal
+ *
+ *  Queue a listing, or a file of iSize bytes, -1 if unknown.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadQueueInternal(const PATH *pPath, const int iFile, const off_t iSize)
+{
+   int   i,
+         iErr = 0;
+   JOB   *pJob = NULL,
+         **ppJobs;
+
+
+   pthread_mutex_lock(&gsDownloadMutex);
+   if (giDownloadJobs == giDownloadJobsSize)
+   {
+      i = giDownloadJobsSize ? giDownloadJobsSize * 2 : LNSZ;
+      ppJobs = realloc(gppDownloadJobs, sizeof(JOB *) * i);
+      if (ppJobs)
+      {
+         gppDownloadJobs = ppJobs;
+         giDownloadJobsSize = i;
+      }
+   }
+   if (pPath && giDownloadJobs < giDownloadJobsSize)
+      pJob = ArenaAlloc(&gsDownloadArena, sizeof(JOB));
+   if (pJob)
+   {
+      pJob->pPath = pPath;
+      pJob->iFile = iFile;
+      pJob->iSize = iFile ? iSize : -1;
+      pJob->iSequence = giDownloadSequence++;
+
+      // Sift the new job up from the bottom
+      i = giDownloadJobs;
+      giDownloadJobs++;
+      while (i && DownloadJobFirstInternal(pJob, gppDownloadJobs[(i - 1) / 2]))
+      {
+         gppDownloadJobs[i] = gppDownloadJobs[(i - 1) / 2];
+         i = (i - 1) / 2;
+      }
+      gppDownloadJobs[i] = pJob;
+      pthread_cond_signal(&gsDownloadCond);
+   }
+   else
+      iErr = ERROR_PKGCACHE_MEM;
+   pthread_mutex_unlock(&gsDownloadMutex);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadVersionInternal
+ *
+ *  Split a package file name, like "foo-1.2_1.txz", into its base name
+ *  and its version, without the extension.  szVersion must be LNSZ
+ *  long.
+ *
+ *  Return: The length of the base name, 0 if there's no version.
+ */
+
+int
+DownloadVersionInternal(const char *szName,     char *szVersion)
+{
+   int         i = 0;
+   const char  *p,
+               *pExt;
+
+
+   *szVersion = 0;
+   p = strrchr(szName, '-');
+   if (p && p != szName)
+   {
+      i = p - szName;
+
+      // ".2" is part of the version, ".txz" isn't
+      pExt = strrchr(p, '.');
+      if (pExt && !strpbrk(pExt, "0123456789") && pExt - p < LNSZ)
+         StrnCopy(szVersion, p + 1, pExt - p);
+      else
+         StrnCopy(szVersion, p + 1, LNSZ);
+   }
+
+   return(i);
+}
+
+
+/*
+ *  DownloadVersionCmpInternal
+ *
+ *  Return: the order of two package file names, by base name, then
+ *          from the newest version to the oldest.
+ */
+
+int
+DownloadVersionCmpInternal(const void *p1, const void *p2)
+{
+   int         i1,
+               i2,
+               iRet;
+   const char  *sz1 = *(const char * const *)p1,
+               *sz2 = *(const char * const *)p2;
+   char        szVersion1[LNSZ],
+               szVersion2[LNSZ];
+
+
+   // Without a version, the whole name is the base name
+   i1 = DownloadVersionInternal(sz1,     szVersion1);
+   if (!i1)
+      i1 = strlen(sz1);
+   i2 = DownloadVersionInternal(sz2,     szVersion2);
+   if (!i2)
+      i2 = strlen(sz2);
+
+   iRet = strncmp(sz1, sz2, i1 < i2 ? i1 : i2);
+   if (!iRet)
+      iRet = i1 - i2;
+   if (!iRet)
+      iRet = VersionCompare(szVersion2, szVersion1);
+
+   return(iRet);
+}
+
+
+/*
+ *  DownloadMatchInternal
+ *
+ *  Add the files of pNames, NUL terminated names back to back, whose
+ *  package is on the package list to pFiles.  Only the giDownloadKeep
+ *  newest versions of a package are kept.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadMatchInternal(const BUFFER *pNames, const char *szUrl,
+                      const char *szPkgcachePathname,     STRSET *pFiles)
+{
+   int         i,
+               iBase,
+               iCount = 0,
+               iErr = 0,
+               iFound = 0,
+               iKept = 0,
+               iPrevious = 0;
+   char        *p,
+               *pcFound = NULL,
+               szVersion[LNSZ];
+   const char  **ppNames = NULL,
+               *pPrevious = NULL;
+   FILENAME    szPathname,
+               szUrl2;
+
+
+   for (p = pNames->p ; p < pNames->p + pNames->iLength ; p += strlen(p) + 1)
+      iCount++;
+   if (iCount)
+   {
+      ppNames = malloc(sizeof(char *) * iCount);
+      pcFound = malloc(iCount);
+      if (ppNames && pcFound)
+      {
+         for (i = 0, p = pNames->p ; i < iCount ; i++, p += strlen(p) + 1)
+            ppNames[i] = p;
+         iErr = ListMatch(ppNames, iCount,     pcFound);
+      }
+      else
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+
+   // Newest versions first, then skip the older ones
+   for (i = 0 ; !iErr && i < iCount ; i++)
+   {
+      if (pcFound[i])
+      {
+         ppNames[iFound] = ppNames[i];
+         iFound++;
+      }
+   }
+   if (iFound > 1)
+      qsort(ppNames, iFound, sizeof(char *), DownloadVersionCmpInternal);
+   for (i = 0 ; !iErr && i < iFound ; i++)
+   {
+      iBase = DownloadVersionInternal(ppNames[i],     szVersion);
+      if (!iBase || iBase != iPrevious
+          || strncmp(pPrevious, ppNames[i], iBase))
+         iKept = 0;
+      pPrevious = ppNames[i];
+      iPrevious = iBase;
+      iKept++;
+
+      if (iKept <= giDownloadKeep
+          && strlen(szUrl) + strlen(ppNames[i]) < LNFILENAME
+          && strlen(szPkgcachePathname) + strlen(ppNames[i]) < LNFILENAME)
+      {
+         sprintf(szUrl2, "%s%s", szUrl, ppNames[i]);
+         sprintf(szPathname, "%s%s", szPkgcachePathname, ppNames[i]);
+         if (IsFilterMatch(szUrl2, gszDownloadPathFilter)
+             && !JournalIsFile(szPathname)
+             && !StrSetIsFound(pFiles, ppNames[i]))
+            iErr = StrSetAdd(pFiles, ppNames[i]);
+      }
+   }
+
+   if (ppNames)
+      free(ppNames);
+   if (pcFound)
+      free(pcFound);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadPackageInternal
+ *
+ *  Download szUrl into the file szName of the directory iFdDir, whose
+ *  whole pathname is szPathname.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadPackageInternal(const char *szUrl, const int iFdDir,
+                        const char *szName, const char *szPathname)
+{
+   int      iErr;
+
+
+   printf("Downloading %s\n", szName);
+   iErr = DownloadFile(szUrl, iFdDir, szName);
+   if (!iErr)
+      iErr = CheckDependancies(iFdDir, szName);
+   if (!iErr)
+      iErr = JournalFile(szPathname);
+   else if (iErr == ERROR_PKGCACHE_FILE_R)
+   {
+      printf("WARNING: Skipping %s, download failed!\n", szUrl);
+      iErr = 0;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadPlanLineInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadPlanLineInternal(char *pLine, const int iLength, void *pData)
+{
+   int      iErr = 0;
+   char     c,
+            *p,
+            szSize[LNSZ];
+   FILENAME szRepopath;
+   PLAN     *pPlan = pData;
+   PLANFILE sFile;
+
+
+   // Files of the listing itself are already handled
+   if (CatalogGetValue(pLine, "repopath", szRepopath, LNFILENAME)
+       && *szRepopath != '/' && !strstr(szRepopath, "..")
+       && (p = strrchr(szRepopath, '/')))
+   {
+      c = *(p + 1);
+      *(p + 1) = 0;
+      if (!StrSetIsFound(&(pPlan->sDirs), szRepopath))
+         iErr = StrSetAdd(&(pPlan->sDirs), szRepopath);
+      *(p + 1) = c;
+
+      if (!iErr && (IsDownloadAlways(p + 1) || ListIsFound(p + 1)))
+      {
+         sFile.iSize = -1;
+         if (CatalogGetValue(pLine, "pkgsize", szSize, LNSZ))
+            sFile.iSize = strtoll(szSize, NULL, 10);
+         sFile.szRepopath = strdup(szRepopath);
+         if (sFile.szRepopath)
+         {
+            iErr = BufferAppend(&(pPlan->sFiles), &sFile, sizeof(sFile));
+            if (iErr)
+               free(sFile.szRepopath);
+         }
+         else
+            iErr = ERROR_PKGCACHE_MEM;
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadPlanInternal
+ *
+ *  Queue the package files of the catalog, instead of crawling the
+ *  directories it describes.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadPlanInternal(const PATH *pDir, const char *pUrl,
+                     const char *pPkgcachePathname, const char *szCatalog,
+                        PLAN *pPlan, int *piQueued)
+{
+   int      i,
+            iCount,
+            iErr;
+   char     *p;
+   FILENAME szDirUrl,
+            szPathname,
+            szUrl;
+   PLANFILE *pFiles;
+
+
+   iErr = CatalogRead(szCatalog, DownloadPlanLineInternal, pPlan);
+   pFiles = (PLANFILE *)pPlan->sFiles.p;
+   iCount = pPlan->sFiles.iLength / sizeof(PLANFILE);
+   if (iErr)
+   {
+      // Crawl all the directories instead
+      printf("WARNING: Can't read %s, browsing instead!\n", szCatalog);
+      StrSetClear(&(pPlan->sDirs));
+      iErr = 0;
+   }
+   else
+   {
+      for (i = 0 ; !iErr && i < iCount ; i++)
+      {
+         if (strlen(pUrl) + strlen(pFiles[i].szRepopath) < LNFILENAME
+             && strlen(pPkgcachePathname) + strlen(pFiles[i].szRepopath)
+                < LNFILENAME)
+         {
+            sprintf(szUrl, "%s%s", pUrl, pFiles[i].szRepopath);
+            sprintf(szPathname, "%s%s", pPkgcachePathname,
+                    pFiles[i].szRepopath);
+            strcpy(szDirUrl, szUrl);
+            p = strrchr(szDirUrl, '/');
+            *(p + 1) = 0;
+            if (IsFilterMatch(szDirUrl, gszDownloadNavFilter)
+                && IsFilterMatch(szUrl, gszDownloadPathFilter)
+                && !JournalIsFile(szPathname))
+            {
+               iErr = DownloadQueueInternal(
+                         DownloadPathAddInternal(pDir, pFiles[i].szRepopath),
+                         1, pFiles[i].iSize);
+               if (!iErr)
+                  (*piQueued)++;
+            }
+         }
+      }
+   }
+   for (i = 0 ; i < iCount ; i++)
+      free(pFiles[i].szRepopath);
+   BufferFree(&(pPlan->sFiles));
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadListingFindInternal
+ *
+ *  Called with gsDownloadListingMutex held.
+ *
+ *  Return: The listing kept for szUrl, NULL if none
+ */
+
+LISTING *
+DownloadListingFindInternal(const char *szUrl)
+{
+   LISTING  *pListing;
+
+
+   pListing = gpDownloadListings[DownloadHashInternal(szUrl, strlen(szUrl))];
+   while (pListing && strcmp(pListing->szUrl, szUrl))
+      pListing = pListing->pNext;
+
+   return(pListing);
+}
+
+
+/*
+ *  DownloadListingLoadInternal
+ *
+ *  Write the listing kept for szUrl into iFdW.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadListingLoadInternal(const char *szUrl, const int iFdW,
+                               off_t *piCount)
+{
+   int      iErr = ERROR_PKGCACHE_TEMP;
+   LISTING  *pListing;
+
+
+   *piCount = 0;
+   pthread_mutex_lock(&gsDownloadListingMutex);
+   pListing = DownloadListingFindInternal(szUrl);
+   if (pListing)
+   {
+      if (write(iFdW, pListing->sBody.p, pListing->sBody.iLength)
+          == (ssize_t)(pListing->sBody.iLength))
+      {
+         *piCount = pListing->sBody.iLength;
+         iErr = 0;
+      }
+      else
+         iErr = ERROR_PKGCACHE_FILE_W;
+   }
+   pthread_mutex_unlock(&gsDownloadListingMutex);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadListingSaveInternal
+ *
+ *  Keep the iCount bytes of the listing in iFdW, modified at iModified.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadListingSaveInternal(const char *szUrl, const int iFdW,
+                            const off_t iCount, const time_t iModified)
+{
+   int      i,
+            iErr = 0;
+   LISTING  *pListing;
+
+
+   pthread_mutex_lock(&gsDownloadListingMutex);
+   pListing = DownloadListingFindInternal(szUrl);
+   if (!pListing)
+   {
+      pListing = malloc(sizeof(LISTING) + strlen(szUrl) + 1);
+      if (pListing)
+      {
+         strcpy(pListing->szUrl, szUrl);
+         memset(&(pListing->sBody), 0, sizeof(BUFFER));
+         i = DownloadHashInternal(szUrl, strlen(szUrl));
+         pListing->pNext = gpDownloadListings[i];
+         gpDownloadListings[i] = pListing;
+      }
+      else
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+   if (!iErr)
+   {
+      pListing->iModified = 0;     // Unusable until complete
+      pListing->sBody.iLength = 0;
+      iErr = BufferReserve(&(pListing->sBody), iCount);
+   }
+   if (!iErr)
+   {
+      if (pread(iFdW, pListing->sBody.p, iCount, 0) == iCount)
+      {
+         pListing->sBody.iLength = iCount;
+         pListing->iModified = iModified;
+      }
+      else
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   pthread_mutex_unlock(&gsDownloadListingMutex);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadLocalListingInternal
+ *
+ *  Write a listing of the local directory szDirname into iFdW, as a
+ *  web server would.  The hidden entries are left out, and so are the
+ *  snapshots at the top of another packages directory.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadLocalListingInternal(const char *szDirname, const int iTop,
+                             const int iFdW,     off_t *piCount)
+{
+   int            iErr = 0;
+   DIR            *pDir;
+   BUFFER         sListing = {NULL, 0, 0};
+   FILENAME       sz;
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   *piCount = 0;
+   pDir = opendir(szDirname);
+   if (pDir)
+   {
+      iErr = BufferAppendStr(&sListing, "<html><body>\n");
+      while (!iErr && (pEntry = readdir(pDir)))
+      {
+         // The links to the trees of a packages directory are followed
+         if (*(pEntry->d_name) != '.'
+             && strlen(pEntry->d_name) + 2 < LNFILENAME
+             && !fstatat(dirfd(pDir), pEntry->d_name, &sPathStats, 0))
+         {
+            sprintf(sz, "%s%s", pEntry->d_name,
+                    S_ISDIR(sPathStats.st_mode) ? "/" : "");
+            if (!iTop || strcmp(sz, PKGCACHE_SNAPSHOT_DIR))
+            {
+               iErr = BufferAppendStr(&sListing, "<a href=\"");
+               if (!iErr)
+                  iErr = BufferAppendStr(&sListing, sz);
+               if (!iErr)
+                  iErr = BufferAppendStr(&sListing, "\"></a>\n");
+            }
+         }
+      }
+      closedir(pDir);
+      if (!iErr)
+         iErr = BufferAppendStr(&sListing, "</body></html>\n");
+      if (!iErr)
+      {
+         if (write(iFdW, sListing.p, sListing.iLength)
+             == (ssize_t)(sListing.iLength))
+            *piCount = sListing.iLength;
+         else
+            iErr = ERROR_PKGCACHE_FILE_W;
+      }
+   }
+   BufferFree(&sListing);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadUpdates
+ *
+ *  Handle one directory listing, queueing its subdirectories.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadUpdates(const PATH *pDir)
+{
+   int      i,
+            iBlock = 0,
+            iCatalog = 0,
+            iErr = 0,
+            iHrefLn,
+            iFdDir = -1,
+            iFdW = -1,
+            iState = PKGCACHE_HTML_DEFAULT,
+            iQueued = 0;
+   char     block[LNBLOCK],
+            *pBlock = NULL;
+   STRSET   sFiles = {0, 0, NULL},
+            sSubdirs = {0, 0, NULL};
+   BUFFER   sNames = {NULL, 0, 0};
+   PLAN     sPlan = {{0, 0, NULL}, {NULL, 0, 0}};
+   off_t    iCount;
+   size_t   iCountR;
+   time_t   iModified = 0;
+   FILE     *pFileR = NULL;
+   LISTING  *pListing;
+   FILENAME szHref,
+            szPkgcachePathname,
+            szPkgcachePathname2,
+            szUrl,
+            szUrl2;
+   struct stat sPathStats;
+
+
+   iErr = DownloadPathInternal(pDir, gszDownloadUrl,     szUrl);
+   if (!iErr)
+      iErr = DownloadPathInternal(pDir, gszDownloadPathname,
+                                     szPkgcachePathname);
+   if (!iErr && JournalIsListing(szUrl))
+      iErr = ERROR_PKGCACHE_TEMP;   // Already completed by an interrupted run
+   if (!iErr)
+   {
+      iFdDir = DownloadDirInternal(pDir);
+      if (iFdDir >= 0)
+         iFdW = openat(iFdDir, PKGCACHE_TEMP_FILENAME,
+                       O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (iFdW < 0)
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+   if (!iErr && posix_memalign((void **)&pBlock, getpagesize(), LNIOBLOCK))
+      iErr = ERROR_PKGCACHE_MEM;
+   if (!iErr)
+   {
+      // A local directory is listed here, unless it's missing
+      if (!strncasecmp(szUrl, PKGCACHE_URL_FILE, LNPKGCACHE_URL_FILE))
+         iErr = DownloadLocalListingInternal(szUrl + LNPKGCACHE_URL_FILE,
+                                             !(pDir->pParent), iFdW,
+                                             &iCount);
+      else
+      {
+         // An unchanged listing is the one kept from the previous run
+         if (giDownloadListings)
+         {
+            pthread_mutex_lock(&gsDownloadListingMutex);
+            pListing = DownloadListingFindInternal(szUrl);
+            if (pListing)
+               iModified = pListing->iModified;
+            pthread_mutex_unlock(&gsDownloadListingMutex);
+         }
+         iErr = DownloadRetryInternal(szUrl, iFdW, pBlock,     &iCount,
+                                         &iModified);
+         if (iErr == PKGCACHE_DOWNLOAD_UNCHANGED)
+            iErr = DownloadListingLoadInternal(szUrl, iFdW,     &iCount);
+         else if (!iErr && iCount && iModified && giDownloadListings)
+            iErr = DownloadListingSaveInternal(szUrl, iFdW, iCount,
+                                               iModified);
+      }
+
+      // An incomplete listing is caught by the second read
+      if (!iCount)
+         iErr = ERROR_PKGCACHE_TEMP;
+      else if (iErr == ERROR_PKGCACHE_FILE_R)
+         iErr = 0;
+      if (!iErr)
+         printf("Browsing %s\n", szUrl);
+   }
+   if (pBlock)
+      free(pBlock);
+   
+   // Second read, from the start of the same descriptor...
+   if (!iErr)
+   {
+      if (!lseek(iFdW, 0, SEEK_SET))
+         pFileR = fdopen(iFdW, "r");
+      if (pFileR)
+         iFdW = -1;        // Closed with pFileR
+      else
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+   if (iFdW >= 0)
+      close(iFdW);
+   if (!iErr)
+   {
+      szHref[0] = 0;
+      do
+      {
+         iCountR = fread(block, 1, LNBLOCK, pFileR);
+         do
+         {
+            if (GetHrefLink(iCountR, block,     &iBlock, &iState, szHref))
+            {
+               iHrefLn = strlen(szHref);
+               if (iHrefLn)
+               {
+                  if (szHref[0] != '/' && strncasecmp(szHref, "http:", 5)
+                      && strncasecmp(szHref, "https:", 6) && szHref[0] != '.'
+                      && szHref[0] != '?')  // Skip absolute and navigation links
+                  {
+                     // Patch because of non desirable HTML directory format
+                     if (strstr(szHref, "FreeBSD%3A") && szHref[iHrefLn-1] != '/')
+                     {
+                        StrReplace(szHref, "%3A", ':');
+                        strcat(szHref, "/");
+                        iHrefLn = strlen(szHref);
+                     }
+                     sprintf(szUrl2, "%s%s", szUrl, szHref);
+                     if (szHref[iHrefLn-1] == '/')
+                     {
+                        // Queued once the catalog, if any, is known
+                        if (IsFilterMatch(szUrl2, gszDownloadNavFilter)
+                            && !StrSetIsFound(&sSubdirs, szHref))
+                           iErr = StrSetAdd(&sSubdirs, szHref);
+                     }
+                     // The metadata right away, the packages are queued
+                     else if (IsDownloadAlways(szHref)
+                              && IsFilterMatch(szUrl2, gszDownloadPathFilter))
+                     {
+                        sprintf(szPkgcachePathname2, "%s%s", szPkgcachePathname,
+                                szHref);
+                        if (!JournalIsFile(szPkgcachePathname2))
+                           iErr = DownloadPackageInternal(szUrl2, iFdDir,
+                                             szHref, szPkgcachePathname2);
+                        if (!iErr && !strcmp(szHref, PKGCACHE_CATALOG_SITE)
+                            && !fstatat(iFdDir, szHref, &sPathStats, 0)
+                            && S_ISREG(sPathStats.st_mode))
+                           iCatalog = 1;
+                     }
+                     // The others are matched with the list all at once
+                     else
+                        iErr = BufferAppend(&sNames, szHref, iHrefLn + 1);
+                  }
+
+                  szHref[0] = 0;
+               }
+            }
+         }
+         while (iBlock && !iErr && iState != PKGCACHE_HTML_EOH) ;
+      }
+      while (iCountR == LNBLOCK && !iErr && iState != PKGCACHE_HTML_EOH) ;
+
+      fclose(pFileR);
+
+      if (!iErr && iState != PKGCACHE_HTML_EOH)
+      {
+         printf("ERROR: %s didn't load completely.\n", szUrl);
+         iErr = ERROR_PKGCACHE_NO_EOH;
+      }
+      if (!iErr)
+         iErr = DownloadMatchInternal(&sNames, szUrl, szPkgcachePathname,
+                                         &sFiles);
+      // The catalog lists the package files of its directories, so
+      // there's no need to browse them.
+      if (!iErr && iCatalog)
+      {
+         sprintf(szPkgcachePathname2, "%s%s", szPkgcachePathname,
+                 PKGCACHE_CATALOG_SITE);
+         iErr = DownloadPlanInternal(pDir, szUrl, szPkgcachePathname,
+                                     szPkgcachePathname2,     &sPlan, &iQueued);
+      }
+      for (i = 0 ; !iErr && i < sSubdirs.iCount ; i++)
+      {
+         if (!StrSetIsFound(&(sPlan.sDirs), sSubdirs.ppStr[i]))
+         {
+            iErr = DownloadQueueInternal(
+                      DownloadPathAddInternal(pDir, sSubdirs.ppStr[i]), 0, -1);
+            if (!iErr)
+               iQueued++;
+         }
+      }
+      for (i = 0 ; !iErr && i < sFiles.iCount ; i++)
+      {
+         iErr = DownloadQueueInternal(
+                   DownloadPathAddInternal(pDir, sFiles.ppStr[i]), 1, -1);
+         if (!iErr)
+            iQueued++;
+      }
+
+      // Only journal the listings that queued nothing: the jobs of the
+      // others aren't tracked, so an interrupted run reads them again
+      // and queues what's still pending.
+      if (!iErr && !iQueued)
+         iErr = JournalListing(szUrl);
+   }
+
+   StrSetClear(&sFiles);
+   StrSetClear(&sSubdirs);
+   StrSetClear(&(sPlan.sDirs));
+   BufferFree(&sNames);
+
+   if (iErr == ERROR_PKGCACHE_TEMP)
+      iErr = 0;
+   if (iFdDir >= 0)
+      unlinkat(iFdDir, PKGCACHE_TEMP_FILENAME, 0);
+   return(iErr);
+}
+
+
+/*
+ *  DownloadWorkerInternal
+ *
+ *  Handle the queued jobs until none is left, or an error occurs.
+ */
+
+void *
+DownloadWorkerInternal(void *pData)
+{
+   int      iErr = 0,
+            iFdDir;
+   JOB      *pJob;
+   FILENAME szPathname,
+            szUrl;
+
+
+   pthread_mutex_lock(&gsDownloadMutex);
+   while (!iErr)
+   {
+      // The throttle window bounds the jobs transferring at once
+      if (giDownloadJobs && giDownloadBusy < ThrottleWindow())
+      {
+         pJob = DownloadJobInternal();
+         giDownloadBusy++;
+         pthread_mutex_unlock(&gsDownloadMutex);
+
+         if (!pJob->iFile)
+            iErr = DownloadUpdates(pJob->pPath);
+         else if (!DownloadPathInternal(pJob->pPath, gszDownloadUrl,     szUrl)
+                  && !DownloadPathInternal(pJob->pPath, gszDownloadPathname,
+                                              szPathname))
+         {
+            iFdDir = DownloadDirInternal(pJob->pPath->pParent);
+            if (iFdDir >= 0)
+               iErr = DownloadPackageInternal(szUrl, iFdDir,
+                                              pJob->pPath->szSegment,
+                                              szPathname);
+            else
+               iErr = ERROR_PKGCACHE_ACCESS;
+         }
+
+         pthread_mutex_lock(&gsDownloadMutex);
+         giDownloadBusy--;
+         if (iErr && !giDownloadErr)
+            giDownloadErr = iErr;
+         pthread_cond_broadcast(&gsDownloadCond);
+      }
+      else if (giDownloadBusy)
+         pthread_cond_wait(&gsDownloadCond, &gsDownloadMutex);
+      else
+         break;      // Nothing left to do
+
+      iErr = giDownloadErr;
+   }
+   pthread_mutex_unlock(&gsDownloadMutex);
+
+   return(NULL);
+}
+
+
+/*
+ *  DownloadRun
+ *
+ *  Synchronize the repository tree at pUrl with iJobs threads, the
+ *  throttle window deciding how many of them transfer at once.  The
+ *  browsed directories get the iKeep newest versions of a package.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadRun(const char *pUrl, const char *pNavFilter,
+            const char *pPathFilter, const char *pPkgcachePathname,
+            const int iJobs, const int iKeep)
+{
+   int         i,
+               iErr,
+               iThreads = 0;
+   pthread_t   sThreads[PKGCACHE_DOWNLOAD_JOBS_MAX];
+   DIRFD       *pDirFd;
+   PATH        *pRoot;
+
+
+   gszDownloadNavFilter = pNavFilter;
+   gszDownloadPathFilter = pPathFilter;
+   gszDownloadPathname = pPkgcachePathname;
+   gszDownloadUrl = pUrl;
+   giDownloadErr = 0;
+   giDownloadKeep = iKeep;
+   pRoot = ArenaAlloc(&gsDownloadArena, sizeof(PATH));
+   if (pRoot)
+   {
+      pRoot->iLength = 0;
+      pRoot->szSegment = NULL;
+      pRoot->pParent = NULL;
+   }
+   giDownloadDirFd = open(pPkgcachePathname, O_RDONLY | O_DIRECTORY);
+   if (giDownloadDirFd < 0)
+      iErr = ERROR_PKGCACHE_ACCESS;
+   else
+      iErr = DownloadQueueInternal(pRoot, 0, -1);
+
+   // The calling thread is one of the workers
+   for (i = 1 ; !iErr && i < iJobs && i < PKGCACHE_DOWNLOAD_JOBS_MAX ; i++)
+   {
+      if (!pthread_create(sThreads + iThreads, NULL,
+                          DownloadWorkerInternal, NULL))
+         iThreads++;
+   }
+   if (!iErr)
+   {
+      DownloadWorkerInternal(NULL);
+      for (i = 0 ; i < iThreads ; i++)
+         pthread_join(sThreads[i], NULL);
+      iErr = giDownloadErr;
+   }
+
+   // Forget the paths and the jobs left behind by an error
+   giDownloadJobs = 0;
+   for (i = 0 ; i < PKGCACHE_DOWNLOAD_SEGMENTS ; i++)
+   {
+      for (pDirFd = gpDownloadDirs[i] ; pDirFd ; pDirFd = pDirFd->pNext)
+         close(pDirFd->iFd);
+   }
+   if (giDownloadDirFd >= 0)
+      close(giDownloadDirFd);
+   giDownloadDirFd = -1;
+   memset(gpDownloadDirs, 0, sizeof(gpDownloadDirs));
+   memset(gpDownloadSegments, 0, sizeof(gpDownloadSegments));
+   ArenaFree(&gsDownloadArena);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadRescanWalkInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadRescanWalkInternal(const char *szPathname, const int iPathType,
+                           void *pData)
+{
+   int   i,
+         iErr = 0;
+
+
+   i = strlen(szPathname);
+   if (iPathType == PKGCACHE_EXIST_DIR
+       && SnapshotIsDir(gszDownloadPathname, szPathname))
+      iErr = PKGCACHE_WALK_PRUNE;
+   else if (iPathType == PKGCACHE_EXIST_FILE && i > 4
+            && !strcasecmp(szPathname + i - 4, ".txz"))
+      iErr = StrSetAdd((STRSET *)pData, szPathname);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadRescanWorkerInternal
+ *
+ *  Check the dependencies of the scanned packages until none is left.
+ */
+
+void *
+DownloadRescanWorkerInternal(void *pData)
+{
+   int      i,
+            iErr = 0;
+   STRSET   *pFiles = pData;
+
+
+   do
+   {
+      pthread_mutex_lock(&gsDownloadMutex);
+      if (giDownloadErr)
+         i = pFiles->iCount;
+      else
+      {
+         i = giDownloadNext;
+         giDownloadNext++;
+      }
+      if (iErr && !giDownloadErr)
+         giDownloadErr = iErr;
+      pthread_mutex_unlock(&gsDownloadMutex);
+
+      if (i < pFiles->iCount)
+         iErr = CheckDependancies(AT_FDCWD, pFiles->ppStr[i]);
+   }
+   while (i < pFiles->iCount) ;
+
+   return(NULL);
+}
+
+
+/*
+ *  DownloadRescan
+ *
+ *  Add the missing dependencies of the cached packages to the list,
+ *  with one thread per CPU.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+DownloadRescan(const char *pPkgcachePathname)
+{
+   int         i,
+               iErr,
+               iJobs,
+               iThreads = 0;
+   pthread_t   sThreads[PKGCACHE_DOWNLOAD_JOBS_MAX];
+   STRSET      sFiles = {0, 0, NULL};
+
+
+   gszDownloadPathname = pPkgcachePathname;
+   iErr = DirWalk(pPkgcachePathname, DownloadRescanWalkInternal, &sFiles);
+   if (!iErr)
+   {
+      iJobs = sysconf(_SC_NPROCESSORS_ONLN);
+      if (iJobs < 1)
+         iJobs = 1;
+      else if (iJobs > PKGCACHE_DOWNLOAD_JOBS_MAX)
+         iJobs = PKGCACHE_DOWNLOAD_JOBS_MAX;
+      printf("Scanning %d packages with %d threads\n", sFiles.iCount, iJobs);
+
+      giDownloadNext = 0;
+      giDownloadErr = 0;
+      for (i = 1 ; i < iJobs ; i++)
+      {
+         if (!pthread_create(sThreads + iThreads, NULL,
+                             DownloadRescanWorkerInternal, &sFiles))
+            iThreads++;
+      }
+      DownloadRescanWorkerInternal(&sFiles);
+      for (i = 0 ; i < iThreads ; i++)
+         pthread_join(sThreads[i], NULL);
+      iErr = giDownloadErr;
+   }
+   StrSetClear(&sFiles);
+
+   return(iErr);
+}
+
+
+/*
+ *  DownloadImport
+ *
+ *  The repository is a local mirror or packages directory to import:
+ *  its files are hard linked instead of copied, when they're on the
+ *  same file system.
+ */
+
+void
+DownloadImport(void)
+{
+   giDownloadLink = 1;
+}
+
+
+/*
+ *  DownloadListings
+ *
+ *  Keep the directory listings from one run to the next, so that an
+ *  unchanged listing isn't transferred again.  They're kept until
+ *  DownloadQuit.
+ */
+
+void
+DownloadListings(void)
+{
+   pthread_mutex_lock(&gsDownloadListingMutex);
+   giDownloadListings = 1;
+   pthread_mutex_unlock(&gsDownloadListingMutex);
+}
+
+
+/*
+ *  DownloadQuit
+ */
+
+void
+DownloadQuit(void)
+{
+   int      i;
+   LISTING  *pListing;
+
+
+   pthread_mutex_lock(&gsDownloadListingMutex);
+   for (i = 0 ; i < PKGCACHE_DOWNLOAD_SEGMENTS ; i++)
+   {
+      while ((pListing = gpDownloadListings[i]))
+      {
+         gpDownloadListings[i] = pListing->pNext;
+         BufferFree(&(pListing->sBody));
+         free(pListing);
+      }
+   }
+   giDownloadListings = 0;
+   pthread_mutex_unlock(&gsDownloadListingMutex);
+
+   StrSetClear(&gsDownloadChecked);
+   if (gppDownloadJobs)
+      free(gppDownloadJobs);
+   gppDownloadJobs = NULL;
+   giDownloadJobsSize = 0;
+}
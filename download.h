@@ -0,0 +1,56 @@
+/* 
+ * File:    download.h
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Repository download header file. Tested under FreeBSD 11.2.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef PKGCACHE_DOWNLOAD_H
+#define PKGCACHE_DOWNLOAD_H
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_DOWNLOAD_JOBS      16      // The throttle window's cap
+#define PKGCACHE_DOWNLOAD_KEEP      1       // Versions of a package
+#define PKGCACHE_DOWNLOAD_JOBS_MAX  64
+
+
+/*
+ *  Prototypes
+ */
+
+int  DownloadFile(const char *pUrl, const int iFdDir, const char *pFilename);
+void DownloadImport(void);
+void DownloadListings(void);
+void DownloadQuit(void);
+int  DownloadRescan(const char *pPkgcachePathname);
+int  DownloadRun(const char *pUrl, const char *pNavFilter,
+                 const char *pPathFilter, const char *pPkgcachePathname,
+                 const int iJobs, const int iKeep);
+
+
+#endif  // PKGCACHE_DOWNLOAD_H
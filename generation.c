@@ -0,0 +1,444 @@
+/* 
+ * File:    generation.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Generation publishing. Tested under FreeBSD 11.2.
+ *
+ *          A DOWNLOAD doesn't write into the served tree.  Each
+ *          repository tree, a directory at the top of the packages
+ *          directory, lives in a generation:
+ *            .pkgcachegen/<n>/<tree>/ : The files of generation n.
+ *            .pkgcachegen/current     : Symbolic link to the published
+ *                                       generation.
+ *            <tree>                   : Symbolic link to
+ *                                       .pkgcachegen/current/<tree>.
+ *          A new generation starts as hard links to the files of the
+ *          published one, and the downloads replace the links with
+ *          new files.  Once the run is over, swapping the 'current'
+ *          link publishes every file at once.  The generation before
+ *          the published one is kept for the transfers still going on
+ *          from it, the older ones are removed.  An interrupted run
+ *          leaves its generation behind, and the next DOWNLOAD picks
+ *          it up.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "generation.h"
+#include "snapshot.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_GENERATION_CURRENT "current"
+#define PKGCACHE_GENERATION_TEMP    ".pkgcachetemp"
+
+
+/*
+ *  Types
+ */
+
+typedef struct
+{
+   int         iLength;
+   const char  *szDst,
+               *szPkgcachePathname;
+} CLONE;
+
+
+/*
+ *  Object variables
+ */
+
+int   giGenerationStage = 0;
+
+
+/*
+ *  GenerationCloneInternal
+ *
+ *  Hard link a file of the published trees into the new generation.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+GenerationCloneInternal(const char *szPathname, const int iPathType,
+                        void *pData)
+{
+   int         iErr = 0;
+   const char  *p;
+   CLONE       *pClone = pData;
+   FILENAME    sz;
+
+
+   p = szPathname + pClone->iLength;
+
+   // The snapshots are frozen, they stay out of the generations
+   if (iPathType == PKGCACHE_EXIST_DIR
+       && SnapshotIsDir(pClone->szPkgcachePathname, szPathname))
+      iErr = PKGCACHE_WALK_PRUNE;
+
+   // The top level files, like the package list, aren't published
+   else if (*p && (iPathType == PKGCACHE_EXIST_DIR || strchr(p, '/')))
+   {
+      if (strlen(pClone->szDst) + strlen(p) < LNFILENAME)
+      {
+         sprintf(sz, "%s%s", pClone->szDst, p);
+         if (iPathType == PKGCACHE_EXIST_DIR)
+         {
+            if (mkdir(sz, 0775) && errno != EEXIST)
+               iErr = ERROR_PKGCACHE_FILE_W;
+         }
+         // Files already in a resumed generation are newer
+         else if (link(szPathname, sz) && errno != EEXIST)
+            iErr = ERROR_PKGCACHE_FILE_W;
+      }
+      else
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  GenerationCurrentInternal
+ *
+ *  Return: The published generation number, 0 if none
+ */
+
+int
+GenerationCurrentInternal(const char *szPkgcachePathname)
+{
+   int         i = 0;
+   ssize_t     l;
+   FILENAME    sz,
+               szTarget;
+
+
+   if (strlen(szPkgcachePathname) + 30 < LNFILENAME)
+   {
+      sprintf(sz, "%s" PKGCACHE_GENERATION_DIR PKGCACHE_GENERATION_CURRENT,
+              szPkgcachePathname);
+      l = readlink(sz, szTarget, LNFILENAME - 1);
+      if (l > 0)
+      {
+         szTarget[l] = 0;
+         i = atoi(szTarget);
+      }
+   }
+
+   return(i);
+}
+
+
+/*
+ *  GenerationLastInternal
+ *
+ *  Return: The newest generation number, published or not, 0 if none
+ */
+
+int
+GenerationLastInternal(const char *szPkgcachePathname)
+{
+   int            i,
+                  iLast = 0;
+   DIR            *pDir;
+   FILENAME       sz;
+   struct dirent  *pEntry;
+
+
+   if (strlen(szPkgcachePathname) + 30 < LNFILENAME)
+   {
+      sprintf(sz, "%s" PKGCACHE_GENERATION_DIR, szPkgcachePathname);
+      pDir = opendir(sz);
+      if (pDir)
+      {
+         while ((pEntry = readdir(pDir)))
+         {
+            i = atoi(pEntry->d_name);
+            if (i > iLast)
+               iLast = i;
+         }
+         closedir(pDir);
+      }
+   }
+
+   return(iLast);
+}
+
+
+/*
+ *  GenerationOpen
+ *
+ *  Prepare the generation to download into, and return its pathname.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+GenerationOpen(const char *szPkgcachePathname,     char *szStagePathname)
+{
+   int            iErr = 0;
+   CLONE          sClone;
+   FILENAME       sz;
+
+
+   if (strlen(szPkgcachePathname) + 30 >= LNFILENAME)
+      iErr = ERROR_PKGCACHE_MEM;
+   else
+   {
+      sprintf(sz, "%s" PKGCACHE_GENERATION_DIR, szPkgcachePathname);
+      iErr = MakePath(sz);
+   }
+   if (!iErr)
+   {
+      // A generation newer than the published one was interrupted
+      giGenerationStage = MAX(GenerationCurrentInternal(szPkgcachePathname)
+                              + 1, GenerationLastInternal(szPkgcachePathname));
+
+      sprintf(szStagePathname, "%s" PKGCACHE_GENERATION_DIR "%d/",
+              szPkgcachePathname, giGenerationStage);
+      if (Exist(szStagePathname, PKGCACHE_EXIST_DIR))
+         printf("Resuming generation %d.\n", giGenerationStage);
+      else
+         iErr = MakePath(szStagePathname);
+   }
+   if (!iErr)
+   {
+      // The walk goes through the top level links, so the published
+      // generation and the trees not published yet are both cloned.
+      sClone.iLength = strlen(szPkgcachePathname);
+      sClone.szDst = szStagePathname;
+      sClone.szPkgcachePathname = szPkgcachePathname;
+      iErr = DirWalk(szPkgcachePathname, GenerationCloneInternal, &sClone);
+   }
+
+#ifdef PKGCACHE_VERBOSE
+printf("GenerationOpen(%s): %s iErr=%d\n", szPkgcachePathname,
+       szStagePathname, iErr);
+#endif
+
+   return(iErr);
+}
+
+
+/*
+ *  GenerationPublish
+ *
+ *  Publish the generation returned by GenerationOpen.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+GenerationPublish(const char *szPkgcachePathname)
+{
+   int            i,
+                  iErr = 0,
+                  iPrevious;
+   ssize_t        l;
+   DIR            *pDir = NULL;
+   FILENAME       sz,
+                  szDir,
+                  szTarget,
+                  szTemp;
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   if (!giGenerationStage || strlen(szPkgcachePathname) + 30 >= LNFILENAME)
+      iErr = ERROR_PKGCACHE_MEM;
+   else
+   {
+      iPrevious = GenerationCurrentInternal(szPkgcachePathname);
+
+      // The swap: rename(2) replaces the 'current' link atomically
+      sprintf(szDir, "%s" PKGCACHE_GENERATION_DIR, szPkgcachePathname);
+      sprintf(sz, "%s" PKGCACHE_GENERATION_CURRENT, szDir);
+      sprintf(szTemp, "%s" PKGCACHE_GENERATION_TEMP, szDir);
+      sprintf(szTarget, "%d", giGenerationStage);
+      unlink(szTemp);
+      if (symlink(szTarget, szTemp) || rename(szTemp, sz))
+      {
+         unlink(szTemp);
+         iErr = ERROR_PKGCACHE_FILE_W;
+      }
+   }
+
+   // Point the top level at the published trees, once for all
+   if (!iErr)
+   {
+      sprintf(sz, "%s%d/", szDir, giGenerationStage);
+      pDir = opendir(sz);
+      if (!pDir)
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+   while (!iErr && (pEntry = readdir(pDir)))
+   {
+      if (*(pEntry->d_name) != '.')
+      {
+         if (strlen(szDir) + strlen(pEntry->d_name) + 30 >= LNFILENAME)
+            iErr = ERROR_PKGCACHE_MEM;
+         else
+         {
+            sprintf(sz, "%s%s", szPkgcachePathname, pEntry->d_name);
+            sprintf(szTarget, PKGCACHE_GENERATION_DIR
+                    PKGCACHE_GENERATION_CURRENT "/%s", pEntry->d_name);
+            if (lstat(sz, &sPathStats))
+               sPathStats.st_mode = 0;       // Not there yet
+            if (S_ISDIR(sPathStats.st_mode))
+            {
+               // A tree from before the generations, or created by the
+               // PROXY, goes away with the previous generation.
+               sprintf(szTemp, "%s%d/", szDir, iPrevious);
+               iErr = MakePath(szTemp);
+               strcat(szTemp, pEntry->d_name);
+               if (!iErr && rename(sz, szTemp))
+                  iErr = ERROR_PKGCACHE_FILE_W;
+            }
+            else if (S_ISLNK(sPathStats.st_mode))
+            {
+               l = readlink(sz, szTemp, LNFILENAME - 1);
+               if (l > 0)
+               {
+                  szTemp[l] = 0;
+                  if (!strcmp(szTemp, szTarget))
+                     *szTarget = 0;    // Already in place
+               }
+            }
+            if (!iErr && *szTarget)
+            {
+               sprintf(szTemp, "%s.%s" PKGCACHE_GENERATION_TEMP,
+                       szPkgcachePathname, pEntry->d_name);
+               unlink(szTemp);
+               if (symlink(szTarget, szTemp) || rename(szTemp, sz))
+               {
+                  unlink(szTemp);
+                  iErr = ERROR_PKGCACHE_FILE_W;
+               }
+            }
+         }
+      }
+   }
+   if (pDir)
+      closedir(pDir);
+
+   // Only keep the published generation and the previous one
+   if (!iErr)
+   {
+      pDir = opendir(szDir);
+      if (pDir)
+      {
+         while (!iErr && (pEntry = readdir(pDir)))
+         {
+            i = atoi(pEntry->d_name);
+            if (*(pEntry->d_name) >= '0' && *(pEntry->d_name) <= '9'
+                && i != giGenerationStage && i != iPrevious)
+            {
+               sprintf(sz, "%s%s", szDir, pEntry->d_name);
+               iErr = DirRemove(sz);
+            }
+         }
+         closedir(pDir);
+      }
+      printf("Generation %d published.\n", giGenerationStage);
+      giGenerationStage = 0;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  GenerationStage
+ *
+ *  Return: The generation another process is downloading, 0 if none
+ */
+
+int
+GenerationStage(const char *szPkgcachePathname)
+{
+   int iStage;
+
+
+   iStage = GenerationLastInternal(szPkgcachePathname);
+   if (iStage <= GenerationCurrentInternal(szPkgcachePathname))
+      iStage = 0;
+
+   return(iStage);
+}
+
+
+/*
+ *  GenerationStageLink
+ *
+ *  Hard link szPathname, a file about to be added to the published
+ *  trees as szPath, relative to the packages directory, into the
+ *  generation iStage returned by GenerationStage, if any.  Otherwise,
+ *  publishing that generation would drop the file.  The number is
+ *  taken before the file is added, so the link goes in even if the
+ *  generation was published since.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+GenerationStageLink(const char *szPkgcachePathname, const int iStage,
+                    const char *szPathname, const char *szPath)
+{
+   int         iErr = 0;
+   char        *p;
+   FILENAME    szStage;
+
+
+   if (iStage)
+   {
+      if (strlen(szPkgcachePathname) + strlen(szPath) + 30 >= LNFILENAME)
+         iErr = ERROR_PKGCACHE_MEM;
+      else
+      {
+         sprintf(szStage, "%s" PKGCACHE_GENERATION_DIR "%d/%s",
+                 szPkgcachePathname, iStage, szPath);
+         p = strrchr(szStage, '/');
+         *p = 0;
+         iErr = MakePath(szStage);
+         *p = '/';
+
+         // The download may have fetched it too
+         if (!iErr && link(szPathname, szStage) && errno != EEXIST)
+            iErr = ERROR_PKGCACHE_FILE_W;
+      }
+   }
+
+   return(iErr);
+}
@@ -0,0 +1,51 @@
+/* 
+ * File:    generation.h
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Generation publishing header file. Tested under FreeBSD 11.2.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef PKGCACHE_GENERATION_H
+#define PKGCACHE_GENERATION_H
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_GENERATION_DIR     ".pkgcachegen/"
+
+
+/*
+ *  Prototypes
+ */
+
+int  GenerationOpen(const char *szPkgcachePathname,     char *szStagePathname);
+int  GenerationPublish(const char *szPkgcachePathname);
+int  GenerationStage(const char *szPkgcachePathname);
+int  GenerationStageLink(const char *szPkgcachePathname, const int iStage,
+                         const char *szPathname, const char *szPath);
+
+
+#endif  // PKGCACHE_GENERATION_H
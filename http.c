@@ -0,0 +1,778 @@
+/* 
+ * File:    http.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Compressed HTTP transfers. Tested under FreeBSD 11.2.
+ *
+ *          fetch neither asks for nor decodes a content encoding, so the
+ *          directory listings, several megabytes of HTML for the large
+ *          'All/' directories, are asked for here instead: an HTTP/1.1
+ *          GET with "Accept-Encoding: gzip, deflate".  The body is
+ *          de-chunked and inflated with zlib as it's read, behind a
+ *          funopen(3) stream, so the callers read the HTML as with
+ *          fetch.  A truncated or corrupted body is a read error.
+ *          Like fetch, the connection, reads and writes give up after
+ *          the -timeout seconds.
+ *
+ *          The URLs this can't handle, https, with credentials or
+ *          through a proxy, are left to fetch, and so are redirections
+ *          to them.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <fetch.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "http.h"
+
+
+/*
+ *  Constants
+ */
+
+#define ENVHTTPTIMEOUT              "HTTP_TIMEOUT"
+
+#define LNHTTPBLOCK                 (64*1024)
+#define LNHTTPLINE                  4096
+
+#define PKGCACHE_HTTP_DATE          "%a, %d %b %Y %H:%M:%S GMT"
+#define PKGCACHE_HTTP_REDIRECTS     5
+#define PKGCACHE_HTTP_USERAGENT     "pkgcache/1.1"
+
+#define PKGCACHE_HTTP_IDENTITY      0
+#define PKGCACHE_HTTP_GZIP          1
+#define PKGCACHE_HTTP_DEFLATE       2
+
+
+/*
+ *  Types
+ */
+
+// A response body being read, see HttpReadInternal
+typedef struct
+{
+   int            iChunked,      // Transfer-Encoding: chunked
+                  iEncoding,     // PKGCACHE_HTTP_xyz
+                  iEof,          // Of the body
+                  iFd,
+                  iInflate,      // inflateInit2() done
+                  iInflateEnd,   // Of the compressed stream
+                  iRaw,          // Next byte of raw
+                  iRawLength;
+   off_t          iLeft;         // Of the chunk or body, -1 if unknown
+   z_stream       sZ;
+   unsigned char  body[LNHTTPBLOCK],    // Encoded, for zlib
+                  raw[LNHTTPBLOCK];     // As received
+} HTTPSTREAM;
+
+
+/*
+ *  Object variables
+ */
+
+pthread_mutex_t   gsHttpFetchMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ *  HttpFillInternal
+ *
+ *  Return: > 0 if some received bytes are waiting in raw, 0 at the end
+ *          of the connection, -1 on error
+ */
+
+int
+HttpFillInternal(HTTPSTREAM *pStream)
+{
+   int      iRet = 1;
+   ssize_t  l;
+
+
+   if (pStream->iRaw >= pStream->iRawLength)
+   {
+      // An interrupted read, by the watchdog, is an error
+      l = read(pStream->iFd, pStream->raw, LNHTTPBLOCK);
+      if (l > 0)
+      {
+         pStream->iRaw = 0;
+         pStream->iRawLength = l;
+      }
+      else
+         iRet = l;
+   }
+
+   return(iRet);
+}
+
+
+/*
+ *  HttpLineInternal
+ *
+ *  Read a line of the response, without its line end.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+HttpLineInternal(HTTPSTREAM *pStream,     char *sz)
+{
+   int   i = 0,
+         iErr = 0;
+   char  c = 0;
+
+
+   while (!iErr && c != '\n')
+   {
+      if (HttpFillInternal(pStream) > 0)
+      {
+         c = pStream->raw[pStream->iRaw];
+         pStream->iRaw++;
+         if (i < LNHTTPLINE - 1)
+         {
+            sz[i] = c;
+            i++;
+         }
+         else
+            iErr = ERROR_PKGCACHE_MEM;
+      }
+      else
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   while (i && (sz[i-1] == '\n' || sz[i-1] == '\r'))
+      i--;
+   sz[i] = 0;
+
+   return(iErr);
+}
+
+
+/*
+ *  HttpBodyInternal
+ *
+ *  Read the body as sent, de-chunked.
+ *
+ *  Return: The number of bytes read, 0 at the end of the body, -1 on
+ *          error
+ */
+
+ssize_t
+HttpBodyInternal(HTTPSTREAM *pStream, unsigned char *pBuffer,
+                 const size_t l)
+{
+   int      iFill;
+   ssize_t  i = 0;
+   char     sz[LNHTTPLINE];
+
+
+   if (pStream->iChunked && !(pStream->iLeft) && !(pStream->iEof))
+   {
+      // The next chunk size, after the line end of the previous chunk
+      if (HttpLineInternal(pStream,     sz))
+         i = -1;
+      else if (!*sz && HttpLineInternal(pStream,     sz))
+         i = -1;
+      else if (!isxdigit(*sz))
+         i = -1;
+      else
+      {
+         pStream->iLeft = strtoll(sz, NULL, 16);
+         if (pStream->iLeft < 0)
+            i = -1;
+         else if (!(pStream->iLeft))
+            pStream->iEof = 1;   // The trailers are left unread
+      }
+   }
+
+   if (!i && !(pStream->iEof))
+   {
+      iFill = HttpFillInternal(pStream);
+      if (iFill > 0)
+      {
+         i = pStream->iRawLength - pStream->iRaw;
+         if ((size_t)i > l)
+            i = l;
+         if (pStream->iLeft >= 0 && i > pStream->iLeft)
+            i = pStream->iLeft;
+         memcpy(pBuffer, pStream->raw + pStream->iRaw, i);
+         pStream->iRaw += i;
+         if (pStream->iLeft > 0)
+         {
+            pStream->iLeft -= i;
+            if (!(pStream->iLeft) && !(pStream->iChunked))
+               pStream->iEof = 1;
+         }
+      }
+      else if (!iFill && pStream->iLeft < 0)
+         pStream->iEof = 1;      // Closed after a body of unknown length
+      else
+         i = -1;                 // Truncated
+   }
+
+   return(i);
+}
+
+
+/*
+ *  HttpInflateInitInternal
+ *
+ *  Called once the first bytes of the body are in sZ.  A deflate body
+ *  should have a zlib header, but some servers send it raw.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+HttpInflateInitInternal(HTTPSTREAM *pStream)
+{
+   int            iBits = 15 + 16;     // gzip
+   unsigned char  *p;
+
+
+   if (pStream->iEncoding == PKGCACHE_HTTP_DEFLATE)
+   {
+      p = pStream->sZ.next_in;
+      if ((p[0] & 0x0F) == Z_DEFLATED && (pStream->sZ.avail_in < 2
+                                          || !(((p[0] << 8) | p[1]) % 31)))
+         iBits = 15;
+      else
+         iBits = -15;
+   }
+   pStream->iInflate = (inflateInit2(&(pStream->sZ), iBits) == Z_OK);
+
+   return(pStream->iInflate ? 0 : ERROR_PKGCACHE_MEM);
+}
+
+
+/*
+ *  HttpReadInternal
+ *
+ *  funopen(3) read function, the body decoded.
+ *
+ *  Return: The number of bytes read, -1 on error
+ */
+
+int
+HttpReadInternal(void *pCookie, char *pBuffer, int l)
+{
+   int         i = 0,
+               iZ;
+   ssize_t     lBody;
+   HTTPSTREAM  *pStream = pCookie;
+
+
+   if (pStream->iEncoding == PKGCACHE_HTTP_IDENTITY)
+      i = HttpBodyInternal(pStream, (unsigned char *)pBuffer, l);
+   else
+   {
+      pStream->sZ.next_out = (unsigned char *)pBuffer;
+      pStream->sZ.avail_out = l;
+
+      // Until some output, the end of the compressed stream or an error
+      while (i >= 0 && !(pStream->iInflateEnd)
+             && pStream->sZ.avail_out == (uInt)l)
+      {
+         if (!(pStream->sZ.avail_in))
+         {
+            // The body ending first is a truncated stream
+            lBody = HttpBodyInternal(pStream, pStream->body, LNHTTPBLOCK);
+            if (lBody > 0)
+            {
+               pStream->sZ.next_in = pStream->body;
+               pStream->sZ.avail_in = lBody;
+            }
+            else
+               i = -1;
+         }
+         if (i >= 0 && !(pStream->iInflate)
+             && HttpInflateInitInternal(pStream))
+            i = -1;
+         if (i >= 0)
+         {
+            iZ = inflate(&(pStream->sZ), Z_NO_FLUSH);
+            if (iZ == Z_STREAM_END)
+               pStream->iInflateEnd = 1;
+            else if (iZ != Z_OK && iZ != Z_BUF_ERROR)
+               i = -1;
+         }
+      }
+      if (i >= 0)
+         i = l - pStream->sZ.avail_out;
+   }
+   if (i < 0)
+      errno = EIO;
+
+   return(i);
+}
+
+
+/*
+ *  HttpCloseInternal
+ *
+ *  Return: 0
+ */
+
+int
+HttpCloseInternal(void *pCookie)
+{
+   HTTPSTREAM  *pStream = pCookie;
+
+
+   if (pStream->iInflate)
+      inflateEnd(&(pStream->sZ));
+   if (pStream->iFd >= 0)
+      close(pStream->iFd);
+   free(pStream);
+
+   return(0);
+}
+
+
+/*
+ *  HttpHostInternal
+ *
+ *  The host and port of pUrl as written in a URL or a Host header, an
+ *  IPv6 address being in brackets.  sz must be LNHTTPLINE long.
+ */
+
+void
+HttpHostInternal(const struct url *pUrl,     char *sz)
+{
+   const char  *szFormat;
+
+
+   if (strchr(pUrl->host, ':') && *(pUrl->host) != '[')
+      szFormat = pUrl->port ? "[%s]:%d" : "[%s]";
+   else
+      szFormat = pUrl->port ? "%s:%d" : "%s";
+   snprintf(sz, LNHTTPLINE, szFormat, pUrl->host, pUrl->port);
+}
+
+
+/*
+ *  HttpConnectInternal
+ *
+ *  The connection gives up after the -timeout seconds, like the reads
+ *  and writes.  Without -timeout, only the watchdog's -firstbyte limit
+ *  interrupts it, before the system's own connection timeout.
+ *
+ *  Return: The connected socket, or -1
+ */
+
+int
+HttpConnectInternal(const struct url *pUrl)
+{
+   int               iErr,
+                     iFd = -1,
+                     iFlags,
+                     iTimeout = 0;
+   char              *p,
+                     szHost[LNHTTPLINE],
+                     szPort[16];
+   socklen_t         iLength;
+   struct addrinfo   sHints,
+                     *pInfo = NULL,
+                     *pNext;
+   struct pollfd     sPoll;
+   struct timeval    sTimeout;
+
+
+   // Same timeout as fetch, see -timeout
+   p = getenv(ENVHTTPTIMEOUT);
+   if (p && atoi(p) > 0)
+      iTimeout = atoi(p);
+
+   // An IPv6 address may come in brackets
+   StrnCopy(szHost, pUrl->host + (*(pUrl->host) == '['), LNHTTPLINE);
+   p = strchr(szHost, ']');
+   if (p)
+      *p = 0;
+
+   memset(&sHints, 0, sizeof(sHints));
+   sHints.ai_family = AF_UNSPEC;
+   sHints.ai_socktype = SOCK_STREAM;
+   sprintf(szPort, "%d", pUrl->port ? pUrl->port : 80);
+   if (!getaddrinfo(szHost, szPort, &sHints, &pInfo))
+   {
+      for (pNext = pInfo ; pNext && iFd < 0 ; pNext = pNext->ai_next)
+      {
+         iFd = socket(pNext->ai_family, pNext->ai_socktype,
+                      pNext->ai_protocol);
+         if (iFd >= 0)
+         {
+            iFlags = fcntl(iFd, F_GETFL);
+            if (iTimeout)
+               fcntl(iFd, F_SETFL, iFlags | O_NONBLOCK);
+            iErr = connect(iFd, pNext->ai_addr, pNext->ai_addrlen) ? errno
+                                                                    : 0;
+            if (iErr == EINPROGRESS)
+            {
+               sPoll.fd = iFd;
+               sPoll.events = POLLOUT;
+               iLength = sizeof(iErr);
+               if (poll(&sPoll, 1, iTimeout * 1000) != 1
+                   || getsockopt(iFd, SOL_SOCKET, SO_ERROR, &iErr, &iLength))
+                  iErr = ETIMEDOUT;
+            }
+            fcntl(iFd, F_SETFL, iFlags);
+            if (iErr)
+            {
+               close(iFd);
+               iFd = -1;
+            }
+         }
+      }
+      freeaddrinfo(pInfo);
+   }
+
+   if (iFd >= 0 && iTimeout)
+   {
+      sTimeout.tv_sec = iTimeout;
+      sTimeout.tv_usec = 0;
+      setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+      setsockopt(iFd, SOL_SOCKET, SO_SNDTIMEO, &sTimeout, sizeof(sTimeout));
+   }
+
+   return(iFd);
+}
+
+
+/*
+ *  HttpRequestInternal
+ *
+ *  Send the GET request of pUrl, then read the response up to its
+ *  body.  A redirection returns its URL in szLocation.
+ *
+ *  Return: The body stream, NULL with *piStatus set on failure
+ */
+
+FILE *
+HttpRequestInternal(const struct url *pUrl, struct url_stat *pStat,
+                    const time_t iModified,     char *szLocation,
+                       int *piStatus)
+{
+   int         iErr = 0,
+               iStatus = 0;
+   char        *p,
+               sz[LNHTTPLINE];
+   ssize_t     l;
+   size_t      i;
+   struct tm   sTm;
+   FILE        *pFile = NULL;
+   BUFFER      sRequest = {NULL, 0, 0};
+   HTTPSTREAM  *pStream;
+
+
+   *szLocation = 0;
+   pStream = malloc(sizeof(HTTPSTREAM));
+   if (pStream)
+   {
+      pStream->iChunked = 0;
+      pStream->iEncoding = PKGCACHE_HTTP_IDENTITY;
+      pStream->iEof = 0;
+      pStream->iInflate = 0;
+      pStream->iInflateEnd = 0;
+      pStream->iRaw = 0;
+      pStream->iRawLength = 0;
+      pStream->iLeft = -1;
+      memset(&(pStream->sZ), 0, sizeof(z_stream));
+      pStream->iFd = HttpConnectInternal(pUrl);
+      if (pStream->iFd < 0)
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   else
+      iErr = ERROR_PKGCACHE_MEM;
+
+   // The connection is closed after the response, like fetch does
+   if (!iErr)
+   {
+      HttpHostInternal(pUrl,     sz);
+      iErr = BufferAppendStr(&sRequest, "GET ");
+      if (!iErr)
+         iErr = BufferAppendStr(&sRequest, *(pUrl->doc) ? pUrl->doc : "/");
+      if (!iErr)
+         iErr = BufferAppendStr(&sRequest, " HTTP/1.1\r\nHost: ");
+      if (!iErr)
+         iErr = BufferAppendStr(&sRequest, sz);
+      if (!iErr)
+         iErr = BufferAppendStr(&sRequest, "\r\n"
+                   "User-Agent: " PKGCACHE_HTTP_USERAGENT "\r\n"
+                   "Accept-Encoding: gzip, deflate\r\n"
+                   "Connection: close\r\n");
+      if (!iErr && iModified)
+      {
+         strftime(sz, LNHTTPLINE, "If-Modified-Since: " PKGCACHE_HTTP_DATE
+                  "\r\n", gmtime_r(&iModified, &sTm));
+         iErr = BufferAppendStr(&sRequest, sz);
+      }
+      if (!iErr)
+         iErr = BufferAppendStr(&sRequest, "\r\n");
+   }
+   for (i = 0 ; !iErr && i < sRequest.iLength ; i += l)
+   {
+      l = write(pStream->iFd, sRequest.p + i, sRequest.iLength - i);
+      if (l <= 0)
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+   BufferFree(&sRequest);
+
+   // The status line, after the interim responses, then the headers
+   while (!iErr && iStatus < 200)
+   {
+      iErr = HttpLineInternal(pStream,     sz);
+      if (!iErr && sscanf(sz, "HTTP/%*d.%*d %d", &iStatus) != 1)
+         iErr = ERROR_PKGCACHE_FILE_R;
+      if (!iErr)
+         iErr = HttpLineInternal(pStream,     sz);
+      while (!iErr && *sz)
+      {
+         p = strchr(sz, ':');
+         if (p)
+         {
+            *p = 0;
+            do
+               p++;
+            while (*p == ' ' || *p == '\t') ;
+         }
+         else
+            p = sz + strlen(sz);
+
+         if (!strcasecmp(sz, "Content-Length"))
+            pStream->iLeft = strtoll(p, NULL, 10);
+         else if (!strcasecmp(sz, "Transfer-Encoding"))
+            pStream->iChunked = !strncasecmp(p, "chunked", 7);
+         else if (!strcasecmp(sz, "Content-Encoding"))
+         {
+            if (!strcasecmp(p, "gzip") || !strcasecmp(p, "x-gzip"))
+               pStream->iEncoding = PKGCACHE_HTTP_GZIP;
+            else if (!strcasecmp(p, "deflate"))
+               pStream->iEncoding = PKGCACHE_HTTP_DEFLATE;
+            else if (strcasecmp(p, "identity"))
+               iErr = ERROR_PKGCACHE_FILE_R;    // Not asked for
+         }
+         else if (!strcasecmp(sz, "Last-Modified"))
+         {
+            memset(&sTm, 0, sizeof(sTm));
+            if (strptime(p, PKGCACHE_HTTP_DATE, &sTm))
+               pStat->mtime = timegm(&sTm);
+         }
+         else if (!strcasecmp(sz, "Location"))
+            StrnCopy(szLocation, p, LNFILENAME);
+
+         if (!iErr)
+            iErr = HttpLineInternal(pStream,     sz);
+      }
+   }
+
+   // Only a redirection keeps its location
+   if (iErr || (iStatus != 301 && iStatus != 302 && iStatus != 303
+                && iStatus != 307 && iStatus != 308))
+      *szLocation = 0;
+
+   *piStatus = 0;
+   if (!iErr)
+   {
+      switch (iStatus)
+      {
+         case 200:
+            if (pStream->iChunked)
+               pStream->iLeft = 0;
+            else if (!(pStream->iLeft))
+               pStream->iEof = 1;
+            pStat->size = (pStream->iEncoding == PKGCACHE_HTTP_IDENTITY
+                           && !(pStream->iChunked)) ? pStream->iLeft : -1;
+            pStat->atime = pStat->mtime;
+            pFile = funopen(pStream, HttpReadInternal, NULL, NULL,
+                            HttpCloseInternal);
+            if (!pFile)
+               *piStatus = FETCH_NETWORK;
+            break;
+
+         case 301:
+         case 302:
+         case 303:
+         case 307:
+         case 308:
+            if (!*szLocation)
+               *piStatus = FETCH_NETWORK;
+            break;
+
+         case 304:
+            *piStatus = FETCH_UNCHANGED;
+            break;
+
+         case 404:
+         case 410:
+            *piStatus = FETCH_UNAVAIL;
+            break;
+
+         default:
+            *piStatus = FETCH_NETWORK;
+            break;
+      }
+   }
+   else
+      *piStatus = FETCH_NETWORK;
+   if (!pFile && pStream)
+      HttpCloseInternal(pStream);
+
+#ifdef PKGCACHE_VERBOSE
+printf("HttpRequestInternal(%s%s): status=%d encoding=%d chunked=%d iErr=%d\n",
+       pUrl->host, pUrl->doc, iStatus, pStream ? pStream->iEncoding : -1,
+       pStream ? pStream->iChunked : -1, iErr);
+#endif
+
+   return(pFile);
+}
+
+
+/*
+ *  HttpFetchURL
+ *
+ *  Same as HttpGetURL, with fetch, uncompressed.  fetchLastErrCode is
+ *  shared by the threads, so it's read under a lock held since the
+ *  request.
+ *
+ *  Return: The body stream, NULL on failure
+ */
+
+FILE *
+HttpFetchURL(const char *pUrl, struct url_stat *pStat,
+             const time_t iModified,     int *piStatus)
+{
+   FILE        *pFile;
+   struct url  *pUrlIms = NULL;
+
+
+   if (iModified)
+      pUrlIms = fetchParseURL(pUrl);
+
+   pthread_mutex_lock(&gsHttpFetchMutex);
+   if (pUrlIms)
+   {
+      // A 304 fails with FETCH_UNCHANGED
+      pUrlIms->ims_time = iModified;
+      pFile = fetchXGet(pUrlIms, pStat, "i");
+   }
+   else
+      pFile = fetchXGetURL(pUrl, pStat, "");
+   *piStatus = pFile ? 0 : fetchLastErrCode;
+   pthread_mutex_unlock(&gsHttpFetchMutex);
+
+   if (pUrlIms)
+      fetchFreeURL(pUrlIms);
+
+   return(pFile);
+}
+
+
+/*
+ *  HttpGetURL
+ *
+ *  Same as fetchXGetURL, asking for a compressed body.  With
+ *  iModified, only if modified since, see fetchXGet's "i" flag.
+ *  *piStatus is the FETCH_xyz code of a failure, 0 on success.
+ *
+ *  Return: The decoded body stream, NULL on failure
+ */
+
+FILE *
+HttpGetURL(const char *pUrl, struct url_stat *pStat,
+           const time_t iModified,     int *piStatus)
+{
+   int         i = 0,
+               iDirect;
+   char        *p,
+               szHost[LNHTTPLINE];
+   FILE        *pFile = NULL;
+   FILENAME    szLocation,
+               szUrl;
+   struct url  *pUrlParsed;
+
+
+   StrnCopy(szUrl, pUrl, LNFILENAME);
+   do
+   {
+      *szLocation = 0;
+      pUrlParsed = fetchParseURL(szUrl);
+
+      // fetch handles the proxies, the credentials and https
+      iDirect = (pUrlParsed && !strcmp(pUrlParsed->scheme, "http")
+                 && !*(pUrlParsed->user) && !*(pUrlParsed->pwd)
+                 && !getenv("HTTP_PROXY") && !getenv("http_proxy"));
+      if (iDirect)
+         pFile = HttpRequestInternal(pUrlParsed, pStat, iModified,
+                                     szLocation,     piStatus);
+      else
+         pFile = HttpFetchURL(szUrl, pStat, iModified,     piStatus);
+
+      // A redirection, absolute or relative to the server
+      if (!pFile && *szLocation)
+      {
+         if (*szLocation == '/')
+            HttpHostInternal(pUrlParsed,     szHost);
+         if (*szLocation == '/' && strlen(szHost) + 8 + strlen(szLocation)
+                                   < LNFILENAME)
+            sprintf(szUrl, "http://%s%s", szHost, szLocation);
+         else if (strstr(szLocation, "://"))
+            strcpy(szUrl, szLocation);
+         else
+         {
+            // Relative to the directory of the URL
+            p = strrchr(szUrl, '/');
+            if (p && (p - szUrl) + strlen(szLocation) + 2 < LNFILENAME)
+               strcpy(p + 1, szLocation);
+            else
+               *szLocation = 0;
+         }
+      }
+      if (pUrlParsed)
+         fetchFreeURL(pUrlParsed);
+      i++;
+   }
+   while (!pFile && *szLocation && i < PKGCACHE_HTTP_REDIRECTS) ;
+
+   if (!pFile && *szLocation)
+      *piStatus = FETCH_NETWORK;     // Too many redirections
+
+#ifdef PKGCACHE_VERBOSE
+printf("HttpGetURL(%s): %s\n", pUrl, pFile ? "OK" : "failed");
+#endif
+
+   return(pFile);
+}
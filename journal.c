@@ -0,0 +1,319 @@
+/* 
+ * File:    journal.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Download run journal. Tested under FreeBSD 11.2.
+ *
+ *          The journal, '.pkgcachejournal', is stored in the packages
+ *          directory while a DOWNLOAD is in progress.  Each line is a
+ *          record made of a one letter tag, a space and a value:
+ *            L <url>      : The listing and all its files are done.
+ *            F <pathname> : The file is downloaded and checked.
+ *            N <pkgname>  : The package name was added to the list.
+ *            P            : A download pass is over.
+ *          Records are flushed to disk as they are written, so that an
+ *          interrupted run can be replayed by the next one.  The
+ *          journal is deleted once the package list is saved.  The
+ *          records can be written by concurrent download jobs.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "journal.h"
+#include "list.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_JOURNAL_FILENAME   ".pkgcachejournal"
+
+#define PKGCACHE_JOURNAL_FILE       'F'
+#define PKGCACHE_JOURNAL_LISTING    'L'
+#define PKGCACHE_JOURNAL_NAME       'N'
+#define PKGCACHE_JOURNAL_PASS       'P'
+
+
+/*
+ *  Object variables
+ */
+
+FILE     *gpJournalFile = NULL;
+FILENAME gszJournalFilename = "";
+STRSET   gsJournalFiles = {0, 0, NULL},
+         gsJournalListings = {0, 0, NULL};
+pthread_mutex_t gsJournalMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ *  JournalWriteInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+JournalWriteInternal(const char cTag, const char *szValue)
+{
+   int iErr = 0;
+
+
+   pthread_mutex_lock(&gsJournalMutex);
+   if (gpJournalFile)
+   {
+      if (fprintf(gpJournalFile, "%c %s\n", cTag, szValue) < 0
+          || fflush(gpJournalFile)
+          || fsync(fileno(gpJournalFile)))
+         iErr = ERROR_PKGCACHE_FILE_W;
+   }
+   pthread_mutex_unlock(&gsJournalMutex);
+
+   return(iErr);
+}
+
+
+/*
+ *  JournalClose
+ */
+
+void
+JournalClose(const int iDelete)
+{
+   if (gpJournalFile)
+   {
+      fclose(gpJournalFile);
+      gpJournalFile = NULL;
+
+      if (iDelete)
+         remove(gszJournalFilename);
+   }
+
+   StrSetClear(&gsJournalFiles);
+   StrSetClear(&gsJournalListings);
+}
+
+
+/*
+ *  JournalFile
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+JournalFile(const char *szPathname)
+{
+   int iErr;
+
+
+   pthread_mutex_lock(&gsJournalMutex);
+   iErr = StrSetAdd(&gsJournalFiles, szPathname);
+   pthread_mutex_unlock(&gsJournalMutex);
+   if (!iErr)
+      iErr = JournalWriteInternal(PKGCACHE_JOURNAL_FILE, szPathname);
+
+   return(iErr);
+}
+
+
+/*
+ *  JournalIsFile
+ *
+ *  Return: TRUE if the file is already done in this pass.
+ */
+
+int
+JournalIsFile(const char *szPathname)
+{
+   int iBool;
+
+
+   pthread_mutex_lock(&gsJournalMutex);
+   iBool = StrSetIsFound(&gsJournalFiles, szPathname);
+   pthread_mutex_unlock(&gsJournalMutex);
+
+   return(iBool);
+}
+
+
+/*
+ *  JournalIsListing
+ *
+ *  Return: TRUE if the listing is already done in this pass.
+ */
+
+int
+JournalIsListing(const char *szUrl)
+{
+   int iBool;
+
+
+   pthread_mutex_lock(&gsJournalMutex);
+   iBool = StrSetIsFound(&gsJournalListings, szUrl);
+   pthread_mutex_unlock(&gsJournalMutex);
+
+   return(iBool);
+}
+
+
+/*
+ *  JournalListing
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+JournalListing(const char *szUrl)
+{
+   int iErr;
+
+
+   pthread_mutex_lock(&gsJournalMutex);
+   iErr = StrSetAdd(&gsJournalListings, szUrl);
+   pthread_mutex_unlock(&gsJournalMutex);
+   if (!iErr)
+      iErr = JournalWriteInternal(PKGCACHE_JOURNAL_LISTING, szUrl);
+
+   return(iErr);
+}
+
+
+/*
+ *  JournalName
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+JournalName(const char *szPkgName)
+{
+   return(JournalWriteInternal(PKGCACHE_JOURNAL_NAME, szPkgName));
+}
+
+
+/*
+ *  JournalOpen
+ *
+ *  Replay the journal left behind by an interrupted run, if any, then
+ *  open it to record the current run.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+JournalOpen(const char *szPkgcachePathname,     int *piReplayed)
+{
+   int      i,
+            iErr = 0;
+   char     *p;
+   FILE     *pFile;
+   FILENAME sz;
+
+
+   *piReplayed = 0;
+   if (strlen(szPkgcachePathname) + strlen(PKGCACHE_JOURNAL_FILENAME)
+       < LNFILENAME)
+      sprintf(gszJournalFilename, "%s%s", szPkgcachePathname,
+              PKGCACHE_JOURNAL_FILENAME);
+   else
+      iErr = ERROR_PKGCACHE_MEM;
+
+   if (!iErr)
+   {
+      pFile = fopen(gszJournalFilename, "r");
+      if (pFile)
+      {
+         do
+         {
+            p = fgets(sz, LNFILENAME, pFile);
+            if (p)
+            {
+               // A torn last record, without its '\n', is ignored.
+               i = strlen(sz);
+               if (i > 2 && sz[i-1] == '\n' && sz[1] == ' ')
+               {
+                  sz[i-1] = 0;
+                  switch (*sz)
+                  {
+                     case PKGCACHE_JOURNAL_FILE:
+                        iErr = StrSetAdd(&gsJournalFiles, sz + 2);
+                        break;
+
+                     case PKGCACHE_JOURNAL_LISTING:
+                        iErr = StrSetAdd(&gsJournalListings, sz + 2);
+                        break;
+
+                     case PKGCACHE_JOURNAL_NAME:
+                        iErr = ListAdd(sz + 2);
+                        break;
+
+                     case PKGCACHE_JOURNAL_PASS:
+                        // Files and listings are revisited by the next pass
+                        StrSetClear(&gsJournalFiles);
+                        StrSetClear(&gsJournalListings);
+                        break;
+                  }
+                  (*piReplayed)++;
+               }
+            }
+         }
+         while (!iErr && p) ;
+
+         fclose(pFile);
+      }
+   }
+
+   if (!iErr)
+   {
+      gpJournalFile = fopen(gszJournalFilename, "a");
+      if (!gpJournalFile)
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+
+#ifdef PKGCACHE_VERBOSE
+printf("JournalOpen(%s) iErr=%d, replayed=%d\n", gszJournalFilename, iErr,
+       *piReplayed);
+#endif
+
+   return(iErr);
+}
+
+
+/*
+ *  JournalPass
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+JournalPass(void)
+{
+   StrSetClear(&gsJournalFiles);
+   StrSetClear(&gsJournalListings);
+
+   return(JournalWriteInternal(PKGCACHE_JOURNAL_PASS, ""));
+}
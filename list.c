@@ -14,6 +14,23 @@
  *          package repository.  The next lines contain the package's
  *          base name, i.e. without the version number.
  *
+ *          In memory, the names are stored back to back in a string
+ *          pool, and the sorted list is made of their offset and length
+ *          in the pool.  The names have no length limit.
+ *
+ *          A list is a LIST context.  The names are spread over shards,
+ *          each with its own pool and read-write lock, so that lookups
+ *          from many threads run concurrently and inserts only lock one
+ *          shard.  Iterating is done on a sorted snapshot taken by each
+ *          caller's LISTCURSOR, unaffected by later inserts.  The List
+ *          functions without a context use a default one.
+ *
+ *          Each shard also has a Bloom filter of its names, two bits
+ *          per name taken from the name's hash.  ListCtxMatch matches
+ *          a whole directory listing at once: the names the filters
+ *          reject are dropped right away, the others are sorted and
+ *          merged with the sorted shards in a single pass.
+ *
  * Web:     https://github.com/fossette/pkgcache/wiki
  *
  * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
@@ -34,39 +51,126 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <malloc_np.h>
+#include <pthread.h>
 #include <string.h>
 
 #include "common.h"
+#include "list.h"
 
 
 /*
  *  Constants
  */
 
-#define  LNPKGNAME                  50
 #define  PKGNAMELIST_INITIAL_COUNT  50
+#define  PKGCACHE_LIST_SHARDS       16    // A power of 2
+#define  PKGCACHE_LIST_BLOOM        16384 // Bits per shard, 2^14
+#define  PKGCACHE_LIST_TEMP         ".pkgcachetemp"
 
 
 /*
  *  Types
  */
 
-typedef char PKGNAME[LNPKGNAME];
+typedef struct
+{
+   int   iOffset,       // In the string pool
+         iLength;
+} PKGNAME;
+
+typedef struct
+{
+   int               iCount,
+                     iSize,
+                     iStatExisting,
+                     iStatNew;
+   BUFFER            sPool;
+   PKGNAME           *pList;
+   pthread_rwlock_t  sLock;
+   unsigned char     cBloom[PKGCACHE_LIST_BLOOM / 8];
+} SHARD;
+
+typedef struct
+{
+   int         iIndex,        // In the caller's array
+               iOffset,       // Of the clean name, in the match pool
+               iShard;
+   const char  *szPkgName;
+} MATCH;
+
+struct LIST
+{
+   char     szFilterNav[LNFILENAME],
+            szFilterPath[LNFILENAME],
+            szRepoUrl[LNFILENAME];
+   SHARD    sShards[PKGCACHE_LIST_SHARDS];
+};
 
 
 /*
  *  Object variables
  */
 
-int      giGet = -1,
-         giPkgnameListCount = 0,
-         giPkgnameListNextAdd = 0,
-         giStatExisting = 0,
-         giStatNew = 0;
-char     gszPkgRepoFilterNav[LNFILENAME] = "",
-         gszPkgRepoFilterPath[LNFILENAME] = "",
-         gszPkgRepoUrl[LNFILENAME] = "";
-PKGNAME  *gpPkgnameList = NULL;
+LIST           *gpList = NULL;      // Default context
+LISTCURSOR     gsListCursor = {0, 0, NULL, {NULL, 0, 0}};
+pthread_once_t gsListOnce = PTHREAD_ONCE_INIT;
+
+
+/*
+ *  ListNameInternal
+ */
+
+#define ListNameInternal(pShard, i) \
+           ((pShard)->sPool.p + (pShard)->pList[i].iOffset)
+
+
+/*
+ *  ListBloomAddInternal, ListBloomIsFoundInternal
+ *
+ *  The shard is taken from the low bits of the hash, the filter bits
+ *  from the 2 x 14 high bits.
+ */
+
+#define ListBloomBitInternal(pShard, i) \
+           ((pShard)->cBloom[(i) >> 3] & (1 << ((i) & 7)))
+#define ListBloomSetInternal(pShard, i) \
+           ((pShard)->cBloom[(i) >> 3] |= (1 << ((i) & 7)))
+
+#define ListBloomAddInternal(pShard, iHash) \
+           do \
+           { \
+              ListBloomSetInternal(pShard, ((iHash) >> 4) & 0x3FFF); \
+              ListBloomSetInternal(pShard, ((iHash) >> 18) & 0x3FFF); \
+           } \
+           while (0)
+#define ListBloomIsFoundInternal(pShard, iHash) \
+           (ListBloomBitInternal(pShard, ((iHash) >> 4) & 0x3FFF) \
+            && ListBloomBitInternal(pShard, ((iHash) >> 18) & 0x3FFF))
+
+
+/*
+ *  ListCmpInternal
+ *
+ *  Compare the entry i with the iLength bytes of pPkgName, which don't
+ *  need a NUL.  Same order as strcmp().
+ *
+ *  Return: the strcmp() like result.
+ */
+
+int
+ListCmpInternal(SHARD *pShard, const int i, const char *pPkgName,
+                const int iLength)
+{
+   int   iCmp;
+
+
+   iCmp = memcmp(ListNameInternal(pShard, i), pPkgName,
+                 MIN(pShard->pList[i].iLength, iLength));
+   if (!iCmp)
+      iCmp = pShard->pList[i].iLength - iLength;
+
+   return(iCmp);
+}
 
 
 /*
@@ -76,7 +180,8 @@ PKGNAME  *gpPkgnameList = NULL;
  */
 
 int
-ListFindInternal(char *szPkgName, int iMin, int iMax,     int *pIndex)
+ListFindInternal(SHARD *pShard, const char *pPkgName, const int iLength,
+                    int iMin, int iMax, int *pIndex)
 {
    int   iIndex,
          iCmp;   
@@ -89,7 +194,7 @@ ListFindInternal(char *szPkgName, int iMin, int iMax,     int *pIndex)
       do
       {
          iIndex++;
-         iCmp = strcmp(gpPkgnameList[iIndex], szPkgName);
+         iCmp = ListCmpInternal(pShard, iIndex, pPkgName, iLength);
       }
       while (iCmp < 0 && iIndex < iMax) ;
 
@@ -99,13 +204,15 @@ ListFindInternal(char *szPkgName, int iMin, int iMax,     int *pIndex)
    {
       // Binary search is optimal in this case
       iIndex = (iMin + iMax) / 2;
-      iCmp = strcmp(gpPkgnameList[iIndex], szPkgName);
+      iCmp = ListCmpInternal(pShard, iIndex, pPkgName, iLength);
       if (iCmp)
       {
          if (iCmp < 0)
-            iCmp = ListFindInternal(szPkgName, iIndex + 1, iMax,     pIndex);
+            iCmp = ListFindInternal(pShard, pPkgName, iLength, iIndex + 1,
+                                    iMax,     pIndex);
          else
-            iCmp = ListFindInternal(szPkgName, iMin, iIndex - 1,     pIndex);
+            iCmp = ListFindInternal(pShard, pPkgName, iLength, iMin,
+                                    iIndex - 1,     pIndex);
       }
       else
          *pIndex = iIndex;
@@ -117,71 +224,83 @@ ListFindInternal(char *szPkgName, int iMin, int iMax,     int *pIndex)
 
 /*
  *  ListPkgNameValidateInternal
+ *
+ *  The package name is the first *piLength bytes of szPkgNameRaw,
+ *  whatever its length, without its version or trailing spaces.
+ *
+ *  Return: the hash of the package name, its low bits being the shard.
  */
 
-void
-ListPkgNameValidateInternal(char *szPkgNameRaw,     char *szPkgName)
+unsigned int
+ListPkgNameValidateInternal(const char *szPkgNameRaw,     int *piLength)
 {
-   int i;
+   int            i = 0;
+   unsigned int   iHash = 2166136261U;
    
    
    if (szPkgNameRaw)
    {
-      for (i = LNPKGNAME-1 ; *szPkgNameRaw
-                             && (*szPkgNameRaw != '-'
-                                 || !isdigit(*(szPkgNameRaw+1)) )
-                             && !isspace(*szPkgNameRaw) && i ; i--)
-      {
-         *szPkgName = *szPkgNameRaw;
-         szPkgName++;
-         szPkgNameRaw++;
-      }
+      for ( ; szPkgNameRaw[i]
+              && (szPkgNameRaw[i] != '-' || !isdigit(szPkgNameRaw[i+1]))
+              && !isspace(szPkgNameRaw[i]) ; i++)
+         iHash = (iHash ^ (unsigned char)szPkgNameRaw[i]) * 16777619U;
    }
 
-   *szPkgName = 0;
+   *piLength = i;
+
+   return(iHash);
 }
 
 
 /*
- *  ListAdd
+ *  ListDefaultInternal
+ */
+
+void
+ListDefaultInternal(void)
+{
+   gpList = ListNew();
+}
+
+
+/*
+ *  ListCtxAdd
+ *
+ *  *piNew, if not NULL, tells if the package name was added.
  *
  *  Return: ERROR_PKGCACHE_xyz
  */
 
 int
-ListAdd(char *szPkgNameRaw)
+ListCtxAdd(LIST *pList, const char *szPkgNameRaw,     int *piNew)
 {
-   int      i,
-            iCmp,
-            iErr = 0,
-            iIndex;
-   PKGNAME  szPkgName;
+   int            iCmp = 0,
+                  iErr = 0,
+                  iIndex,
+                  iLength,
+                  iOffset;
+   unsigned int   iHash;
+   SHARD          *pShard;
+   PKGNAME        *p;
 
 
    // Clean up the package name
-   ListPkgNameValidateInternal(szPkgNameRaw,     szPkgName);
+   iHash = ListPkgNameValidateInternal(szPkgNameRaw,     &iLength);
+   pShard = pList->sShards + (iHash & (PKGCACHE_LIST_SHARDS - 1));
    
-   if (*szPkgName)
+   pthread_rwlock_wrlock(&(pShard->sLock));
+   if (iLength)
    {
       // Enough space?
-      if (giPkgnameListCount)
+      if (pShard->iSize - pShard->iCount < 2)
       {
-         if (giPkgnameListCount - giPkgnameListNextAdd < 2)
+         iIndex = pShard->iSize ? pShard->iSize * 2 : PKGNAMELIST_INITIAL_COUNT;
+         p = realloc(pShard->pList, sizeof(PKGNAME) * iIndex);
+         if (p)
          {
-            giPkgnameListCount *= 2;
-            gpPkgnameList = realloc(gpPkgnameList, sizeof(PKGNAME) * giPkgnameListCount);
-            if (!gpPkgnameList)
-            {
-               giPkgnameListCount = 0;
-               iErr = ERROR_PKGCACHE_MEM;
-            }
+            pShard->pList = p;
+            pShard->iSize = iIndex;
          }
-      }
-      else
-      {
-         gpPkgnameList = malloc(sizeof(PKGNAME) * PKGNAMELIST_INITIAL_COUNT);
-         if (gpPkgnameList)
-            giPkgnameListCount = PKGNAMELIST_INITIAL_COUNT;
          else
             iErr = ERROR_PKGCACHE_MEM;
       }
@@ -189,36 +308,44 @@ ListAdd(char *szPkgNameRaw)
       if (!iErr)
       {
          // Find out if the package name has already been added
-         if (giPkgnameListNextAdd)
+         if (pShard->iCount)
          {
             // Optimization check since the list is expected to be sorted.
-            iCmp = ListFindInternal(szPkgName, giPkgnameListNextAdd-1,
-                                               giPkgnameListNextAdd-1,
-                                                  &iIndex);      
+            iCmp = ListFindInternal(pShard, szPkgNameRaw, iLength,
+                                    pShard->iCount-1, pShard->iCount-1,
+                                       &iIndex);      
             if (iCmp > 0)
-               iCmp = ListFindInternal(szPkgName, 0, giPkgnameListNextAdd-1,
-                                          &iIndex);
+               iCmp = ListFindInternal(pShard, szPkgNameRaw, iLength, 0,
+                                       pShard->iCount-1,     &iIndex);
             if (iCmp < 0)
                iIndex++;
          }
          else
          {
-            // First package name to add to the list
+            // First package name to add to the shard
             iIndex = 0;
             iCmp = 1;
          }
 
          if (iCmp)
          {
-            giGet = -1;    // Invalidate ListGetNext()
-
+            // Add the package name to the pool, with its NUL
+            iOffset = pShard->sPool.iLength;
+            iErr = BufferAppend(&(pShard->sPool), szPkgNameRaw, iLength);
+            if (!iErr)
+               iErr = BufferAppend(&(pShard->sPool), "", 1);
+         }
+         if (iCmp && !iErr)
+         {
             // Shift the entries if needed
-            for (i = giPkgnameListNextAdd ; i > iIndex ; i--)
-               strcpy(gpPkgnameList[i], gpPkgnameList[i - 1]);
+            memmove(pShard->pList + iIndex + 1, pShard->pList + iIndex,
+                    sizeof(PKGNAME) * (pShard->iCount - iIndex));
 
             // Add the package name
-            strcpy(gpPkgnameList[iIndex], szPkgName);
-            giPkgnameListNextAdd++;
+            pShard->pList[iIndex].iOffset = iOffset;
+            pShard->pList[iIndex].iLength = iLength;
+            pShard->iCount++;
+            ListBloomAddInternal(pShard, iHash);
          }
       }
 
@@ -226,154 +353,104 @@ ListAdd(char *szPkgNameRaw)
       if (!iErr)
       {
          if (iCmp)
-            giStatNew++;
+            pShard->iStatNew++;
          else
-            giStatExisting++;
+            pShard->iStatExisting++;
       }
    }
    // else
    //    exit silently if no package to add
+   pthread_rwlock_unlock(&(pShard->sLock));
 
-   return(iErr);
-}
-
-
-/*
- *  ListGetNext
- *
- *  Return: TRUE if found.
- */
-
-int
-ListGetNext(     char *szPkgName)
-{
-   int iBool;
-   
-
-   if (giGet < 0)
-      iBool = 0;
-   else
-   {
-      strcpy(szPkgName, gpPkgnameList[giGet]);
-      giGet++;
-      iBool = (giGet < giPkgnameListNextAdd);
-      if (!iBool)
-         giGet = -1;
-   }
-   
-   return(iBool);
-}
-
+   if (piNew)
+      *piNew = (iCmp && !iErr);
 
-/*
- *  ListGetFirst
- *
- *  Return: TRUE if found.
- */
-
-int
-ListGetFirst(     char *szPkgName)
-{
-   int iBool;
-   
-
-   if (giPkgnameListNextAdd)
-   {
-      giGet = 0;
-      iBool = ListGetNext(     szPkgName);
-   }
-   else
-      iBool = 0;
-   
-   return(iBool);
+   return(iErr);
 }
 
 
 /*
- *  ListGetNavFilter
+ *  ListCtxGetNavFilter
  */
 
-
 void
-ListGetNavFilter(     char *pNavFilter)
+ListCtxGetNavFilter(LIST *pList,     char *pNavFilter)
 {
-   strcpy(pNavFilter, gszPkgRepoFilterNav);
+   strcpy(pNavFilter, pList->szFilterNav);
 }
 
 
 /*
- *  ListGetPathFilter
+ *  ListCtxGetPathFilter
  */
 
-
 void
-ListGetPathFilter(     char *pPathFilter)
+ListCtxGetPathFilter(LIST *pList,     char *pPathFilter)
 {
-   strcpy(pPathFilter, gszPkgRepoFilterPath);
+   strcpy(pPathFilter, pList->szFilterPath);
 }
 
 
 /*
- *  ListGetRepoUrl
+ *  ListCtxGetRepoUrl
  */
 
-
 void
-ListGetRepoUrl(     char *pRepoUrl)
+ListCtxGetRepoUrl(LIST *pList,     char *pRepoUrl)
 {
-   strcpy(pRepoUrl, gszPkgRepoUrl);
+   strcpy(pRepoUrl, pList->szRepoUrl);
 }
 
 
 /*
- *  ListGetStatExisting
- *
- *  Return: a positive count.
+ *  ListCtxGetStat
  */
 
-
-int
-ListGetStatExisting(void)
+void
+ListCtxGetStat(LIST *pList,     int *piNew, int *piExisting)
 {
-   return(giStatExisting);
-}
-
-
-/*
- *  ListGetStatNew
- *
- *  Return: a positive count.
- */
+   int i;
 
 
-int
-ListGetStatNew(void)
-{
-   return(giStatNew);
+   *piNew = 0;
+   *piExisting = 0;
+   for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+   {
+      pthread_rwlock_rdlock(&(pList->sShards[i].sLock));
+      *piNew += pList->sShards[i].iStatNew;
+      *piExisting += pList->sShards[i].iStatExisting;
+      pthread_rwlock_unlock(&(pList->sShards[i].sLock));
+   }
 }
 
 
 /*
- *  ListIsFound
+ *  ListCtxIsFound
  *
  *  Return: TRUE if found.
  */
 
 int
-ListIsFound(char *szPkgNameRaw)
+ListCtxIsFound(LIST *pList, const char *szPkgNameRaw)
 {
-   int      iIndex,
-            iBool;
-   PKGNAME  szPkgName;
+   int            iIndex,
+                  iBool,
+                  iLength;
+   unsigned int   iHash;
+   SHARD          *pShard;
 
 
    // Clean up the package name
-   ListPkgNameValidateInternal(szPkgNameRaw,     szPkgName);
+   iHash = ListPkgNameValidateInternal(szPkgNameRaw,     &iLength);
+   pShard = pList->sShards + (iHash & (PKGCACHE_LIST_SHARDS - 1));
    
-   if (giPkgnameListNextAdd && *szPkgName)
-      iBool = !ListFindInternal(szPkgName, 0, giPkgnameListNextAdd - 1,     &iIndex);
+   pthread_rwlock_rdlock(&(pShard->sLock));
+   if (pShard->iCount && iLength && ListBloomIsFoundInternal(pShard, iHash))
+      iBool = !ListFindInternal(pShard, szPkgNameRaw, iLength, 0,
+                                pShard->iCount - 1,     &iIndex);
    else
       iBool = 0;
+   pthread_rwlock_unlock(&(pShard->sLock));
    
 #ifdef PKGCACHE_VERBOSE
 printf("ListIsFound(%s) iBool=%d\n", szPkgNameRaw, iBool);
@@ -384,21 +461,22 @@ printf("ListIsFound(%s) iBool=%d\n", szPkgNameRaw, iBool);
 
 
 /*
- *  ListLoad
+ *  ListCtxLoad
  *
  *  Return: ERROR_PKGCACHE_xyz
  */
 
 int
-ListLoad(char *szFilename)
+ListCtxLoad(LIST *pList, const char *szFilename)
 {
    int      i,
             j,
             k,
             iErr = 0;
-   char     sz[LNSZ],
+   char     *pLine = NULL,
             szUrl[LNFILENAME],
             *p;
+   size_t   iLine = 0;
    FILE     *pFile;
 
    
@@ -435,21 +513,21 @@ ListLoad(char *szFilename)
                   j++;
                if (j < k)
                {
-                  strcpy(gszPkgRepoFilterNav, szUrl + j);
+                  strcpy(pList->szFilterNav, szUrl + j);
                   j = 0;
-                  k = strlen(gszPkgRepoFilterNav);
+                  k = strlen(pList->szFilterNav);
 
-                  while (j < k && !isspace(gszPkgRepoFilterNav[j]))
+                  while (j < k && !isspace(pList->szFilterNav[j]))
                      j++;
                   if (j < k)
                   {
                      // The path filter is found, isolate it!
-                     gszPkgRepoFilterNav[j] = 0;
+                     pList->szFilterNav[j] = 0;
                      j++;
-                     while (j < k && isspace(gszPkgRepoFilterNav[j]))
+                     while (j < k && isspace(pList->szFilterNav[j]))
                         j++;
                      if (j < k)
-                        strcpy(gszPkgRepoFilterPath, gszPkgRepoFilterNav + j);
+                        strcpy(pList->szFilterPath, pList->szFilterNav + j);
                   }
                }
             }
@@ -461,28 +539,29 @@ ListLoad(char *szFilename)
                szUrl[i] = 0;
             }
 
-            strcpy(gszPkgRepoUrl, szUrl);
+            strcpy(pList->szRepoUrl, szUrl);
          }
       }
 
-      // Get the package name list
+      // Get the package name list, whatever the length of the lines
       while (!iErr && p)
       {
-         p = fgets(sz, LNPKGNAME, pFile);
-         if (p)
-         {
-            sz[LNPKGNAME-1] = 0;            
-            iErr = ListAdd(sz);
-         }
+         if (getline(&pLine, &iLine, pFile) < 0)
+            p = NULL;
+         else
+            iErr = ListCtxAdd(pList, pLine,     NULL);
       }
 
       // Done!
       fclose(pFile);
+      free(pLine);
 
       // Reset stats because the LOAD phase does not count.
-      giStatExisting = 0;
-      giStatNew = 0;
-
+      for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+      {
+         pList->sShards[i].iStatExisting = 0;
+         pList->sShards[i].iStatNew = 0;
+      }
    }
 
    return(iErr);
@@ -490,72 +569,595 @@ ListLoad(char *szFilename)
 
 
 /*
- *  ListQuit
+ *  ListMatchCmpInternal
+ *
+ *  Return: the order of two matches, by shard then by name.
  */
 
-void
-ListQuit(void)
+int
+ListMatchCmpInternal(const void *p1, const void *p2)
+{
+   int         iRet;
+   const MATCH *pMatch1 = p1,
+               *pMatch2 = p2;
+
+
+   iRet = pMatch1->iShard - pMatch2->iShard;
+   if (!iRet)
+      iRet = strcmp(pMatch1->szPkgName, pMatch2->szPkgName);
+
+   return(iRet);
+}
+
+
+/*
+ *  ListCtxMatch
+ *
+ *  Match the iCount names of ppPkgNames, the files of a directory
+ *  listing for instance, with a single pass through the list.
+ *  pcFound[i] is set if the package name of ppPkgNames[i] is found.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListCtxMatch(LIST *pList, const char **ppPkgNames, const int iCount,
+                char *pcFound)
 {
-   if (gpPkgnameList)
+   int            i,
+                  iCmp,
+                  iErr = 0,
+                  iLength,
+                  iMatches,
+                  iPos[PKGCACHE_LIST_SHARDS] = {0};
+   unsigned int   iHash;
+   BUFFER         sMatches = {NULL, 0, 0},
+                  sPool = {NULL, 0, 0};
+   MATCH          sMatch,
+                  *pMatches;
+   SHARD          *pShard;
+
+
+   memset(pcFound, 0, iCount);
+   for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+      pthread_rwlock_rdlock(&(pList->sShards[i].sLock));
+
+   // Clean up the names, the filters dropping most of them
+   for (i = 0 ; !iErr && i < iCount ; i++)
+   {
+      iHash = ListPkgNameValidateInternal(ppPkgNames[i],     &iLength);
+      sMatch.iShard = iHash & (PKGCACHE_LIST_SHARDS - 1);
+      pShard = pList->sShards + sMatch.iShard;
+      if (iLength && pShard->iCount && ListBloomIsFoundInternal(pShard, iHash))
+      {
+         sMatch.iIndex = i;
+         sMatch.iOffset = sPool.iLength;
+         iErr = BufferAppend(&sPool, ppPkgNames[i], iLength);
+         if (!iErr)
+            iErr = BufferAppend(&sPool, "", 1);
+         if (!iErr)
+            iErr = BufferAppend(&sMatches, &sMatch, sizeof(MATCH));
+      }
+   }
+
+   // Sort the remaining names, then merge them with the shards
+   pMatches = (MATCH *)sMatches.p;
+   iMatches = iErr ? 0 : sMatches.iLength / sizeof(MATCH);
+   for (i = 0 ; i < iMatches ; i++)
+      pMatches[i].szPkgName = sPool.p + pMatches[i].iOffset;
+   if (iMatches > 1)
+      qsort(pMatches, iMatches, sizeof(MATCH), ListMatchCmpInternal);
+   for (i = 0 ; i < iMatches ; i++)
    {
-      free(gpPkgnameList);
-      gpPkgnameList = NULL;
+      pShard = pList->sShards + pMatches[i].iShard;
+      iCmp = -1;
+      while (iPos[pMatches[i].iShard] < pShard->iCount
+             && (iCmp = strcmp(ListNameInternal(pShard,
+                                                iPos[pMatches[i].iShard]),
+                               pMatches[i].szPkgName)) < 0)
+         iPos[pMatches[i].iShard]++;
+      if (!iCmp)
+         pcFound[pMatches[i].iIndex] = 1;
    }
+
+   for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+      pthread_rwlock_unlock(&(pList->sShards[i].sLock));
+   BufferFree(&sMatches);
+   BufferFree(&sPool);
+
+   return(iErr);
 }
 
 
 /*
- *  ListSave
+ *  ListCtxSave
  *
  *  Return: ERROR_PKGCACHE_xyz
  */
 
 int
-ListSave(char *szFilename)
+ListCtxSave(LIST *pList, const char *szFilename)
 {
-   int      i,
-            iEof,
-            iErr = 0;
-   char     sz[LNFILENAME];
-   FILE     *pFile;
-   PKGNAME  *p;
+   int         iEof,
+               iErr = 0;
+   char        sz[LNFILENAME];
+   const char  *p;
+   FILE        *pFile;
+   FILENAME    szTempname;
+   LISTCURSOR  sCursor;
 
    
-   pFile = fopen(szFilename, "w");
-   if (pFile)
+   // Written aside then renamed, a reader never sees half a list
+   if (strlen(szFilename) + strlen(PKGCACHE_LIST_TEMP) < LNFILENAME)
+      sprintf(szTempname, "%s" PKGCACHE_LIST_TEMP, szFilename);
+   else
+      iErr = ERROR_PKGCACHE_MEM;
+   if (!iErr)
+      iErr = ListCursorOpen(pList,     &sCursor);
+   if (!iErr)
    {
-      if (strlen(gszPkgRepoFilterNav))
+      pFile = fopen(szTempname, "w");
+      if (pFile)
       {
-         if (strlen(gszPkgRepoFilterPath))
-            sprintf(sz, "%s %s %s", gszPkgRepoUrl, gszPkgRepoFilterNav,
-                    gszPkgRepoFilterPath);
+         if (strlen(pList->szFilterNav))
+         {
+            if (strlen(pList->szFilterPath))
+               sprintf(sz, "%s %s %s", pList->szRepoUrl, pList->szFilterNav,
+                       pList->szFilterPath);
+            else
+               sprintf(sz, "%s %s", pList->szRepoUrl, pList->szFilterNav);
+         }
          else
-            sprintf(sz, "%s %s", gszPkgRepoUrl, gszPkgRepoFilterNav);
+            strcpy(sz, pList->szRepoUrl);
+         iEof = fputs(sz, pFile);
+         if (iEof >= 0)
+            iEof = fputs("\n", pFile);
+
+         while (iEof >= 0 && (p = ListCursorNext(&sCursor)))
+         {
+            iEof = fputs(p, pFile);
+            if (iEof >= 0)
+               iEof = fputs("\n", pFile);
+         }
+      
+         if (iEof < 0)
+            iErr = ERROR_PKGCACHE_FILE_W;
+
+         // Done!
+         if (fclose(pFile) && !iErr)
+            iErr = ERROR_PKGCACHE_FILE_W;
+         if (!iErr && rename(szTempname, szFilename))
+            iErr = ERROR_PKGCACHE_ACCESS;
+         if (iErr)
+            remove(szTempname);
       }
       else
-         strcpy(sz, gszPkgRepoUrl);
-      iEof = fputs(sz, pFile);
-      if (iEof >= 0)
-         iEof = fputs("\n", pFile);
+         iErr = ERROR_PKGCACHE_ACCESS;
+
+      ListCursorClose(&sCursor);
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  ListCursorClose
+ */
+
+void
+ListCursorClose(LISTCURSOR *pCursor)
+{
+   if (pCursor->piOffsets)
+      free(pCursor->piOffsets);
+   pCursor->piOffsets = NULL;
+   pCursor->iCount = 0;
+   pCursor->iNext = 0;
+   BufferFree(&(pCursor->sPool));
+}
+
+
+/*
+ *  ListCursorNext
+ *
+ *  Return: the next package name of the snapshot, or NULL.
+ */
+
+const char *
+ListCursorNext(LISTCURSOR *pCursor)
+{
+   const char *p = NULL;
+
+
+   if (pCursor->iNext < pCursor->iCount)
+   {
+      p = pCursor->sPool.p + pCursor->piOffsets[pCursor->iNext];
+      pCursor->iNext++;
+   }
+
+   return(p);
+}
+
+
+/*
+ *  ListCursorOpen
+ *
+ *  Take a sorted snapshot of the package names.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListCursorOpen(LIST *pList,     LISTCURSOR *pCursor)
+{
+   int      i,
+            iErr = 0,
+            iPos[PKGCACHE_LIST_SHARDS] = {0},
+            iShard;
+   SHARD    *pShard;
+
+
+   memset(pCursor, 0, sizeof(LISTCURSOR));
+
+   // Lock all the shards for a consistent snapshot
+   for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+   {
+      pthread_rwlock_rdlock(&(pList->sShards[i].sLock));
+      pCursor->iCount += pList->sShards[i].iCount;
+   }
+   pCursor->piOffsets = malloc(sizeof(int) * (pCursor->iCount + 1));
+   if (!pCursor->piOffsets)
+      iErr = ERROR_PKGCACHE_MEM;
 
-      p = gpPkgnameList;
-      for (i = 0 ; i < giPkgnameListNextAdd && iEof >= 0 ; i++)
+   // Merge the sorted shards
+   for (i = 0 ; !iErr && i < pCursor->iCount ; i++)
+   {
+      pShard = NULL;
+      for (iShard = 0 ; iShard < PKGCACHE_LIST_SHARDS ; iShard++)
       {
-         iEof = fputs(*p, pFile);
-         p++;
-         if (iEof >= 0)
-            iEof = fputs("\n", pFile);
+         if (iPos[iShard] < pList->sShards[iShard].iCount
+             && (!pShard
+                 || strcmp(ListNameInternal(pList->sShards + iShard,
+                                            iPos[iShard]),
+                           ListNameInternal(pShard,
+                                            iPos[pShard - pList->sShards]))
+                    < 0))
+            pShard = pList->sShards + iShard;
       }
-      
-      if (iEof < 0)
-         iErr = ERROR_PKGCACHE_FILE_W;
 
-      // Done!
-      fclose(pFile);
+      iShard = pShard - pList->sShards;
+      pCursor->piOffsets[i] = pCursor->sPool.iLength;
+      iErr = BufferAppend(&(pCursor->sPool),
+                          ListNameInternal(pShard, iPos[iShard]),
+                          pShard->pList[iPos[iShard]].iLength + 1);
+      iPos[iShard]++;
    }
-   else
-      iErr = ERROR_PKGCACHE_ACCESS;
+
+   for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+      pthread_rwlock_unlock(&(pList->sShards[i].sLock));
+
+   if (iErr)
+      ListCursorClose(pCursor);
 
    return(iErr);
 }
 
+
+/*
+ *  ListFileAdd
+ *
+ *  Add szPkgName to the list file right away, merged with what the
+ *  other processes saved there since it was loaded.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListFileAdd(const char *szFilename, const char *szPkgName)
+{
+   int   iErr = 0,
+         iNew = 0;
+   LIST  *pList;
+
+
+   pList = ListNew();
+   if (!pList)
+      iErr = ERROR_PKGCACHE_MEM;
+   if (!iErr)
+      iErr = ListCtxLoad(pList, szFilename);
+   if (!iErr)
+      iErr = ListCtxAdd(pList, szPkgName,     &iNew);
+   if (!iErr && iNew)
+      iErr = ListCtxSave(pList, szFilename);
+   ListFree(pList);
+
+   return(iErr);
+}
+
+
+/*
+ *  ListFree
+ */
+
+void
+ListFree(LIST *pList)
+{
+   int i;
+
+
+   if (pList)
+   {
+      for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+      {
+         if (pList->sShards[i].pList)
+            free(pList->sShards[i].pList);
+         BufferFree(&(pList->sShards[i].sPool));
+         pthread_rwlock_destroy(&(pList->sShards[i].sLock));
+      }
+      free(pList);
+   }
+}
+
+
+/*
+ *  ListGetDefault
+ *
+ *  Return: the default context, or NULL.
+ */
+
+LIST *
+ListGetDefault(void)
+{
+   pthread_once(&gsListOnce, ListDefaultInternal);
+
+   return(gpList);
+}
+
+
+/*
+ *  ListNew
+ *
+ *  Return: a new empty context, or NULL.
+ */
+
+LIST *
+ListNew(void)
+{
+   int   i;
+   LIST  *pList;
+
+
+   pList = calloc(1, sizeof(LIST));
+   if (pList)
+   {
+      for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+         pthread_rwlock_init(&(pList->sShards[i].sLock), NULL);
+   }
+
+   return(pList);
+}
+
+
+/*
+ *  ListAdd
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListAdd(const char *szPkgName)
+{
+   int iErr = ERROR_PKGCACHE_MEM;
+
+
+   if (ListGetDefault())
+      iErr = ListCtxAdd(gpList, szPkgName,     NULL);
+
+   return(iErr);
+}
+
+
+/*
+ *  ListGetNext
+ *
+ *  *ppPkgName points in the snapshot, whatever the length of the
+ *  name, until the end of the list is reached.
+ *
+ *  Return: TRUE if found.
+ */
+
+int
+ListGetNext(     const char **ppPkgName)
+{
+   *ppPkgName = ListCursorNext(&gsListCursor);
+   if (!*ppPkgName)
+      ListCursorClose(&gsListCursor);
+   
+   return(*ppPkgName != NULL);
+}
+
+
+/*
+ *  ListGetFirst
+ *
+ *  Return: TRUE if found.
+ */
+
+int
+ListGetFirst(     const char **ppPkgName)
+{
+   int iBool = 0;
+   
+
+   *ppPkgName = NULL;
+   ListCursorClose(&gsListCursor);
+   if (ListGetDefault() && !ListCursorOpen(gpList,     &gsListCursor))
+      iBool = ListGetNext(     ppPkgName);
+   
+   return(iBool);
+}
+
+
+/*
+ *  ListGetNavFilter
+ */
+
+void
+ListGetNavFilter(     char *pNavFilter)
+{
+   *pNavFilter = 0;
+   if (ListGetDefault())
+      ListCtxGetNavFilter(gpList,     pNavFilter);
+}
+
+
+/*
+ *  ListGetPathFilter
+ */
+
+void
+ListGetPathFilter(     char *pPathFilter)
+{
+   *pPathFilter = 0;
+   if (ListGetDefault())
+      ListCtxGetPathFilter(gpList,     pPathFilter);
+}
+
+
+/*
+ *  ListGetRepoUrl
+ */
+
+void
+ListGetRepoUrl(     char *pRepoUrl)
+{
+   *pRepoUrl = 0;
+   if (ListGetDefault())
+      ListCtxGetRepoUrl(gpList,     pRepoUrl);
+}
+
+
+/*
+ *  ListGetStatExisting
+ *
+ *  Return: a positive count.
+ */
+
+int
+ListGetStatExisting(void)
+{
+   int   iExisting = 0,
+         iNew;
+
+
+   if (ListGetDefault())
+      ListCtxGetStat(gpList,     &iNew, &iExisting);
+
+   return(iExisting);
+}
+
+
+/*
+ *  ListGetStatNew
+ *
+ *  Return: a positive count.
+ */
+
+int
+ListGetStatNew(void)
+{
+   int   iExisting,
+         iNew = 0;
+
+
+   if (ListGetDefault())
+      ListCtxGetStat(gpList,     &iNew, &iExisting);
+
+   return(iNew);
+}
+
+
+/*
+ *  ListIsFound
+ *
+ *  Return: TRUE if found.
+ */
+
+int
+ListIsFound(char *szPkgName)
+{
+   return(ListGetDefault() ? ListCtxIsFound(gpList, szPkgName) : 0);
+}
+
+
+/*
+ *  ListLoad
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListLoad(char *szFilename)
+{
+   return(ListGetDefault() ? ListCtxLoad(gpList, szFilename)
+                           : ERROR_PKGCACHE_MEM);
+}
+
+
+/*
+ *  ListMatch
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListMatch(const char **ppPkgNames, const int iCount,     char *pcFound)
+{
+   return(ListGetDefault() ? ListCtxMatch(gpList, ppPkgNames, iCount, pcFound)
+                           : ERROR_PKGCACHE_MEM);
+}
+
+
+/*
+ *  ListQuit
+ */
+
+void
+ListQuit(void)
+{
+   int i;
+
+
+   // The default context stays valid, only emptied
+   ListCursorClose(&gsListCursor);
+   if (gpList)
+   {
+      for (i = 0 ; i < PKGCACHE_LIST_SHARDS ; i++)
+      {
+         pthread_rwlock_wrlock(&(gpList->sShards[i].sLock));
+         if (gpList->sShards[i].pList)
+            free(gpList->sShards[i].pList);
+         gpList->sShards[i].pList = NULL;
+         gpList->sShards[i].iCount = 0;
+         gpList->sShards[i].iSize = 0;
+         memset(gpList->sShards[i].cBloom, 0,
+                sizeof(gpList->sShards[i].cBloom));
+         BufferFree(&(gpList->sShards[i].sPool));
+         pthread_rwlock_unlock(&(gpList->sShards[i].sLock));
+      }
+   }
+}
+
+
+/*
+ *  ListSave
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ListSave(char *szFilename)
+{
+   return(ListGetDefault() ? ListCtxSave(gpList, szFilename)
+                           : ERROR_PKGCACHE_MEM);
+}
@@ -30,20 +30,57 @@
 #define PKGCACHE_LIST_H
 
 
+/*
+ *  Types
+ */
+
+// Package list context, see list.c.
+typedef struct LIST LIST;
+
+// Sorted snapshot of the package names of a context.
+typedef struct
+{
+   int      iCount,
+            iNext,
+            *piOffsets;    // In sPool
+   BUFFER   sPool;
+} LISTCURSOR;
+
+
 /*
  *  Prototypes
  */
 
-int  ListAdd(char *szPkgName);
-int  ListGetFirst(     char *szPkgName);
+int         ListCtxAdd(LIST *pList, const char *szPkgName,     int *piNew);
+void        ListCtxGetNavFilter(LIST *pList,     char *pNavFilter);
+void        ListCtxGetPathFilter(LIST *pList,     char *pPathFilter);
+void        ListCtxGetRepoUrl(LIST *pList,     char *pRepoUrl);
+void        ListCtxGetStat(LIST *pList,     int *piNew, int *piExisting);
+int         ListCtxIsFound(LIST *pList, const char *szPkgName);
+int         ListCtxLoad(LIST *pList, const char *szFilename);
+int         ListCtxMatch(LIST *pList, const char **ppPkgNames,
+                         const int iCount,     char *pcFound);
+int         ListCtxSave(LIST *pList, const char *szFilename);
+void        ListCursorClose(LISTCURSOR *pCursor);
+const char  *ListCursorNext(LISTCURSOR *pCursor);
+int         ListCursorOpen(LIST *pList,     LISTCURSOR *pCursor);
+int         ListFileAdd(const char *szFilename, const char *szPkgName);
+void        ListFree(LIST *pList);
+LIST        *ListGetDefault(void);
+LIST        *ListNew(void);
+
+// Same as above, with the default context
+int  ListAdd(const char *szPkgName);
+int  ListGetFirst(     const char **ppPkgName);
 void ListGetNavFilter(     char *pNavFilter);
-int  ListGetNext(     char *szPkgName);
+int  ListGetNext(     const char **ppPkgName);
 void ListGetPathFilter(     char *pPathFilter);
 void ListGetRepoUrl(     char *pRepoUrl);
 int  ListGetStatExisting(void);
 int  ListGetStatNew(void);
 int  ListIsFound(char *szPkgName);
 int  ListLoad(char *szFilename);
+int  ListMatch(const char **ppPkgNames, const int iCount,     char *pcFound);
 void ListQuit(void);
 int  ListSave(char *szFilename);
 
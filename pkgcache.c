@@ -12,15 +12,41 @@
  * 
  *          First parameter: the tool's command
  *            Add : Interactively add packages to the package list.
- *            Create : Create/update the package list using 'pkg info'.
+ *            Create : Create/update the package list from the local pkg
+ *                database.  See the -db option.
  *                If the directory and filename path is not specified,
  *                '.pkgcache' located in the current directory is used.
+ *            Daemon : Same as Download, again and again, by a process
+ *                keeping its state in memory.  It synchronizes every
+ *                -interval minutes, and when asked for on its -control
+ *                socket, which also takes package names to add.
  *            Download : Update the packages cache via Internet.  The
  *                package list must have previously been created, and
  *                its first line must contain the URL of a FreeBSD
  *                package repository.  Package dependancies are
- *                automatically added to the package list.
+ *                automatically added to the package list.  The updated
+ *                trees are published all at once when it's over.
  *            Help : Display the tool's command syntax.
+ *            Import : Same as Download, from the local mirror or
+ *                packages directory of the -upstream option instead of
+ *                the package list's URL.  The files are hard linked
+ *                when possible, copied by the kernel otherwise.
+ *            Proxy : Same as Serve, but the missing files are fetched
+ *                from the package list's repository while being served,
+ *                then kept in the cache.  Package names are added to
+ *                the package list.
+ *            Rescan : Add the dependencies of the cached packages to
+ *                the package list, without using the network.
+ *            Serve : Serve the packages directory over HTTP until
+ *                interrupted.  See the -listen option.
+ *            Snapshot : Freeze the packages directory under
+ *                snapshots/<name>/ with hard links, then list the
+ *                snapshots.  See the -name and -expire options.
+ *            Trim : Rewrite the repository catalogs of the cache so
+ *                they only describe the cached packages.  The
+ *                catalogs are signed if the -key option is used.
+ *            Verify : Check the cached packages against the checksums
+ *                of the repository catalogs.  See the -requeue option.
  * 
  *          Optional parameter: the packages directory and package list
  *                filename path to use.  If the packages directory is
@@ -57,11 +83,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <archive.h>
-#include <archive_entry.h>
 #include <ctype.h>
-#include <errno.h>
-#include <archive.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
@@ -70,8 +93,20 @@
 
 #include <fetch.h>
 
+#include "catalog.h"
 #include "common.h"
+#include "daemon.h"
+#include "download.h"
+#include "generation.h"
+#include "journal.h"
 #include "list.h"
+#include "pkgdb.h"
+#include "replay.h"
+#include "serve.h"
+#include "snapshot.h"
+#include "throttle.h"
+#include "verify.h"
+#include "watch.h"
 
 
 /*
@@ -79,233 +114,72 @@
  */
 
 #define ENVHTTPTIMEOUT              "HTTP_TIMEOUT"
-#define LNBLOCK                     2048
 
 #define PKGCACHE_DEFAULT_FILENAME   ".pkgcachelist"
-#define PKGCACHE_TEMP_FILENAME      ".pkgcachetemp"
 
 #define PKGCACHE_ADD                1
 #define PKGCACHE_CREATE             2
 #define PKGCACHE_DOWNLOAD           3
 #define PKGCACHE_HELP               4
-
-#define PKGCACHE_DEPS_DEFAULT       0b000000
-#define PKGCACHE_DEPS_QUOTE         0b000001
-
-#define PKGCACHE_HTML_DEFAULT       0b0000000
-#define PKGCACHE_HTML_QUOTE         0b0000001
-#define PKGCACHE_HTML_TAG           0b0000010
-#define PKGCACHE_HTML_TAGQUOTE      0b0000011
-#define PKGCACHE_HTML_HREF          0b0000111
-#define PKGCACHE_HTML_ATAG          0b0001010
-#define PKGCACHE_HTML_ATAGQUOTE     0b0001011
-#define PKGCACHE_HTML_BEGINTAG      0b0010010
-#define PKGCACHE_HTML_CLOSETAG      0b0100010
-#define PKGCACHE_HTML_EOH           0b1000000
-
-#define LNPKGCACHE_DOWNLOAD_ALWAYS  6
-char *PKGCACHE_DOWNLOAD_ALWAYS[LNPKGCACHE_DOWNLOAD_ALWAYS]
-   = {"digests.txz", "meta.txz", "packagesite.txz", "pkg-devel.txz", "pkg.txz", "pkg.txz.sig"};
+#define PKGCACHE_TRIM               5
+#define PKGCACHE_SERVE              6
+#define PKGCACHE_PROXY              7
+#define PKGCACHE_RESCAN             8
+#define PKGCACHE_VERIFY             9
+#define PKGCACHE_SNAPSHOT           10
+#define PKGCACHE_DAEMON             11
+#define PKGCACHE_IMPORT             12
 
 
 /*
- *  GetDepsEntry
- *
- *  Return: TRUE if found
+ *  Types
  */
 
-int
-GetDepsString(const la_ssize_t iCountR, char *pBlock,
-                  int *piBlock, int *piState, int *pLevel, char *pSz)
+// What a DOWNLOAD, or a synchronization of the daemon, is run with
+typedef struct
 {
-   int   iBool = 0,
-         iOut;
-   char  *pIn,
-         *pOut;
+   int         iAttempts,
+               iBandwidth,
+               iDaemon,
+               iFirstByte,
+               iJobs,
+               iKeep,
+               iStallSpeed,
+               iStallTime;
+   double      dScale;
+   const char  *szCaptureDirname,
+               *szPkgcachePathname,
+               *szPkglistFilename,
+               *szPlaybackDirname,
+               *szUpstream;   // Instead of the package list's URL
+} SYNC;
 
 
-   pIn = pBlock + *piBlock;
-   iOut = strlen(pSz);
-   pOut = pSz + iOut;
-   while (*piBlock < iCountR && !iBool)
-   {
-      if (*piState == PKGCACHE_DEPS_QUOTE)
-      {
-         if (*pIn == '"')     // This is the end-quote
-         {
-            iBool = 1;
-            *piState = PKGCACHE_DEPS_DEFAULT;
-         }
-         else
-         {
-            *pOut = *pIn;
-            iOut++;
-            pOut++;
-            if (iOut >= LNSZ-1)
-               iBool = 1;     // Too long!  Trunk and return it!
-         }
-      }
-      else if (*pIn == '"')
-         *piState = PKGCACHE_DEPS_QUOTE;
-      else if (*pIn == '{')
-         (*pLevel)++;
-      else if (*pIn == '}')
-         (*pLevel)--;
-
-      pIn++;
-      (*piBlock)++;
-   }
-
-   if (*piBlock >= iCountR)
-      *piBlock = 0;
+/*
+ *  Object variables
+ */
 
-   *pOut = 0;
-
-   return(iBool);
-}
+// Options and commands may be abbreviated to any prefix matching only
+// one of them
+const char *gszPkgcacheOptions[] =
+   {"ATTEMPTS", "BANDWIDTH", "CAPTURE", "CONTROL", "DB", "EXPIRE",
+    "FIRSTBYTE", "INTERVAL", "JOBS", "KEEP", "KEY", "LISTEN", "NAME",
+    "PLAYBACK", "REQUEUE", "STALL", "TIMEOUT", "UPSTREAM", NULL};
+const char *gszPkgcacheCommands[] =
+   {"ADD", "CREATE", "DAEMON", "DOWNLOAD", "HELP", "IMPORT", "PROXY",
+    "RESCAN", "SERVE", "SNAPSHOT", "TRIM", "VERIFY", NULL};
 
 
 /*
- *  CheckDependancies
+ *  AddInstalled
  *
  *  Return: ERROR_PKGCACHE_xyz
  */
 
 int
-CheckDependancies(const char *pFilename)
+AddInstalled(const char *szName, const char *szOrigin, void *pData)
 {
-   int         iBlock,
-               iErr = 0,
-               iDeps,
-               iDepsCount,
-               iDepsLevel,
-               iLevel,
-               iState;
-   la_ssize_t  iCountR;
-   char        block[LNBLOCK],
-               szDeps[LNSZ];
-   struct archive *pArc = NULL;
-   struct archive_entry *pArcEntry = NULL;
-
-
-   // Patch to only check TXZ files
-   iBlock = strlen(pFilename);
-   if (iBlock > 4)
-   {
-      if (strcasecmp(pFilename + iBlock - 4, ".txz"))
-         iErr = ERROR_PKGCACHE_TEMP;
-   }
-   else
-      iErr = ERROR_PKGCACHE_TEMP;
-   
-   if (!iErr)
-   {
-      pArc = archive_read_new();
-      pArcEntry = archive_entry_new();
-      if (!(pArc && pArcEntry))
-         iErr = ERROR_PKGCACHE_MEM;
-   }
-   if (!iErr)
-   {
-      iErr = archive_read_support_filter_all(pArc);
-      if (!iErr)
-         iErr = archive_read_support_format_all(pArc);
-      if (!iErr)
-         iErr = archive_read_open_filename(pArc, pFilename, LNBLOCK);
-   }
-   if (!iErr)
-   {
-      do
-      {
-         iErr = archive_read_next_header2(pArc,     pArcEntry);
-         if (iErr == ARCHIVE_WARN)
-            iErr = 0;
-         if (!iErr)
-         {
-#ifdef PKGCACHE_VERBOSE
-printf("CheckDependancies(%s): archive_entry_pathname=%s\n", pFilename,
-        archive_entry_pathname(pArcEntry));
-#endif
-            if (strcmp(archive_entry_pathname(pArcEntry), "+MANIFEST"))
-               archive_read_data_skip(pArc);
-            else
-            {
-               iBlock = 0;
-               iDeps = 0;
-               iLevel = 0;
-               iState = PKGCACHE_DEPS_DEFAULT;
-               *szDeps = 0;
-               do
-               {
-                  iCountR = archive_read_data(pArc, block, LNBLOCK);
-                  if (iCountR < 0)
-                  {
-                     iErr = iCountR;
-                     iCountR = 0;
-                  }
-                  if (iCountR)
-                  {
-                     do
-                     {
-                        if (GetDepsString(iCountR, block,
-                                 &iBlock, &iState, &iLevel, szDeps))
-                        {
-#ifdef PKGCACHE_VERBOSE
-printf("CheckDependancies(%s): GetDepsString=%s\n", pFilename, szDeps);
-#endif
-                           if (iDeps)
-                           {
-                              if (iLevel == iDepsLevel && !iDepsCount)
-                              {
-                                 iErr = ListAdd(szDeps);
-                                 if (!iErr)
-                                    iErr = ARCHIVE_EOF;
-                              }
-                              else if (iLevel == iDepsLevel + 1)
-                              {
-                                 iErr = ListAdd(szDeps);
-                                 if (!iErr)
-                                    iDepsCount++;
-                              }
-                              else if (iLevel <= iDepsLevel)
-                                 iErr = ARCHIVE_EOF;
-                           }
-                           else if (!strcmp(szDeps, "deps"))
-                           {
-                              iDeps++;
-                              iDepsCount = 0;
-                              iDepsLevel = iLevel;
-                           }
-
-                           *szDeps = 0;
-                        }
-                     }
-                     while (iBlock && !iErr) ;
-                  }
-               }
-               while (iCountR == LNBLOCK && !iErr) ;
-
-               if (!iErr)
-                  iErr = ARCHIVE_EOF;
-            }
-         }
-      }
-      while (!iErr) ;
-
-      if (iErr == ARCHIVE_EOF)
-         iErr = 0;
-   }
-
-   if (pArcEntry)      
-      archive_entry_free(pArcEntry);
-   if (pArc)      
-      archive_read_free(pArc);
-
-   // Carry on to the next task if an error occured in the archive
-   if (iErr == ERROR_PKGCACHE_TEMP || iErr < 0)
-      iErr = 0;
-   
-   return(iErr);
+   return(ListAdd(szName));
 }
 
 
@@ -339,572 +213,133 @@ CompareCommand(const char *szCmd, const char *sz)
 
 
 /*
- *  DownloadFile
+ *  IsAmbiguous
  *
- *  Return: ERROR_PKGCACHE_xyz
+ *  Return: TRUE if sz abbreviates more than one of the NULL terminated
+ *          pNames, none of them being sz itself.
  */
 
 int
-DownloadFile(const char *pUrl, const char *pFilename)
+IsAmbiguous(const char **pNames, const char *sz)
 {
-   int      iEmpty = 1,
-            iErr = 0;
-   char     block[LNBLOCK];
-   size_t   iCountR,
-            iCountW;
-   FILE     *pFileR,
-            *pFileW;
-
-
-   // Always download archives because they often change
-   // while still keeping the same file name and version.
-
-   pFileW = fopen(pFilename, "w");
-   if (pFileW)
-   {
-#ifdef PKGCACHE_VERBOSE
-printf("DownloadFile: fopen(%s) OK\n", pFilename);
-#endif
-      pFileR = fetchGetURL(pUrl, "");
-   }
-   else
-      pFileR = NULL;
-
-   if (pFileR)
-   {
-#ifdef PKGCACHE_VERBOSE
-printf("DownloadFile: fetchGetURL(%s) OK\n", pUrl);
-#endif
-      do
-      {
-         iCountR = fread(block, 1, LNBLOCK, pFileR);
-         if (iCountR)
-         {
-            iEmpty = 0;
-            iCountW = fwrite(block, 1, iCountR, pFileW);
-            if (iCountR != iCountW)
-               iErr = ERROR_PKGCACHE_FILE_W;
-         }
-      }
-      while (iCountR == LNBLOCK && !iErr) ;
-
-      // Check for a successful download
-      if (iCountR < LNBLOCK && !iErr)
-      {
-         if (!feof(pFileR) || ferror(pFileR))
-            iErr = ERROR_PKGCACHE_FILE_R;
-      }
-   }
-
-   if (pFileR)
-      fclose(pFileR);
-   if (pFileW)
-      fclose(pFileW);
-#ifdef PKGCACHE_VERBOSE
-   else
-   {
-printf("DownloadFile: fopen(%s) errno=%d\n", pFilename, errno);
-   }
-#endif
-
-   if (iErr || iEmpty)
-   {
-      // Cleanup if incomplete or no download, but make sure it's a file.
-      if (Exist(pFilename, PKGCACHE_EXIST_FILE))
-      {
-         remove(pFilename);
-         if (!iErr)
-            printf("  Warning: %s missing!\n", pUrl);
-      }
-   }
-
-#ifdef PKGCACHE_VERBOSE
-if (iErr)
-   printf("DownloadFile: iErr=%d\n", iErr);
-#endif
-
-   return(iErr);
-}
-
-
-/*
- *  GetHrefLink
- *
- *  Return: TRUE if link found
- */
-
-int
-GetHrefLink(const int iCountR, char *pBlock,
-                  int *piBlock, int *piState, char *pszHref)
-{
-   int   iBool = 0,
-         iOut;
-   char  *pIn,
-         *pOut;
-
-
-   pIn = pBlock + *piBlock;
-   iOut = strlen(pszHref);
-   pOut = pszHref + iOut;
-   while (*piBlock < iCountR && !iBool && *piState != PKGCACHE_HTML_EOH)
-   {
-      // Handeling quoted text
-      if (*piState & PKGCACHE_HTML_QUOTE)
-      {
-         if (*pIn == '"')  // This is the end-quote
-         {
-            if (*piState == PKGCACHE_HTML_HREF)
-            {
-               iBool = 1;
-               *piState = PKGCACHE_HTML_TAG;
-            }
-            else
-               *piState &= PKGCACHE_HTML_ATAG; // & with implicit PKGCACHE_HTML_TAG
-         }
-         else
-         {
-            if (*piState == PKGCACHE_HTML_HREF)
-            {
-               if (iOut >= LNSZ-1)
-               {
-                  // Too long, skip it!
-                  *piState = PKGCACHE_HTML_TAGQUOTE;
-               }
-               else
-               {
-                  *pOut = *pIn;
-                  iOut++;
-                  pOut++;
-               }
-            }
-         }
-      }
+   int   iCount = 0,
+         iExact = 0;
 
-      // Handeling tags
-      else if (*piState & PKGCACHE_HTML_TAG)
-      {
-         if (*pIn == '>')  // This is the end-tag
-         {
-            if (*piState == PKGCACHE_HTML_CLOSETAG)
-            {
-               *pOut = 0;
-               if (strcasecmp(pszHref, "/html"))
-                  *piState = PKGCACHE_HTML_DEFAULT;
-               else
-                  *piState = PKGCACHE_HTML_EOH;
-            }
-            else
-               *piState = PKGCACHE_HTML_DEFAULT;
-         }
-         else if (*piState == PKGCACHE_HTML_BEGINTAG)
-         {
-            if (isspace(*pIn))
-            {
-               *pOut = 0;
-               if (strcasecmp(pszHref, "a"))
-                  *piState = PKGCACHE_HTML_TAG;
-               else
-               {
-                  pOut = pszHref;
-                  iOut = 0;
-                  *piState = PKGCACHE_HTML_ATAG;
-               }
-            }
-            else if (*pIn == '"')
-            {
-               *piState = PKGCACHE_HTML_TAGQUOTE;
-            }
-            else if (*pIn == '/')
-            {
-               pOut = pszHref;
-               *pOut = '/';
-               pOut++;
-               iOut = 1;
-               *piState = PKGCACHE_HTML_CLOSETAG;
-            }
-            else
-            {
-               *pOut = *pIn;
-               iOut++;
-               pOut++;
-            }
-         }
-         else if (*piState == PKGCACHE_HTML_ATAG)
-         {
-            if (isspace(*pIn))
-            {
-               // Tolerate a space before and after the '=' sign only.
-               *pOut = 0;
-               if (strcasecmp(pszHref, "href") && strcasecmp(pszHref, "href="))
-               {
-                  pOut = pszHref;
-                  iOut = 0;
-               }
-            }
-            else if (*pIn == '"')
-            {
-               *pOut = 0;
-               if (strcasecmp(pszHref, "href="))
-                  *piState = PKGCACHE_HTML_ATAGQUOTE;
-               else
-                  *piState = PKGCACHE_HTML_HREF;
 
-               pOut = pszHref;
-               iOut = 0;
-            }
-            else
-            {
-               *pOut = *pIn;
-               iOut++;
-               pOut++;
-            }
-         }
-         else if (*piState == PKGCACHE_HTML_CLOSETAG)
-         {
-            *pOut = *pIn;
-            iOut++;
-            pOut++;
-         }
-      }
-
-      // Waiting for tags
-      else
+   for ( ; *pNames && !iExact ; pNames++)
+      if (CompareCommand(*pNames, sz))
       {
-         if (*pIn == '<')  // This is the begin-tag
-         {
-            pOut = pszHref;
-            iOut = 0;
-            *piState = PKGCACHE_HTML_BEGINTAG;
-         }
+         iCount++;
+         iExact = (strlen(*pNames) == strlen(sz));
       }
 
-      pIn++;
-      (*piBlock)++;
-   }
-
-   if (*piBlock >= iCountR)
-      *piBlock = 0;
-
-   *pOut = 0;
-
-   return(iBool);
+   return(iCount > 1 && !iExact);
 }
 
 
 /*
- *  IsDownloadAlways
+ *  Synchronize
  *
- *  Return: TRUE if identified.
- */
-
-int
-IsDownloadAlways(const char *pFilename)
-{
-   int   i = LNPKGCACHE_DOWNLOAD_ALWAYS,
-         iBool;
-
-
-   do
-   {
-      i--;
-      iBool = !strcmp(pFilename, PKGCACHE_DOWNLOAD_ALWAYS[i]);
-   }
-   while (i && !iBool) ;
-
-   return(iBool);
-}
-
-
-/*
- *  IsFilterMatchInt
- *
- *  Return: TRUE if match.
- */
-
-int
-IsFilterMatchInt(const char *pUrl, const char *pFilter,     int *pI)
-{
-   int      i,
-            iBool = 0,
-            iBool2;
-   FILENAME sz;
-
-
-#ifdef PKGCACHE_VERBOSE
-printf("--> (%s %s %d)\n", pUrl, pFilter, *pI);
-#endif
-   if (!(pFilter[*pI]) || pFilter[*pI] == ')' || pFilter[*pI] == '&'
-       || pFilter[*pI] == '|')
-   {
-      // Error: Invalid expression
-      (*pI) = strlen(pFilter);
-   }
-   else if (pFilter[*pI] == '!')
-   {
-      // '!' operator handler (lower priority than '&' and '|')
-      (*pI)++;
-
-      i = 0;
-      iBool = !IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
-      (*pI) += i;
-   }
-   else if (pFilter[*pI] == '(')
-   {
-      // '( )' operator handler
-      (*pI)++;
-
-      i = 0;
-      iBool = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
-      (*pI) += i;
-      if (pFilter[*pI] == ')')
-      {
-         (*pI)++;
-
-         if (pFilter[*pI] == '&')
-         {
-            (*pI)++;
-
-            i = 0;
-            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
-            iBool = iBool && iBool2;
-            (*pI) += i;
-         }
-         else if (pFilter[*pI] == '|')
-         {
-            (*pI)++;
-
-            i = 0;
-            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
-            iBool = iBool || iBool2;
-            (*pI) += i;
-         }
-      }
-      else
-      {
-         // Error: Invalid expression
-         (*pI) = strlen(pFilter);
-      }
-   }
-   else
-   {
-      // String filter handler
-      i = 0;
-      while (pFilter[*pI] && pFilter[*pI] != '(' && pFilter[*pI] != ')'
-             && pFilter[*pI] != '!' && pFilter[*pI] != '&' && pFilter[*pI] != '|')
-      {
-         sz[i] = pFilter[*pI];
-         i++;
-         (*pI)++;
-      }
-      sz[i] = 0;
-      if (i)
-      {
-         iBool = strstr(pUrl, sz) != NULL;
-
-         if (pFilter[*pI] == '&')
-         {
-            (*pI)++;
-
-            i = 0;
-            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
-            iBool = iBool && iBool2;
-            (*pI) += i;
-         }
-         else if (pFilter[*pI] == '|')
-         {
-            (*pI)++;
-
-            i = 0;
-            iBool2 = IsFilterMatchInt(pUrl, pFilter + (*pI),     &i);
-            iBool = iBool || iBool2;
-            (*pI) += i;
-         }
-      }
-   }
-#ifdef PKGCACHE_VERBOSE
-printf("<-- (%d) %d\n", *pI, iBool);
-#endif
-
-   return(iBool);
-}
-
-
-/*
- *  IsFilterMatch
- *
- *  Return: TRUE if match.
- */
-
-int
-IsFilterMatch(const char *pUrl, const char *pFilter)
-{
-   int   i = 0,
-         iBool = 1;
-
-
-   if (strlen(pFilter))
-   {
-      iBool = IsFilterMatchInt(pUrl, pFilter,     &i);
-      if (iBool)
-         iBool = !(pFilter[i]);
-   }
-
-   return(iBool);
-}
-
-
-/*
- *  DownloadUpdates
+ *  Download the relevant packages into a new generation, then publish
+ *  it.  Run again and again by the daemon, which saves the package list
+ *  after each run.
  *
  *  Return: ERROR_PKGCACHE_xyz
  */
 
 int
-DownloadUpdates(const char *pUrl, const char *pNavFilter,
-                const char *pPathFilter, const char *pPkgcachePathname)
+Synchronize(void *pData)
 {
    int      i,
-            iBlock = 0,
-            iErr = 0,
-            iHrefLn,
-            iState = PKGCACHE_HTML_DEFAULT;
-   char     block[LNBLOCK];
-   size_t   iCountR,
-            iCountW;
-   FILE     *pFileR,
-            *pFileW = NULL;
-   FILENAME szHref,
-            szPkgcachePathname2,
-            szTempname,
-            szUrl2;
-
-
-   // Since the docs say that fetch is not reentrant,
-   // no choice but to read the web page twice.
-   iErr = MakePath(pPkgcachePathname);
+            iErr,
+            iNew;
+   char     sz[LNSZ],
+            *p;
+   SYNC     *pSync = pData;
+   FILENAME szPkgNavFilter,
+            szPkgPathFilter,
+            szPkgRepoUrl,
+            szStagePathname;
+
+
+   ListGetRepoUrl(     szPkgRepoUrl);
+   ListGetNavFilter(     szPkgNavFilter);
+   ListGetPathFilter(     szPkgPathFilter);
+   if (*(pSync->szUpstream))
+      StrnCopy(szPkgRepoUrl, pSync->szUpstream, LNFILENAME);
+   if (*szPkgRepoUrl)
+      iErr = JournalOpen(pSync->szPkgcachePathname,     &i);
+   else
+      iErr = ERROR_PKGCACHE_REPO;
    if (!iErr)
    {
-      strcpy(szTempname, pPkgcachePathname);
-      i = strlen(szTempname);
-      if (szTempname[i - 1] != '/')
-      {
-         szTempname[i] = '/';
-         i++;
-         szTempname[i] = 0;
-      }
-      strcpy(szTempname + i, PKGCACHE_TEMP_FILENAME);
+      if (i)
+         printf("Resuming an interrupted download, %d journal records"
+                " replayed.\n", i);
 
-      pFileW = fopen(szTempname, "w");
-      if (!pFileW)
-         iErr = ERROR_PKGCACHE_ACCESS;
-   }
-   if (!iErr)
-   {
-      pFileR = fetchGetURL(pUrl, "");
-      if (!pFileR)
-         iErr = ERROR_PKGCACHE_TEMP;
+      // The served trees stay untouched until the publishing
+      iErr = GenerationOpen(pSync->szPkgcachePathname,     szStagePathname);
+      ThrottleInit(pSync->iJobs, (int64_t)(pSync->iBandwidth) * 1024);
+      if (!iErr)
+         iErr = WatchInit(pSync->iFirstByte, pSync->iStallSpeed,
+                          pSync->iStallTime, pSync->iAttempts);
+      if (!iErr && *(pSync->szPlaybackDirname))
+         iErr = ReplayPlayback(pSync->szPlaybackDirname, pSync->dScale);
+      else if (!iErr && *(pSync->szCaptureDirname))
+         iErr = ReplayCapture(pSync->szCaptureDirname);
    }
    if (!iErr)
    {
-      printf("Browsing %s\n", pUrl);
+      iNew = ListGetStatNew();
       do
       {
-         iCountR = fread(block, 1, LNBLOCK, pFileR);
-         if (iCountR)
-         {
-            iCountW = fwrite(block, 1, iCountR, pFileW);
-            if (iCountR != iCountW)
-               iErr = ERROR_PKGCACHE_FILE_W;
-         }
-      }
-      while (iCountR == LNBLOCK && !iErr) ;
+         i = iNew;
+         iErr = DownloadRun(szPkgRepoUrl, szPkgNavFilter, szPkgPathFilter,
+                            szStagePathname, pSync->iJobs, pSync->iKeep);
+         if (!iErr)
+            iErr = JournalPass();
 
-      fclose(pFileR);
-   }
-   if (pFileW)
-      fclose(pFileW);
-   
-   // Second read...
-   if (!iErr)
-   {
-      pFileR = fopen(szTempname, "r");
-      if (!pFileR)
-         iErr = ERROR_PKGCACHE_ACCESS;
-   }
-   if (!iErr)
-   {
-      szHref[0] = 0;
-      do
-      {
-         iCountR = fread(block, 1, LNBLOCK, pFileR);
-         do
+         // The daemon doesn't ask, the next run resumes it
+         else if (iErr == ERROR_PKGCACHE_NO_EOH && !(pSync->iDaemon))
          {
-            if (GetHrefLink(iCountR, block,     &iBlock, &iState, szHref))
+            p = getenv(ENVHTTPTIMEOUT);
+            if (p)
             {
-               iHrefLn = strlen(szHref);
-               if (iHrefLn)
-               {
-                  if (szHref[0] != '/' && strncasecmp(szHref, "http:", 5)
-                      && strncasecmp(szHref, "https:", 6) && szHref[0] != '.'
-                      && szHref[0] != '?')  // Skip absolute and navigation links
-                  {
-                     // Patch because of non desirable HTML directory format
-                     if (strstr(szHref, "FreeBSD%3A") && szHref[iHrefLn-1] != '/')
-                     {
-                        StrReplace(szHref, "%3A", ':');
-                        strcat(szHref, "/");
-                        iHrefLn = strlen(szHref);
-                     }
-                     sprintf(szUrl2, "%s%s", pUrl, szHref);
-                     sprintf(szPkgcachePathname2, "%s%s", pPkgcachePathname,
-                             szHref);
-                     if (szHref[iHrefLn-1] == '/')
-                     {
-                        if (IsFilterMatch(szUrl2, pNavFilter))
-                           iErr = DownloadUpdates(szUrl2, pNavFilter,
-                                                  pPathFilter, szPkgcachePathname2);
-                     }
-                     else
-                     {
-                        if ((IsDownloadAlways(szHref) || ListIsFound(szHref))
-                            && IsFilterMatch(szUrl2, pPathFilter))
-                        {
-                           printf("Downloading %s\n", szHref);
-                           iErr = MakePath(pPkgcachePathname);
-                           if (!iErr)
-                              iErr = DownloadFile(szUrl2, szPkgcachePathname2);
-                           if (!iErr)
-                              iErr = CheckDependancies(szPkgcachePathname2);
-                           else if (iErr == ERROR_PKGCACHE_FILE_R)
-                           {
-                              printf("WARNING: Skipping %s, download failed!\n",
-                                     szHref);
-                              iErr = 0;
-                           }
-                        }
-                     }
-                  }
-
-                  szHref[0] = 0;
-               }
+               if (atoi(p) > 1)
+                  printf("HTTP Fetch Timeout: %s sec., ", p);
+               else
+                  printf("No HTTP Fetch Timeout specified! ");
+            }
+            printf("Retry? ([CR]=Yes) ");
+            gets_s(sz, LNSZ);
+            if (!(*sz) || *sz=='y' || *sz=='Y')
+            {
+               i--;
+               iErr = 0;
             }
          }
-         while (iBlock && !iErr && iState != PKGCACHE_HTML_EOH) ;
+         iNew = ListGetStatNew();
       }
-      while (iCountR == LNBLOCK && !iErr && iState != PKGCACHE_HTML_EOH) ;
+      while (iNew != i && !iErr) ;
 
-      fclose(pFileR);
+      if (!iErr)
+         iErr = GenerationPublish(pSync->szPkgcachePathname);
+   }
 
-      if (!iErr && iState != PKGCACHE_HTML_EOH)
-      {
-         printf("ERROR: %s didn't load completely.\n", pUrl);
-         iErr = ERROR_PKGCACHE_NO_EOH;
-      }
+   if (pSync->iDaemon)
+   {
+      if (!iErr)
+         iErr = ListSave((char *)(pSync->szPkglistFilename));
+
+      // The journal is only needed to resume an unsaved run
+      JournalClose(!iErr);
+      ReplayQuit();
+      if (!iErr)
+         printf("Synchronized: %d new package(s) added, %d existing"
+                " package(s) revisited.\n\n", ListGetStatNew(),
+                ListGetStatExisting());
    }
 
-   if (iErr == ERROR_PKGCACHE_TEMP)
-      iErr = 0;
-   remove(szTempname);
    return(iErr);
 }
 
@@ -919,17 +354,36 @@ main(int argc, char** argv)
    int            i,
                   iCommand = 0,
                   iErr = 0,
-                  iNew;
+                  iAttempts = PKGCACHE_WATCH_ATTEMPTS,
+                  iBandwidth = 0,
+                  iExpire = 0,
+                  iFirstByte = PKGCACHE_WATCH_FIRSTBYTE,
+                  iInterval = 0,
+                  iJobs = PKGCACHE_DOWNLOAD_JOBS,
+                  iKeep = PKGCACHE_DOWNLOAD_KEEP,
+                  iNew,
+                  iRequeue = 0,
+                  iStallSpeed = PKGCACHE_WATCH_STALLSPEED,
+                  iStallTime = PKGCACHE_WATCH_STALLTIME;
    char           sz[LNSZ],
-                  *p;
-   FILE           *pFile;
+                  *p,
+                  *pEnd;
+   double         dScale = 1.0;
    FILENAME       szPkgcachePathname,
                   szPkglistFilename,
                   szPkgNavFilter,
                   szPkgPathFilter,
+                  szCaptureDirname = "",
+                  szControl = "",
+                  szKeyFilename = "",
+                  szName = "",
+                  szUpstream = "",
+                  szPlaybackDirname = "",
+                  szListen = PKGCACHE_SERVE_DEFAULT,
                   szPkgRepoUrl,
-                  szResultsFilename,
                   szTempName;
+   STRSET         sDbFilenames = {0, 0, NULL};
+   SYNC           sSync;
    struct stat    sPathStats;
 
 
@@ -964,33 +418,203 @@ main(int argc, char** argv)
       strcpy(szPkglistFilename + i, PKGCACHE_DEFAULT_FILENAME);
 
       // Option parsing
-      if (argc >= 2 && argc <= 6)
+      if (argc >= 2)
       {
          i = 1;
 
-         // Option: Set HTTP_TIMEOUT
-         if (*(argv[i]) == '-' && argc >= 4)
+         while (!iErr && i < argc - 1 && *(argv[i]) == '-')
          {
-            if (CompareCommand("TIMEOUT", (argv[i])+1)
-                && atoi(argv[i+1]) > 1)
+            if (IsAmbiguous(gszPkgcacheOptions, (argv[i])+1))
+               iErr = ERROR_PKGCACHE_CMD;
+
+            // Option: Set HTTP_TIMEOUT
+            else if (CompareCommand("TIMEOUT", (argv[i])+1))
             {
-               setenv(ENVHTTPTIMEOUT, argv[i+1], 1);
+               if (atoi(argv[i+1]) > 1)
+                  setenv(ENVHTTPTIMEOUT, argv[i+1], 1);
                i++;
-            }            
+            }
+
+            // Option: Attempts of a failed or stalled transfer
+            else if (CompareCommand("ATTEMPTS", (argv[i])+1))
+            {
+               iAttempts = atoi(argv[i+1]);
+               if (iAttempts < 1)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Time to the response, 0 for none
+            else if (CompareCommand("FIRSTBYTE", (argv[i])+1))
+            {
+               iFirstByte = atoi(argv[i+1]);
+               if (iFirstByte < 0)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Low speed limit, <bytes/s>[:<sec.>], 0 for none
+            else if (CompareCommand("STALL", (argv[i])+1))
+            {
+               iStallSpeed = atoi(argv[i+1]);
+               p = strchr(argv[i+1], ':');
+               if (p)
+                  iStallTime = atoi(p + 1);
+               if (iStallSpeed < 0 || iStallTime < 1)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Record the transfers
+            else if (CompareCommand("CAPTURE", (argv[i])+1))
+            {
+               StrnCopy(szCaptureDirname, argv[i+1], LNFILENAME);
+               i++;
+            }
+
+            // Option: Daemon control socket
+            else if (CompareCommand("CONTROL", (argv[i])+1))
+            {
+               StrnCopy(szControl, argv[i+1], LNFILENAME);
+               i++;
+            }
+
+            // Option: Play the recorded transfers, <dir>[:<scale>]
+            else if (CompareCommand("PLAYBACK", (argv[i])+1))
+            {
+               StrnCopy(szPlaybackDirname, argv[i+1], LNFILENAME);
+               p = strrchr(szPlaybackDirname, ':');
+               if (p)
+               {
+                  dScale = strtod(p + 1,     &pEnd);
+                  if (pEnd != p + 1 && !(*pEnd))
+                     *p = 0;
+                  else
+                     dScale = 1.0;   // Part of the directory name
+               }
+               if (dScale < 0)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Global download rate limit, in KB/s
+            else if (CompareCommand("BANDWIDTH", (argv[i])+1))
+            {
+               iBandwidth = atoi(argv[i+1]);
+               if (iBandwidth < 0)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Daemon synchronization interval, in minutes
+            else if (CompareCommand("INTERVAL", (argv[i])+1))
+            {
+               iInterval = atoi(argv[i+1]);
+               if (iInterval < 0)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Maximum number of concurrent download jobs
+            else if (CompareCommand("JOBS", (argv[i])+1))
+            {
+               iJobs = atoi(argv[i+1]);
+               if (iJobs < 1 || iJobs > PKGCACHE_DOWNLOAD_JOBS_MAX)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Catalog signing key
+            else if (CompareCommand("KEY", (argv[i])+1))
+            {
+               StrnCopy(szKeyFilename, argv[i+1], LNFILENAME);
+               i++;
+            }
+
+            // Option: Versions of a package to download
+            else if (CompareCommand("KEEP", (argv[i])+1))
+            {
+               iKeep = atoi(argv[i+1]);
+               if (iKeep < 1)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Installed packages database, repeatable
+            else if (CompareCommand("DB", (argv[i])+1))
+            {
+               iErr = StrSetAdd(&sDbFilenames, argv[i+1]);
+               i++;
+            }
+
+            // Option: HTTP server address and port
+            else if (CompareCommand("LISTEN", (argv[i])+1))
+            {
+               StrnCopy(szListen, argv[i+1], LNFILENAME);
+               i++;
+            }
+
+            // Option: Snapshot name, the date and time by default
+            else if (CompareCommand("NAME", (argv[i])+1))
+            {
+               StrnCopy(szName, argv[i+1], LNFILENAME);
+               i++;
+            }
+
+            // Option: Remove the snapshots older than <days>
+            else if (CompareCommand("EXPIRE", (argv[i])+1))
+            {
+               iExpire = atoi(argv[i+1]);
+               if (iExpire < 1)
+                  iErr = ERROR_PKGCACHE_CMD;
+               i++;
+            }
+
+            // Option: Import source, a directory or a file:// URL
+            else if (CompareCommand("UPSTREAM", (argv[i])+1))
+            {
+               StrnCopy(szUpstream, argv[i+1], LNFILENAME);
+               i++;
+            }
+
+            // Option: Requeue the corrupted packages, takes no value
+            else if (CompareCommand("REQUEUE", (argv[i])+1))
+               iRequeue = 1;
+            else
+               iErr = ERROR_PKGCACHE_CMD;
+
             i++;
          }
          
          // Extract the tool's command
-         if (i < argc)
+         if (!iErr && i < argc)
          {
-            if (CompareCommand("ADD", argv[i]))
+            if (IsAmbiguous(gszPkgcacheCommands, argv[i]))
+               iErr = ERROR_PKGCACHE_CMD;
+            else if (CompareCommand("ADD", argv[i]))
                iCommand = PKGCACHE_ADD;
             else if (CompareCommand("CREATE", argv[i]))
                iCommand = PKGCACHE_CREATE;
             else if (CompareCommand("DOWNLOAD", argv[i]))
                iCommand = PKGCACHE_DOWNLOAD;
+            else if (CompareCommand("DAEMON", argv[i]))
+               iCommand = PKGCACHE_DAEMON;
             else if (CompareCommand("HELP", argv[i]))
                iCommand = PKGCACHE_HELP;
+            else if (CompareCommand("IMPORT", argv[i]))
+               iCommand = PKGCACHE_IMPORT;
+            else if (CompareCommand("PROXY", argv[i]))
+               iCommand = PKGCACHE_PROXY;
+            else if (CompareCommand("RESCAN", argv[i]))
+               iCommand = PKGCACHE_RESCAN;
+            else if (CompareCommand("SERVE", argv[i]))
+               iCommand = PKGCACHE_SERVE;
+            else if (CompareCommand("SNAPSHOT", argv[i]))
+               iCommand = PKGCACHE_SNAPSHOT;
+            else if (CompareCommand("TRIM", argv[i]))
+               iCommand = PKGCACHE_TRIM;
+            else if (CompareCommand("VERIFY", argv[i]))
+               iCommand = PKGCACHE_VERIFY;
             else
                iErr = ERROR_PKGCACHE_CMD;
 
@@ -1000,6 +624,8 @@ main(int argc, char** argv)
             iErr = ERROR_PKGCACHE_CMD;
 
          // Extract optional path
+         if (!iErr && i < argc - 1)
+            iErr = ERROR_PKGCACHE_CMD;
          if (!iErr && i < argc)
          {
             StrnCopy(szTempName, argv[i], LNFILENAME);
@@ -1011,7 +637,9 @@ main(int argc, char** argv)
             {
                if (stat(szTempName,     &sPathStats))
                {
-                  if (iCommand == PKGCACHE_DOWNLOAD)
+                  if (iCommand == PKGCACHE_DOWNLOAD
+                      || iCommand == PKGCACHE_DAEMON
+                      || iCommand == PKGCACHE_IMPORT)
                      iErr = ERROR_PKGCACHE_ACCESS;
                }
                else
@@ -1058,14 +686,26 @@ main(int argc, char** argv)
    
    if (!iErr)
    {
-      sprintf(szResultsFilename, "%s%s",
-              szPkgcachePathname, PKGCACHE_TEMP_FILENAME);
-      
       printf("Package List: %s\n", szPkglistFilename);
       iErr = ListLoad(szPkglistFilename);
    }
    if (!iErr)
    {
+      sSync.iAttempts = iAttempts;
+      sSync.iBandwidth = iBandwidth;
+      sSync.iDaemon = 0;
+      sSync.iFirstByte = iFirstByte;
+      sSync.iJobs = iJobs;
+      sSync.iKeep = iKeep;
+      sSync.iStallSpeed = iStallSpeed;
+      sSync.iStallTime = iStallTime;
+      sSync.dScale = dScale;
+      sSync.szCaptureDirname = szCaptureDirname;
+      sSync.szPkgcachePathname = szPkgcachePathname;
+      sSync.szPkglistFilename = szPkglistFilename;
+      sSync.szPlaybackDirname = szPlaybackDirname;
+      sSync.szUpstream = "";
+
       switch (iCommand)
       {
          case PKGCACHE_ADD:
@@ -1084,73 +724,117 @@ main(int argc, char** argv)
             break;
 
          case PKGCACHE_CREATE:
-            sprintf(szTempName, "pkg info > %s", szResultsFilename);
-            if (system(szTempName))
-               iErr = ERROR_PKGCACHE_INFO;
-            else
+            if (!sDbFilenames.iCount)
+               iErr = StrSetAdd(&sDbFilenames, PKGCACHE_PKGDB_DEFAULT);
+            for (i = 0 ; !iErr && i < sDbFilenames.iCount ; i++)
             {
-               pFile = fopen(szResultsFilename, "r");
-               if (pFile)
-               {
-                  do
-                  {
-                     p = fgets(sz, LNSZ, pFile);
-                     if (p)
-                     {
-                        sz[LNSZ-1] = 0;            
-                        iErr = ListAdd(sz);
-                     }
-                  }
-                  while (!iErr && p) ;
-
-                  // Done!
-                  fclose(pFile);
-               }
+               printf("Installed Packages: %s\n", sDbFilenames.ppStr[i]);
+               iErr = PkgdbRead(sDbFilenames.ppStr[i], AddInstalled, NULL);
             }
-            remove(szResultsFilename);
             break;
 
          case PKGCACHE_DOWNLOAD:
+            iErr = Synchronize(&sSync);
+            break;
+
+         case PKGCACHE_DAEMON:
+            // What's kept in memory from one run to the next
+            DownloadListings();
+            sSync.iDaemon = 1;
+            if (!*szControl)
+               sprintf(szControl, "%s" PKGCACHE_DAEMON_CONTROL,
+                       szPkgcachePathname);
+            iErr = DaemonRun(szControl, szPkglistFilename, iInterval, Synchronize,
+                             &sSync);
+            break;
+
+         case PKGCACHE_IMPORT:
+            // The source is browsed as a file:// repository
+            i = strlen(szUpstream);
+            if (!i)
+               iErr = ERROR_PKGCACHE_CMD;
+            else if (!strncasecmp(szUpstream, "file://", 7))
+            {
+               if (i + 2 < LNFILENAME)
+                  sprintf(szPkgRepoUrl, "%s%s", szUpstream,
+                          (szUpstream[i-1] == '/') ? "" : "/");
+               else
+                  iErr = ERROR_PKGCACHE_MEM;
+            }
+            else if (!realpath(szUpstream, szTempName)
+                     || stat(szTempName, &sPathStats)
+                     || !S_ISDIR(sPathStats.st_mode))
+               iErr = ERROR_PKGCACHE_ACCESS;
+            else if (strlen(szTempName) + 10 < LNFILENAME)
+               sprintf(szPkgRepoUrl, "file://%s%s", szTempName,
+                       strcmp(szTempName, "/") ? "/" : "");
+            else
+               iErr = ERROR_PKGCACHE_MEM;
+            if (!iErr)
+            {
+               printf("Importing from %s\n", szPkgRepoUrl);
+               DownloadImport();
+               sSync.szUpstream = szPkgRepoUrl;
+               iErr = Synchronize(&sSync);
+            }
+            break;
+
+         case PKGCACHE_RESCAN:
+            iErr = DownloadRescan(szPkgcachePathname);
+            break;
+
+         case PKGCACHE_TRIM:
+            iErr = CatalogTrimAll(szPkgcachePathname, szKeyFilename);
+            break;
+
+         case PKGCACHE_VERIFY:
+            iErr = VerifyAll(szPkgcachePathname, iRequeue);
+            break;
+
+         case PKGCACHE_SNAPSHOT:
+            // -expire alone doesn't create a snapshot
+            if (iExpire)
+               iErr = SnapshotExpire(szPkgcachePathname, iExpire);
+            if (!iErr && (*szName || !iExpire))
+               iErr = SnapshotCreate(szPkgcachePathname, szName);
+            if (!iErr)
+               iErr = SnapshotList(szPkgcachePathname);
+            break;
+
+         case PKGCACHE_SERVE:
+            iErr = ServeRun(szPkgcachePathname, szListen, NULL, NULL, NULL,
+                            NULL);
+            break;
+
+         case PKGCACHE_PROXY:
             ListGetRepoUrl(     szPkgRepoUrl);
             ListGetNavFilter(     szPkgNavFilter);
             ListGetPathFilter(     szPkgPathFilter);
             if (*szPkgRepoUrl)
-            {
-               iNew = ListGetStatNew();
-               do
-               {
-                  i = iNew;
-                  iErr = DownloadUpdates(szPkgRepoUrl, szPkgNavFilter,
-                                         szPkgPathFilter, szPkgcachePathname);
-                  if (iErr == ERROR_PKGCACHE_NO_EOH)
-                  {
-                     p = getenv(ENVHTTPTIMEOUT);
-                     if (p)
-                     {
-                        if (atoi(p) > 1)
-                           printf("HTTP Fetch Timeout: %s sec., ", p);
-                        else
-                           printf("No HTTP Fetch Timeout specified! ");
-                     }
-                     printf("Retry? ([CR]=Yes) ");
-                     gets_s(sz, LNSZ);
-                     if (!(*sz) || *sz=='y' || *sz=='Y')
-                     {
-                        i--;
-                        iErr = 0;
-                     }
-                  }
-                  iNew = ListGetStatNew();
-               }
-               while (iNew != i && !iErr) ;
-            }
+               iErr = ServeRun(szPkgcachePathname, szListen, szPkgRepoUrl,
+                               szPkgNavFilter, szPkgPathFilter,
+                               szPkglistFilename);
             else
                iErr = ERROR_PKGCACHE_REPO;
             break;
       }
    }
-   if (!iErr)
+   // SERVE and PROXY run long, the proxy saved its adds as they came
+   if (!iErr && iCommand != PKGCACHE_SERVE && iCommand != PKGCACHE_PROXY)
       iErr = ListSave(szPkglistFilename);
+   else if (iErr == ERROR_PKGCACHE_VERIFY && iRequeue)
+   {
+      // Keep the requeued packages, the verification error stays
+      if (ListSave(szPkglistFilename))
+         printf("ERROR: The package list can't be saved!\n");
+   }
+
+   // The journal is only needed to resume an unsaved run
+   JournalClose(!iErr);
+   StrSetClear(&sDbFilenames);
+   WatchQuit();
+   ReplayQuit();
+   DownloadQuit();
    if (!iErr)
    {
       iNew = ListGetStatNew();
@@ -1185,8 +869,12 @@ main(int argc, char** argv)
          printf("ERROR: File Write Failed!\n\n");
          break;
          
+      case ERROR_PKGCACHE_KEY:
+         printf("ERROR: Can't sign with the specified key!\n\n");
+         break;
+         
       case ERROR_PKGCACHE_INFO:
-         printf("ERROR: Can't fetch 'pkg info' results!"
+         printf("ERROR: Can't read the installed packages database!"
                 "  Workaround: Use the ADD command!\n\n");
          break;
          
@@ -1194,6 +882,18 @@ main(int argc, char** argv)
          printf("ERROR: Out of memory!\n\n");
          break;
          
+      case ERROR_PKGCACHE_SERVE:
+         printf("ERROR: Can't serve on the specified address!\n\n");
+         break;
+         
+      case ERROR_PKGCACHE_SNAPSHOT:
+         printf("ERROR: The snapshot can't be created!\n\n");
+         break;
+         
+      case ERROR_PKGCACHE_VERIFY:
+         printf("ERROR: Corrupted or missing packages in the cache!\n\n");
+         break;
+         
       case ERROR_PKGCACHE_REPO:
          printf("ERROR: The repository URL is missing from the package list!\n\n");
          break;
@@ -1203,13 +903,48 @@ main(int argc, char** argv)
          break;
    }
    if (iErr == ERROR_PKGCACHE_CMD || iCommand == PKGCACHE_HELP)
-      printf("USAGE: pkgcache [-timeout <sec.>] <command> [package-list-filename]\n"
+      printf("USAGE: pkgcache [options] <command> [package-list-filename]\n"
+             "  where OPTIONS are:\n"
+             "    -attempts <count> : Attempts of a failed transfer, %d by default.\n"
+             "    -bandwidth <KB/s> : Download rate limit, none by default.\n"
+             "    -capture <dir>  : Record the download transfers.\n"
+             "    -control <socket> : Daemon control socket,\n"
+             "                      <packages-dir>/" PKGCACHE_DAEMON_CONTROL " by default.\n"
+             "    -db <file>      : pkg database or 'pkg query' dump for create,\n"
+             "                      " PKGCACHE_PKGDB_DEFAULT " by default.\n"
+             "    -expire <days>  : Snapshot removes the older snapshots instead.\n"
+             "    -firstbyte <sec.> : Time to the response, %d by default.\n"
+             "    -interval <min.> : Daemon synchronization interval, on request by default.\n"
+             "    -jobs <count>   : Maximum concurrent download jobs, %d by default.\n"
+             "    -keep <count>   : Newest versions of a package to download, %d by default.\n"
+             "    -key <file>     : RSA private key to sign trimmed catalogs.\n"
+             "    -listen <[address:]port> : HTTP server address, "
+             PKGCACHE_SERVE_DEFAULT " by default.\n"
+             "    -name <name>    : Snapshot name, the date and time by default.\n"
+             "    -playback <dir>[:<scale>] : Download the recorded transfers.\n"
+             "    -requeue        : Verify requeues the corrupted packages.\n"
+             "    -stall <bytes/s>[:<sec.>] : Low speed limit, %d:%d by default.\n"
+             "    -timeout <sec.> : HTTP connect and read timeout.\n"
+             "    -upstream <dir>|<file://url> : Import source.\n"
              "  where COMMAND is:\n"
              "    add      : Interactively add packages to the package list.\n"
-             "    create   : Create the package list using 'pkg info'.\n"
+             "    create   : Create the package list from the installed packages.\n"
+             "    daemon   : Download, again and again, controlled by a socket.\n"
              "    download : Download relevant packages via Internet.\n"
              "    help     : Display this command syntax page.\n"
-             "  Note that the first letter of options and commands is accepted.\n\n");
+             "    import   : Download from a local mirror or packages directory.\n"
+             "    proxy    : Serve, fetching missing files via Internet.\n"
+             "    rescan   : Add the dependencies of the cached packages.\n"
+             "    serve    : Serve the packages directory over HTTP.\n"
+             "    snapshot : Freeze the packages directory with hard links.\n"
+             "    trim     : Trim catalogs to the cached packages.\n"
+             "    verify   : Check the cached packages' checksums.\n"
+             "  Note that options and commands may be abbreviated, as long as\n"
+             "  the abbreviation matches only one of them.\n\n",
+             PKGCACHE_WATCH_ATTEMPTS, PKGCACHE_WATCH_FIRSTBYTE,
+             PKGCACHE_DOWNLOAD_JOBS, PKGCACHE_DOWNLOAD_KEEP,
+             PKGCACHE_WATCH_STALLSPEED,
+             PKGCACHE_WATCH_STALLTIME);
    
    return(iErr ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,194 @@
+/* 
+ * File:    pkgdb.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Installed packages database. Tested under FreeBSD 11.2.
+ *
+ *          The installed packages are read straight from the local pkg
+ *          SQLite database, '/var/db/pkg/local.sqlite' by default, in a
+ *          single query.  A text file is also accepted, one package per
+ *          line as a name followed by an optional origin, as produced
+ *          by "pkg query '%n %o'".  That way, a package list can be
+ *          seeded from the databases or dumps of many jails or hosts.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "common.h"
+#include "pkgdb.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_PKGDB_MAGIC        "SQLite format 3"
+#define LNPKGCACHE_PKGDB_MAGIC      16    // Including the NUL
+#define PKGCACHE_PKGDB_QUERY        "SELECT name, origin FROM packages"
+
+
+/*
+ *  PkgdbReadSqliteInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+PkgdbReadSqliteInternal(const char *szFilename, PKGDBFUNC pFunc, void *pData)
+{
+   int            iErr = 0,
+                  iStep;
+   const char     *szName,
+                  *szOrigin;
+   sqlite3        *pDb = NULL;
+   sqlite3_stmt   *pStmt = NULL;
+
+
+   if (sqlite3_open_v2(szFilename, &pDb, SQLITE_OPEN_READONLY, NULL)
+       != SQLITE_OK)
+      iErr = ERROR_PKGCACHE_INFO;
+   else if (sqlite3_prepare_v2(pDb, PKGCACHE_PKGDB_QUERY, -1, &pStmt, NULL)
+            != SQLITE_OK)
+      iErr = ERROR_PKGCACHE_INFO;
+   while (!iErr)
+   {
+      iStep = sqlite3_step(pStmt);
+      if (iStep == SQLITE_ROW)
+      {
+         szName = (const char *)sqlite3_column_text(pStmt, 0);
+         szOrigin = (const char *)sqlite3_column_text(pStmt, 1);
+         if (szName)
+            iErr = pFunc(szName, szOrigin ? szOrigin : "", pData);
+      }
+      else if (iStep == SQLITE_DONE)
+         break;
+      else
+         iErr = ERROR_PKGCACHE_INFO;
+   }
+
+#ifdef PKGCACHE_VERBOSE
+if (iErr && pDb)
+   printf("PkgdbReadSqliteInternal(%s) %s\n", szFilename, sqlite3_errmsg(pDb));
+#endif
+
+   if (pStmt)
+      sqlite3_finalize(pStmt);
+   if (pDb)
+      sqlite3_close(pDb);
+
+   return(iErr);
+}
+
+
+/*
+ *  PkgdbReadTextInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+PkgdbReadTextInternal(FILE *pFile, PKGDBFUNC pFunc, void *pData)
+{
+   int   iErr = 0;
+   char  sz[LNSZ],
+         *p,
+         *szName,
+         *szOrigin;
+
+
+   while (!iErr && fgets(sz, LNSZ, pFile))
+   {
+      // Name, then origin
+      p = sz;
+      while (isspace(*p))
+         p++;
+      szName = p;
+      while (*p && !isspace(*p))
+         p++;
+      if (*p)
+      {
+         *p = 0;
+         p++;
+      }
+      while (isspace(*p))
+         p++;
+      szOrigin = p;
+      while (*p && !isspace(*p))
+         p++;
+      *p = 0;
+
+      if (*szName)
+         iErr = pFunc(szName, szOrigin, pData);
+   }
+   if (!iErr && ferror(pFile))
+      iErr = ERROR_PKGCACHE_FILE_R;
+
+   return(iErr);
+}
+
+
+/*
+ *  PkgdbRead
+ *
+ *  Call pFunc for each package of the database or dump file.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+PkgdbRead(const char *szFilename, PKGDBFUNC pFunc, void *pData)
+{
+   int   iErr = 0;
+   char  szMagic[LNPKGCACHE_PKGDB_MAGIC];
+   FILE  *pFile;
+
+
+   pFile = fopen(szFilename, "r");
+   if (pFile)
+   {
+      if (fread(szMagic, 1, LNPKGCACHE_PKGDB_MAGIC, pFile)
+             == LNPKGCACHE_PKGDB_MAGIC
+          && !memcmp(szMagic, PKGCACHE_PKGDB_MAGIC, LNPKGCACHE_PKGDB_MAGIC))
+      {
+         fclose(pFile);
+         pFile = NULL;
+         iErr = PkgdbReadSqliteInternal(szFilename, pFunc, pData);
+      }
+      else
+      {
+         rewind(pFile);
+         iErr = PkgdbReadTextInternal(pFile, pFunc, pData);
+      }
+
+      if (pFile)
+         fclose(pFile);
+   }
+   else
+      iErr = ERROR_PKGCACHE_INFO;
+
+   return(iErr);
+}
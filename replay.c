@@ -0,0 +1,573 @@
+/* 
+ * File:    replay.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Transfer capture and playback. Tested under FreeBSD 11.2.
+ *
+ *          With -capture <dir>, every HTTP transfer of a DOWNLOAD is
+ *          recorded in the directory:
+ *            index            : One line per transfer, in order:
+ *                               <status> <ttfb> <duration> <size>
+ *                               <mtime> <sha256> <url>
+ *                               The status is O for OK, U for
+ *                               unchanged, M for missing and E for
+ *                               failed, the times are in microseconds.
+ *            bodies/<sha256>  : The bodies, stored once per content.
+ *          With -playback <dir>[:<scale>], the transfers are served
+ *          from the directory instead of the network.  The time to
+ *          first byte and the duration of each transfer are replayed,
+ *          multiplied by the scale (1 by default, 0 for no delay).  A
+ *          URL transferred several times plays its records in order,
+ *          then its last one again.  A URL never recorded is missing.
+ *          Since fetch doesn't hand out the response headers, the
+ *          size and the modification time stand for them.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fetch.h>
+
+#include "common.h"
+#include "replay.h"
+#include "throttle.h"
+
+
+/*
+ *  Constants
+ */
+
+#define LNREPLAYSUM                 LNSHA256SUM
+
+#define PKGCACHE_REPLAY_BODIES      "bodies/"
+#define PKGCACHE_REPLAY_INDEX       "index"
+#define PKGCACHE_REPLAY_TEMP        ".pkgcachetempXXXXXX"
+
+#define PKGCACHE_REPLAY_OFF         0
+#define PKGCACHE_REPLAY_CAPTURE     1
+#define PKGCACHE_REPLAY_PLAYBACK    2
+
+
+/*
+ *  Types
+ */
+
+typedef struct
+{
+   char     cStatus,
+            szSum[LNREPLAYSUM],
+            *szUrl;
+   int      iSequence,
+            iUsed;
+   int64_t  iDuration,
+            iTtfb;
+   off_t    iSize;
+   time_t   iMtime;
+} RECORD;
+
+// A body being played back, see ReplayReadInternal
+typedef struct
+{
+   int      iFd;
+   int64_t  iDuration,
+            iStart;
+   off_t    iDone,
+            iSize;
+} PLAYBACK;
+
+
+/*
+ *  Object variables
+ */
+
+int               giReplayCount = 0,
+                  giReplayMode = PKGCACHE_REPLAY_OFF;
+double            gdReplayScale = 1.0;
+FILE              *gpReplayIndex = NULL;
+FILENAME          gszReplayDirname;
+pthread_mutex_t   gsReplayMutex = PTHREAD_MUTEX_INITIALIZER;
+RECORD            *gpReplayRecords = NULL;
+
+
+/*
+ *  ReplayCompareInternal
+ *
+ *  Return: The qsort order of the records, by URL then sequence
+ */
+
+int
+ReplayCompareInternal(const void *p1, const void *p2)
+{
+   int            iRet;
+   const RECORD   *pRecord1 = p1,
+                  *pRecord2 = p2;
+
+
+   iRet = strcmp(pRecord1->szUrl, pRecord2->szUrl);
+   if (!iRet)
+      iRet = pRecord1->iSequence - pRecord2->iSequence;
+
+   return(iRet);
+}
+
+
+/*
+ *  ReplaySleepInternal
+ */
+
+void
+ReplaySleepInternal(const int64_t iWait)
+{
+   struct timespec   sWait;
+
+
+   if (iWait > 0)
+   {
+      sWait.tv_sec = iWait / 1000000;
+      sWait.tv_nsec = (iWait % 1000000) * 1000;
+      nanosleep(&sWait, NULL);
+   }
+}
+
+
+/*
+ *  ReplayDirnameInternal
+ *
+ *  Set gszReplayDirname to szDirname, absolute and ending with '/'.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ReplayDirnameInternal(const char *szDirname)
+{
+   int      i,
+            iErr = 0;
+   FILENAME sz = "";
+
+
+   if (*szDirname != '/' && (!getcwd(sz, LNFILENAME - 1) || !(*sz)))
+      iErr = ERROR_PKGCACHE_ACCESS;
+   else
+   {
+      i = strlen(sz);
+      if (i && sz[i - 1] != '/')
+         strcat(sz, "/");
+      i = strlen(sz) + strlen(szDirname);
+      if (!(*szDirname) || i + 30 >= LNFILENAME)
+         iErr = ERROR_PKGCACHE_CMD;
+      else
+         sprintf(gszReplayDirname, "%s%s%s", sz, szDirname,
+                 (szDirname[strlen(szDirname) - 1] == '/') ? "" : "/");
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  ReplayReadInternal
+ *
+ *  funopen(3) read function, the body arrives at the recorded pace.
+ *
+ *  Return: The number of bytes read, -1 on error
+ */
+
+int
+ReplayReadInternal(void *pCookie, char *pBuffer, int l)
+{
+   int         i;
+   PLAYBACK    *pPlayback = pCookie;
+
+
+   i = read(pPlayback->iFd, pBuffer, l);
+   if (i > 0)
+   {
+      pPlayback->iDone += i;
+      if (pPlayback->iSize > 0)
+         ReplaySleepInternal(pPlayback->iStart + pPlayback->iDuration
+                             * pPlayback->iDone / pPlayback->iSize
+                             - ThrottleClock());
+   }
+
+   return(i);
+}
+
+
+/*
+ *  ReplayCloseInternal
+ *
+ *  Return: 0
+ */
+
+int
+ReplayCloseInternal(void *pCookie)
+{
+   PLAYBACK    *pPlayback = pCookie;
+
+
+   close(pPlayback->iFd);
+   free(pPlayback);
+
+   return(0);
+}
+
+
+/*
+ *  ReplayCapture
+ *
+ *  Record the transfers in szDirname.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ReplayCapture(const char *szDirname)
+{
+   int      iErr;
+   FILENAME sz;
+
+
+   iErr = ReplayDirnameInternal(szDirname);
+   if (!iErr)
+   {
+      sprintf(sz, "%s" PKGCACHE_REPLAY_BODIES, gszReplayDirname);
+      iErr = MakePath(sz);
+   }
+   if (!iErr)
+   {
+      sprintf(sz, "%s" PKGCACHE_REPLAY_INDEX, gszReplayDirname);
+      gpReplayIndex = fopen(sz, "a");
+      if (gpReplayIndex)
+      {
+         giReplayMode = PKGCACHE_REPLAY_CAPTURE;
+         printf("Capturing the transfers in %s\n", gszReplayDirname);
+      }
+      else
+         iErr = ERROR_PKGCACHE_FILE_W;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  ReplayGetURL
+ *
+ *  Same as fetchXGetURL, from the records.  *piStatus is the FETCH_xyz
+ *  code of a failure, 0 on success.
+ *
+ *  Return: The body stream, NULL on failure
+ */
+
+FILE *
+ReplayGetURL(const char *pUrl, struct url_stat *pStat,
+             int *piStatus)
+{
+   int         i,
+               iFd = -1,
+               j;
+   FILE        *pFile = NULL;
+   FILENAME    sz;
+   PLAYBACK    *pPlayback;
+   RECORD      *pRecord = NULL,
+               sKey;
+
+
+   // The first unused record of the URL, or its last one
+   pthread_mutex_lock(&gsReplayMutex);
+   sKey.szUrl = (char *)pUrl;
+   sKey.iSequence = -1;
+   i = 0;
+   j = giReplayCount;
+   while (i < j)
+   {
+      if (ReplayCompareInternal(gpReplayRecords + (i + j) / 2, &sKey) < 0)
+         i = (i + j) / 2 + 1;
+      else
+         j = (i + j) / 2;
+   }
+   while (i < giReplayCount && !strcmp(gpReplayRecords[i].szUrl, pUrl))
+   {
+      pRecord = gpReplayRecords + i;
+      if (!pRecord->iUsed)
+         break;
+      i++;
+   }
+   if (pRecord)
+      pRecord->iUsed = 1;
+   pthread_mutex_unlock(&gsReplayMutex);
+
+   if (pRecord)
+   {
+      ReplaySleepInternal(pRecord->iTtfb * gdReplayScale);
+      if (pRecord->cStatus == 'O'
+          && strlen(gszReplayDirname) + LNREPLAYSUM + 10 < LNFILENAME)
+      {
+         sprintf(sz, "%s" PKGCACHE_REPLAY_BODIES "%s", gszReplayDirname,
+                 pRecord->szSum);
+         iFd = open(sz, O_RDONLY);
+      }
+   }
+   if (iFd >= 0)
+   {
+      pPlayback = malloc(sizeof(PLAYBACK));
+      if (pPlayback)
+      {
+         pPlayback->iFd = iFd;
+         pPlayback->iDone = 0;
+         pPlayback->iSize = pRecord->iSize;
+         pPlayback->iDuration = pRecord->iDuration * gdReplayScale;
+         pPlayback->iStart = ThrottleClock();
+         pFile = funopen(pPlayback, ReplayReadInternal, NULL, NULL,
+                         ReplayCloseInternal);
+         if (!pFile)
+            free(pPlayback);
+      }
+      if (pFile)
+      {
+         pStat->size = pRecord->iSize;
+         pStat->mtime = pRecord->iMtime;
+         pStat->atime = pRecord->iMtime;
+      }
+      else
+         close(iFd);
+   }
+   if (pFile)
+      *piStatus = 0;
+   else if (pRecord && pRecord->cStatus == 'U')
+      *piStatus = FETCH_UNCHANGED;
+   else
+      *piStatus = (!pRecord || pRecord->cStatus == 'M') ? FETCH_UNAVAIL
+                                                        : FETCH_NETWORK;
+
+   return(pFile);
+}
+
+
+/*
+ *  ReplayIsPlayback
+ *
+ *  Return: TRUE if the transfers come from the records
+ */
+
+int
+ReplayIsPlayback(void)
+{
+   return(giReplayMode == PKGCACHE_REPLAY_PLAYBACK);
+}
+
+
+/*
+ *  ReplayPlayback
+ *
+ *  Load the records of szDirname, the times multiplied by dScale.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ReplayPlayback(const char *szDirname, const double dScale)
+{
+   int         iErr,
+               iSize = 0;
+   char        cStatus,
+               szLine[LNFILENAME + 200],
+               szSum[LNREPLAYSUM],
+               szUrl[LNFILENAME];
+   long long   iDuration,
+               iMtime,
+               iSize2,
+               iTtfb;
+   FILE        *pFile = NULL;
+   FILENAME    sz;
+   RECORD      *pRecords;
+
+
+   if (dScale < 0)
+      iErr = ERROR_PKGCACHE_CMD;
+   else
+      iErr = ReplayDirnameInternal(szDirname);
+   if (!iErr)
+   {
+      sprintf(sz, "%s" PKGCACHE_REPLAY_INDEX, gszReplayDirname);
+      pFile = fopen(sz, "r");
+      if (!pFile)
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+   while (!iErr && fgets(szLine, sizeof(szLine), pFile))
+   {
+      if (sscanf(szLine, "%c %lld %lld %lld %lld %64s %1023s", &cStatus,
+                 &iTtfb, &iDuration, &iSize2, &iMtime, szSum, szUrl) == 7)
+      {
+         if (giReplayCount == iSize)
+         {
+            iSize = iSize ? iSize * 2 : LNSZ;
+            pRecords = realloc(gpReplayRecords, sizeof(RECORD) * iSize);
+            if (pRecords)
+               gpReplayRecords = pRecords;
+            else
+               iErr = ERROR_PKGCACHE_MEM;
+         }
+         if (!iErr)
+         {
+            pRecords = gpReplayRecords + giReplayCount;
+            pRecords->szUrl = strdup(szUrl);
+            if (pRecords->szUrl)
+            {
+               pRecords->cStatus = cStatus;
+               strcpy(pRecords->szSum, szSum);
+               pRecords->iSequence = giReplayCount;
+               pRecords->iUsed = 0;
+               pRecords->iDuration = iDuration;
+               pRecords->iTtfb = iTtfb;
+               pRecords->iSize = iSize2;
+               pRecords->iMtime = iMtime;
+               giReplayCount++;
+            }
+            else
+               iErr = ERROR_PKGCACHE_MEM;
+         }
+      }
+   }
+   if (pFile)
+      fclose(pFile);
+
+   if (!iErr)
+   {
+      qsort(gpReplayRecords, giReplayCount, sizeof(RECORD),
+            ReplayCompareInternal);
+      gdReplayScale = dScale;
+      giReplayMode = PKGCACHE_REPLAY_PLAYBACK;
+      printf("Playing back %d transfers from %s\n", giReplayCount,
+             gszReplayDirname);
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  ReplayQuit
+ */
+
+void
+ReplayQuit(void)
+{
+   int   i;
+
+
+   if (gpReplayIndex)
+      fclose(gpReplayIndex);
+   gpReplayIndex = NULL;
+   for (i = 0 ; i < giReplayCount ; i++)
+      free(gpReplayRecords[i].szUrl);
+   if (gpReplayRecords)
+      free(gpReplayRecords);
+   gpReplayRecords = NULL;
+   giReplayCount = 0;
+   giReplayMode = PKGCACHE_REPLAY_OFF;
+}
+
+
+/*
+ *  ReplayRecord
+ *
+ *  Record a transfer, its body being the content of iFd.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ReplayRecord(const char *pUrl, const struct url_stat *pStat, const int iFd,
+             const char cStatus, const int64_t iTtfb,
+             const int64_t iDuration)
+{
+   int            iErr = 0,
+                  iFdW = -1;
+   char           block[LNSZ * 16],
+                  szSum[LNREPLAYSUM] = "-";
+   off_t          iOffset = 0;
+   ssize_t        l;
+   SHA256SUM      sSum;
+   FILENAME       sz,
+                  szTempname;
+
+
+   if (giReplayMode == PKGCACHE_REPLAY_CAPTURE && cStatus == 'O')
+   {
+      // Hash the body while copying it in a temporary file
+      sprintf(szTempname, "%s" PKGCACHE_REPLAY_BODIES PKGCACHE_REPLAY_TEMP,
+              gszReplayDirname);
+      iFdW = mkstemp(szTempname);
+      if (iFdW < 0)
+         iErr = ERROR_PKGCACHE_FILE_W;
+      else
+      {
+         fchmod(iFdW, 0644);
+         iErr = Sha256Init(&sSum);
+         while (!iErr && (l = pread(iFd, block, sizeof(block), iOffset)) > 0)
+         {
+            iErr = Sha256Update(&sSum, block, l);
+            if (!iErr && write(iFdW, block, l) != l)
+               iErr = ERROR_PKGCACHE_FILE_W;
+            iOffset += l;
+         }
+         if (close(iFdW) && !iErr)
+            iErr = ERROR_PKGCACHE_FILE_W;
+         if (Sha256Final(&sSum,     szSum) && !iErr)
+            iErr = ERROR_PKGCACHE_MEM;
+
+         // Stored once per content
+         sprintf(sz, "%s" PKGCACHE_REPLAY_BODIES "%s", gszReplayDirname,
+                 szSum);
+         if (iErr || Exist(sz, PKGCACHE_EXIST_FILE))
+            remove(szTempname);
+         else if (rename(szTempname, sz))
+         {
+            remove(szTempname);
+            iErr = ERROR_PKGCACHE_FILE_W;
+         }
+      }
+   }
+   if (!iErr && giReplayMode == PKGCACHE_REPLAY_CAPTURE)
+   {
+      pthread_mutex_lock(&gsReplayMutex);
+      if (fprintf(gpReplayIndex, "%c %lld %lld %lld %lld %s %s\n", cStatus,
+                  (long long)iTtfb, (long long)iDuration, (long long)iOffset,
+                  (long long)(pStat ? pStat->mtime : 0), szSum, pUrl) < 0
+          || fflush(gpReplayIndex))
+         iErr = ERROR_PKGCACHE_FILE_W;
+      pthread_mutex_unlock(&gsReplayMutex);
+   }
+
+   return(iErr);
+}
@@ -0,0 +1,49 @@
+/* 
+ * File:    replay.h
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Transfer capture and playback header file. Tested under
+ *          FreeBSD 11.2.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef PKGCACHE_REPLAY_H
+#define PKGCACHE_REPLAY_H
+
+
+/*
+ *  Prototypes
+ */
+
+int  ReplayCapture(const char *szDirname);
+FILE *ReplayGetURL(const char *pUrl, struct url_stat *pStat,
+                   int *piStatus);
+int  ReplayIsPlayback(void);
+int  ReplayPlayback(const char *szDirname, const double dScale);
+void ReplayQuit(void);
+int  ReplayRecord(const char *pUrl, const struct url_stat *pStat,
+                  const int iFd, const char cStatus, const int64_t iTtfb,
+                  const int64_t iDuration);
+
+
+#endif  // PKGCACHE_REPLAY_H
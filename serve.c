@@ -0,0 +1,1535 @@
+/* 
+ * File:    serve.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   HTTP server for the packages directory. Tested under
+ *          FreeBSD 11.2.
+ *
+ *          A single thread serves every client from a kqueue(2) event
+ *          loop.  Files are sent with sendfile(2), connections are kept
+ *          alive, and a single byte range may be requested.  Hidden
+ *          files and directories, i.e. pkgcache's own files, are never
+ *          served.  Directory listings use the same format as the
+ *          official repository, so that another pkgcache can download
+ *          from this one.
+ *
+ *          In proxy mode, a file missing from the cache is fetched from
+ *          the upstream repository by a thread, into a hidden temporary
+ *          file of its directory.  The clients asking for it are served
+ *          from that file as it grows, so a single upstream transfer
+ *          feeds them all.  Once complete, the file is moved in place,
+ *          also linked into the generation of a DOWNLOAD going on, and
+ *          its package name is added to the package list.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <fetch.h>
+
+#include "common.h"
+#include "generation.h"
+#include "list.h"
+#include "serve.h"
+
+
+/*
+ *  Constants
+ */
+
+#define LNSERVEDATE                 40
+#define LNSERVEEVENTS               64
+#define LNSERVEREQUEST              8192
+#define LNSERVESENDFILE             (1024*1024)
+
+#define PKGCACHE_SERVE_BACKLOG      128
+#define PKGCACHE_SERVE_IDLE         60       // sec.
+#define PKGCACHE_SERVE_TIMER        10000    // msec.
+
+#define PKGCACHE_SERVE_READ         1
+#define PKGCACHE_SERVE_WRITE        2
+#define PKGCACHE_SERVE_WAIT         3     // For the proxy headers
+
+#define PKGCACHE_SERVE_TEMP         ".pkgcachetemp"
+#define PKGCACHE_SERVE_USER         2     // EVFILT_USER identifier
+
+
+/*
+ *  Types
+ */
+
+// The fields after iFdR are shared with the thread, see gsServeMutex.
+typedef struct PROXY
+{
+   int            iFdR,
+                  iHandled,
+                  iRefs;
+   FILENAME       szPath,
+                  szPathname,
+                  szTempname,
+                  szUrl;
+   pthread_t      sThread;
+   int            iDone,
+                  iErr,
+                  iHeaders;
+   off_t          iAvailable,
+                  iSize;
+   time_t         iMtime;
+   struct PROXY   *pNext;
+} PROXY;
+
+typedef struct CONN
+{
+   int         iFd,
+               iFdFile,
+               iHead,
+               iKeepAlive,
+               iState;
+   off_t       iOffset,
+               iRemaining;      // -1 when unknown
+   size_t      iRequest,
+               iResponseSent;
+   time_t      iActivity;
+   BUFFER      sRequest,
+               sResponse;
+   PROXY       *pProxy;
+   struct CONN *pNext,
+               *pPrev;
+} CONN;
+
+
+/*
+ *  Object variables
+ */
+
+int               giServeDirFd = -1,
+                  giServeKq = -1;
+char              gszServeDirname[LNFILENAME] = "",
+                  gszServeNavFilter[LNFILENAME] = "",
+                  gszServePathFilter[LNFILENAME] = "",
+                  gszServePkglistFilename[LNFILENAME] = "",
+                  gszServeRepoUrl[LNFILENAME] = "";
+CONN              *gpServeConns = NULL,
+                  *gpServeDead = NULL;
+PROXY             *gpServeProxies = NULL;
+pthread_mutex_t   gsServeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ *  Prototypes
+ */
+
+void ServeProcessInternal(CONN *pConn);
+
+
+/*
+ *  ServeProxyReleaseInternal
+ */
+
+void
+ServeProxyReleaseInternal(CONN *pConn)
+{
+   if (pConn->pProxy)
+   {
+      pConn->pProxy->iRefs--;
+      pConn->pProxy = NULL;
+   }
+}
+
+
+/*
+ *  ServeCloseInternal
+ *
+ *  The connection is only freed after the current batch of events,
+ *  since a later event of the batch may still refer to it.
+ */
+
+void
+ServeCloseInternal(CONN *pConn)
+{
+   if (pConn->iFd >= 0)
+   {
+      close(pConn->iFd);
+      pConn->iFd = -1;
+   }
+   if (pConn->iFdFile >= 0)
+   {
+      close(pConn->iFdFile);
+      pConn->iFdFile = -1;
+   }
+   ServeProxyReleaseInternal(pConn);
+
+   // Move it to the dead list
+   if (pConn->pPrev)
+      pConn->pPrev->pNext = pConn->pNext;
+   else
+      gpServeConns = pConn->pNext;
+   if (pConn->pNext)
+      pConn->pNext->pPrev = pConn->pPrev;
+   pConn->pPrev = NULL;
+   pConn->pNext = gpServeDead;
+   gpServeDead = pConn;
+}
+
+
+/*
+ *  ServeFreeDeadInternal
+ */
+
+void
+ServeFreeDeadInternal(void)
+{
+   CONN *pConn;
+
+
+   while (gpServeDead)
+   {
+      pConn = gpServeDead;
+      gpServeDead = pConn->pNext;
+      BufferFree(&(pConn->sRequest));
+      BufferFree(&(pConn->sResponse));
+      free(pConn);
+   }
+}
+
+
+/*
+ *  ServeHeaderInternal
+ *
+ *  Return: TRUE if the request header is found.
+ */
+
+int
+ServeHeaderInternal(const char *pRequest, const char *szName,
+                       char *szValue, const int l)
+{
+   int         i = 0,
+               iName;
+   const char  *p;
+
+
+   iName = strlen(szName);
+   p = strstr(pRequest, "\r\n");
+   while (p && !i)
+   {
+      p += 2;
+      if (!strncasecmp(p, szName, iName) && p[iName] == ':')
+      {
+         p += iName + 1;
+         while (*p == ' ' || *p == '\t')
+            p++;
+         while (*p && *p != '\r' && i < l-1)
+         {
+            szValue[i] = *p;
+            i++;
+            p++;
+         }
+         if (!i)
+            i = -1;  // Found, but empty
+      }
+      else
+         p = strstr(p, "\r\n");
+   }
+   if (i > 0)
+      szValue[i] = 0;
+   else
+      *szValue = 0;
+
+   return(i != 0);
+}
+
+
+/*
+ *  ServePathInternal
+ *
+ *  Decode the request target into a path relative to the packages
+ *  directory.
+ *
+ *  Return: TRUE if valid.
+ */
+
+int
+ServePathInternal(const char *pTarget, const int iTarget,     char *szPath)
+{
+   int   i,
+         iBool = 1,
+         iPath = 0,
+         iSegment = 1;
+   char  c,
+         szHex[3];
+
+
+   if (*pTarget != '/')
+      iBool = 0;
+   for (i = 1 ; iBool && i < iTarget && pTarget[i] != '?'
+                && pTarget[i] != '#' ; i++)
+   {
+      c = pTarget[i];
+      if (c == '%' && i + 2 < iTarget && isxdigit(pTarget[i+1])
+          && isxdigit(pTarget[i+2]))
+      {
+         szHex[0] = pTarget[i+1];
+         szHex[1] = pTarget[i+2];
+         szHex[2] = 0;
+         c = strtol(szHex, NULL, 16);
+         i += 2;
+      }
+
+      // No hidden files, no '.' or '..' navigation
+      if (iSegment && c == '.')
+         iBool = 0;
+      else if (!c || iPath >= LNFILENAME-1)
+         iBool = 0;
+      else
+      {
+         iSegment = (c == '/');
+         szPath[iPath] = c;
+         iPath++;
+      }
+   }
+   szPath[iPath] = 0;
+
+   return(iBool);
+}
+
+
+/*
+ *  ServeResponseInternal
+ *
+ *  Build the response headers, followed by the in memory body if any.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeResponseInternal(CONN *pConn, const char *szStatus,
+                         const char *szHeaders, const off_t iLength,
+                         BUFFER *pBody)
+{
+   int   i,
+         iErr;
+   char  sz[LNSZ];
+
+
+   // Without a length, the end of the body is the end of the connection
+   if (iLength < 0)
+      pConn->iKeepAlive = 0;
+
+   i = snprintf(sz, LNSZ, "HTTP/1.1 %s\r\n"
+                          "Server: pkgcache\r\n"
+                          "Connection: %s\r\n",
+                szStatus, pConn->iKeepAlive ? "keep-alive" : "close");
+   if (iLength >= 0)
+      snprintf(sz + i, LNSZ - i, "Content-Length: %jd\r\n", (intmax_t)iLength);
+
+   pConn->sResponse.iLength = 0;
+   pConn->iResponseSent = 0;
+   iErr = BufferAppendStr(&(pConn->sResponse), sz);
+   if (!iErr && szHeaders)
+      iErr = BufferAppendStr(&(pConn->sResponse), szHeaders);
+   if (!iErr)
+      iErr = BufferAppendStr(&(pConn->sResponse), "\r\n");
+   if (!iErr && pBody)
+      iErr = BufferAppend(&(pConn->sResponse), pBody->p, pBody->iLength);
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeErrorInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeErrorInternal(CONN *pConn, const char *szStatus, const char *szHeaders,
+                      const int iHead)
+{
+   int      iErr;
+   char     sz[LNSZ];
+   BUFFER   sBody = {NULL, 0, 0};
+
+
+   snprintf(sz, LNSZ, "<html><head><title>%s</title></head>"
+                      "<body><h1>%s</h1></body></html>\n", szStatus, szStatus);
+   iErr = BufferAppendStr(&sBody, sz);
+   if (!iErr)
+      iErr = ServeResponseInternal(pConn, szStatus, szHeaders, sBody.iLength,
+                                   iHead ? NULL : &sBody);
+   BufferFree(&sBody);
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeEscapeInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeEscapeInternal(BUFFER *pBuffer, const char *sz, const char *szEscape)
+{
+   int   iErr = 0;
+   char  szHex[4];
+
+
+   while (*sz && !iErr)
+   {
+      if (strchr(szEscape, *sz))
+      {
+         sprintf(szHex, "%%%02X", (unsigned char)*sz);
+         iErr = BufferAppend(pBuffer, szHex, 3);
+      }
+      else
+         iErr = BufferAppend(pBuffer, sz, 1);
+      sz++;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeListingInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeListingInternal(CONN *pConn, const int iFdDir, const char *szPath,
+                        const int iHead)
+{
+   int            i,
+                  iErr = 0,
+                  iFd;
+   char           *p;
+   BUFFER         sBody = {NULL, 0, 0};
+   DIR            *pDir;
+   STRSET         sNames = {0, 0, NULL};
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   iFd = dup(iFdDir);
+   pDir = (iFd >= 0) ? fdopendir(iFd) : NULL;
+   if (pDir)
+   {
+      while (!iErr && (pEntry = readdir(pDir)))
+      {
+         if (*(pEntry->d_name) != '.'
+             && !fstatat(iFdDir, pEntry->d_name, &sPathStats, 0))
+         {
+            if (S_ISDIR(sPathStats.st_mode))
+            {
+               // Same as the official repository, see DownloadUpdates
+               if (strchr(pEntry->d_name, ':'))
+                  iErr = StrSetAdd(&sNames, pEntry->d_name);
+               else if ((p = malloc(strlen(pEntry->d_name) + 2)))
+               {
+                  sprintf(p, "%s/", pEntry->d_name);
+                  iErr = StrSetAdd(&sNames, p);
+                  free(p);
+               }
+               else
+                  iErr = ERROR_PKGCACHE_MEM;
+            }
+            else if (S_ISREG(sPathStats.st_mode))
+               iErr = StrSetAdd(&sNames, pEntry->d_name);
+         }
+      }
+      closedir(pDir);
+   }
+   else
+   {
+      if (iFd >= 0)
+         close(iFd);
+      iErr = ERROR_PKGCACHE_ACCESS;
+   }
+
+   if (!iErr)
+   {
+      iErr = BufferAppendStr(&sBody, "<html><head><title>Index of /");
+      if (!iErr)
+         iErr = ServeEscapeInternal(&sBody, szPath, "<>&");
+      if (!iErr)
+         iErr = BufferAppendStr(&sBody, "</title></head>\n<body>\n<pre>\n"
+                                        "<a href=\"../\">../</a>\n");
+      for (i = 0 ; !iErr && i < sNames.iCount ; i++)
+      {
+         iErr = BufferAppendStr(&sBody, "<a href=\"");
+         if (!iErr)
+            iErr = ServeEscapeInternal(&sBody, sNames.ppStr[i], " \"#%:<>?&");
+         if (!iErr)
+            iErr = BufferAppendStr(&sBody, "\">");
+         if (!iErr)
+            iErr = ServeEscapeInternal(&sBody, sNames.ppStr[i], "<>&");
+         if (!iErr)
+            iErr = BufferAppendStr(&sBody, "</a>\n");
+      }
+      if (!iErr)
+         iErr = BufferAppendStr(&sBody, "</pre>\n</body>\n</html>\n");
+   }
+   if (!iErr)
+      iErr = ServeResponseInternal(pConn, "200 OK",
+                                   "Content-Type: text/html\r\n",
+                                   sBody.iLength, iHead ? NULL : &sBody);
+
+   BufferFree(&sBody);
+   StrSetClear(&sNames);
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeWakeInternal
+ *
+ *  Wake up the event loop from a proxy thread.
+ */
+
+void
+ServeWakeInternal(void)
+{
+   struct kevent sEvent;
+
+
+   EV_SET(&sEvent, PKGCACHE_SERVE_USER, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+   kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+}
+
+
+/*
+ *  ServeProxyThreadInternal
+ *
+ *  Fetch a file from the upstream repository.
+ */
+
+void *
+ServeProxyThreadInternal(void *pData)
+{
+   int               iErr = 0,
+                     iFdR = -1,
+                     iFdW = -1;
+   char              *p,
+                     *pBlock = NULL;
+   int               iStage;
+   size_t            iCountR;
+   ssize_t           iCountW;
+   FILE              *pFileR = NULL;
+   FILENAME          szDir;
+   PROXY             *pProxy = pData;
+   struct url_stat   sStat;
+
+
+   StrnCopy(szDir, pProxy->szPathname, LNFILENAME);
+   p = strrchr(szDir, '/');
+   if (p)
+      *(p + 1) = 0;
+   iErr = MakePath(szDir);
+   if (!iErr)
+   {
+      iFdW = open(pProxy->szTempname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      iFdR = open(pProxy->szTempname, O_RDONLY);
+      if (iFdW < 0 || iFdR < 0)
+         iErr = ERROR_PKGCACHE_ACCESS;
+   }
+   if (!iErr && posix_memalign((void **)&pBlock, getpagesize(), LNIOBLOCK))
+      iErr = ERROR_PKGCACHE_MEM;
+   if (!iErr)
+   {
+      sStat.size = -1;
+      sStat.mtime = 0;
+      pFileR = fetchXGetURL(pProxy->szUrl, &sStat, "");
+      if (pFileR)
+         setvbuf(pFileR, NULL, _IOFBF, LNIOBLOCK);
+      else
+         iErr = ERROR_PKGCACHE_FILE_R;
+   }
+
+   pthread_mutex_lock(&gsServeMutex);
+   pProxy->iFdR = iFdR;
+   pProxy->iSize = sStat.size;
+   pProxy->iMtime = sStat.mtime;
+   pProxy->iErr = iErr;
+   pProxy->iHeaders = 1;
+   pthread_mutex_unlock(&gsServeMutex);
+   ServeWakeInternal();
+
+   // By chunks, so that the clients get the bytes as they come
+   while (!iErr)
+   {
+      iCountR = fread(pBlock, 1, LNIOCHUNK, pFileR);
+      if (iCountR)
+      {
+         iCountW = write(iFdW, pBlock, iCountR);
+         if (iCountW < 0 || (size_t)iCountW != iCountR)
+            iErr = ERROR_PKGCACHE_FILE_W;
+         else
+         {
+            pthread_mutex_lock(&gsServeMutex);
+            pProxy->iAvailable += iCountR;
+            pthread_mutex_unlock(&gsServeMutex);
+            ServeWakeInternal();
+         }
+      }
+      if (!iErr && iCountR < LNIOCHUNK)
+      {
+         if (!feof(pFileR) || ferror(pFileR))
+            iErr = ERROR_PKGCACHE_FILE_R;
+         else if (sStat.size >= 0 && pProxy->iAvailable != sStat.size)
+            iErr = ERROR_PKGCACHE_FILE_R;
+         else
+            break;
+      }
+   }
+
+   // Also keep it in the generation of a DOWNLOAD going on, which
+   // replaces the published trees once over.  It's looked up before
+   // the file is moved in place, a publish could come in between.
+   if (!iErr)
+   {
+      iStage = GenerationStage(gszServeDirname);
+      if (GenerationStageLink(gszServeDirname, iStage, pProxy->szTempname,
+                              pProxy->szPath))
+         printf("WARNING: %s not added to the generation being downloaded!\n",
+                pProxy->szPath);
+   }
+
+   // Move the complete file in place.  Once published, the generation
+   // may already hold it under that name, rename(2) then does nothing.
+   if (!iErr && rename(pProxy->szTempname, pProxy->szPathname))
+      iErr = ERROR_PKGCACHE_FILE_W;
+   if (iFdW >= 0)
+      remove(pProxy->szTempname);
+
+   if (pFileR)
+      fclose(pFileR);
+   if (iFdW >= 0)
+      close(iFdW);
+   if (pBlock)
+      free(pBlock);
+
+   pthread_mutex_lock(&gsServeMutex);
+   pProxy->iErr = iErr;
+   pProxy->iDone = 1;
+   pthread_mutex_unlock(&gsServeMutex);
+   ServeWakeInternal();
+
+   return(NULL);
+}
+
+
+/*
+ *  ServeProxyAttachInternal
+ *
+ *  Attach the connection to the upstream transfer of szPath, starting
+ *  one if needed.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeProxyAttachInternal(CONN *pConn, const char *szPath, const int iHead)
+{
+   int      iErr = 0;
+   char     *p;
+   FILENAME szDirUrl,
+            szUrl;
+   PROXY    *pProxy;
+
+
+   // Already in progress?  A failed transfer still held by its clients
+   // is started over.
+   pthread_mutex_lock(&gsServeMutex);
+   pProxy = gpServeProxies;
+   while (pProxy && (strcmp(pProxy->szPath, szPath)
+                     || (pProxy->iDone && pProxy->iErr)))
+      pProxy = pProxy->pNext;
+   pthread_mutex_unlock(&gsServeMutex);
+
+   if (!pProxy)
+   {
+      // Only what DownloadUpdates would download
+      if (strlen(gszServeRepoUrl) + strlen(szPath) < LNFILENAME
+          && strlen(gszServeDirname) + strlen(szPath)
+             + strlen(PKGCACHE_SERVE_TEMP) + 1 < LNFILENAME)
+      {
+         sprintf(szUrl, "%s%s", gszServeRepoUrl, szPath);
+         strcpy(szDirUrl, szUrl);
+         p = strrchr(szDirUrl, '/');
+         *(p + 1) = 0;
+         if (IsFilterMatch(szUrl, gszServePathFilter)
+             && (!strchr(szPath, '/')
+                 || IsFilterMatch(szDirUrl, gszServeNavFilter)))
+            pProxy = calloc(1, sizeof(PROXY));
+      }
+      if (pProxy)
+      {
+         strcpy(pProxy->szPath, szPath);
+         strcpy(pProxy->szUrl, szUrl);
+         sprintf(pProxy->szPathname, "%s%s", gszServeDirname, szPath);
+         strcpy(pProxy->szTempname, pProxy->szPathname);
+         p = strrchr(pProxy->szTempname, '/');
+         sprintf(p + 1, ".%s%s", strrchr(pProxy->szPathname, '/') + 1,
+                 PKGCACHE_SERVE_TEMP);
+         pProxy->iFdR = -1;
+         pProxy->iSize = -1;
+
+         if (pthread_create(&(pProxy->sThread), NULL,
+                            ServeProxyThreadInternal, pProxy))
+         {
+            free(pProxy);
+            pProxy = NULL;
+         }
+         else
+         {
+            printf("Proxying %s\n", szUrl);
+            pProxy->pNext = gpServeProxies;
+            gpServeProxies = pProxy;
+         }
+      }
+   }
+
+   if (pProxy)
+   {
+      pProxy->iRefs++;
+      pConn->pProxy = pProxy;
+      pConn->iHead = iHead;
+   }
+   else
+      iErr = ServeErrorInternal(pConn, "404 Not Found", NULL, iHead);
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeProxyHeadersInternal
+ *
+ *  Prepare the response headers once the upstream ones are known.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeProxyHeadersInternal(CONN *pConn)
+{
+   int         iErr = 0,
+               iHeaders,
+               iProxyErr;
+   char        szDate[LNSERVEDATE],
+               szHeaders[LNSZ];
+   off_t       iSize;
+   time_t      iMtime;
+   struct tm   sTm;
+
+
+   pthread_mutex_lock(&gsServeMutex);
+   iHeaders = pConn->pProxy->iHeaders;
+   iProxyErr = pConn->pProxy->iErr;
+   iSize = pConn->pProxy->iSize;
+   iMtime = pConn->pProxy->iMtime;
+   pthread_mutex_unlock(&gsServeMutex);
+
+   if (iHeaders)
+   {
+      if (iProxyErr)
+      {
+         ServeProxyReleaseInternal(pConn);
+         iErr = ServeErrorInternal(pConn, "404 Not Found", NULL,
+                                   pConn->iHead);
+      }
+      else
+      {
+         strcpy(szHeaders, "Content-Type: application/octet-stream\r\n");
+         if (iMtime)
+         {
+            gmtime_r(&iMtime, &sTm);
+            strftime(szDate, LNSERVEDATE, "%a, %d %b %Y %H:%M:%S GMT", &sTm);
+            sprintf(szHeaders + strlen(szHeaders), "Last-Modified: %s\r\n",
+                    szDate);
+         }
+         iErr = ServeResponseInternal(pConn, "200 OK", szHeaders, iSize, NULL);
+         pConn->iOffset = 0;
+         if (pConn->iHead)
+            pConn->iRemaining = 0;
+         else
+            pConn->iRemaining = iSize;
+      }
+      pConn->iState = PKGCACHE_SERVE_WRITE;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeProxyEventsInternal
+ *
+ *  Handle the progress of the proxy threads.
+ */
+
+void
+ServeProxyEventsInternal(void)
+{
+   int   iDone,
+         iErr;
+   char  *p;
+   CONN  *pConn,
+         *pNext;
+   PROXY *pProxy,
+         **ppProxy;
+
+
+   for (pProxy = gpServeProxies ; pProxy ; pProxy = pProxy->pNext)
+   {
+      pthread_mutex_lock(&gsServeMutex);
+      iDone = pProxy->iDone;
+      iErr = pProxy->iErr;
+      pthread_mutex_unlock(&gsServeMutex);
+
+      if (iDone && !pProxy->iHandled)
+      {
+         pProxy->iHandled = 1;
+         pthread_join(pProxy->sThread, NULL);
+         if (iErr)
+            printf("WARNING: %s proxy download failed!\n", pProxy->szUrl);
+         else
+         {
+            // Packages are kept in the 'All' directory.  The list is
+            // saved right away, merged with the other processes' adds.
+            p = strrchr(pProxy->szPath, '/');
+            if (p && strstr(pProxy->szPath, "All/") && !IsDownloadAlways(p + 1)
+                && ListFileAdd(gszServePkglistFilename, p + 1))
+               printf("WARNING: %s not added to the package list!\n", p + 1);
+         }
+      }
+   }
+
+   // Resume the clients of the proxied files
+   for (pConn = gpServeConns ; pConn ; pConn = pNext)
+   {
+      pNext = pConn->pNext;
+      if (pConn->pProxy)
+         ServeProcessInternal(pConn);
+   }
+
+   // Forget the completed transfers
+   ppProxy = &gpServeProxies;
+   while (*ppProxy)
+   {
+      pProxy = *ppProxy;
+      if (pProxy->iHandled && !pProxy->iRefs)
+      {
+         *ppProxy = pProxy->pNext;
+         if (pProxy->iFdR >= 0)
+            close(pProxy->iFdR);
+         free(pProxy);
+      }
+      else
+         ppProxy = &(pProxy->pNext);
+   }
+}
+
+
+/*
+ *  ServeRangeInternal
+ *
+ *  Only a single range is supported, others are ignored as allowed
+ *  by RFC 7233.
+ *
+ *  Return: TRUE if a range applies, -1 if it's not satisfiable.
+ */
+
+int
+ServeRangeInternal(const char *szRange, const off_t iSize,
+                      off_t *piOffset, off_t *piLength)
+{
+   int         iRet = 0;
+   char        *p;
+   intmax_t    iFirst,
+               iLast;
+
+
+   if (!strncasecmp(szRange, "bytes=", 6) && !strchr(szRange, ','))
+   {
+      p = (char *)szRange + 6;
+      if (*p == '-')
+      {
+         // Suffix range: the last bytes
+         iLast = strtoimax(p + 1, &p, 10);
+         if (!*p && iLast > 0)
+         {
+            if (iLast > iSize)
+               iLast = iSize;
+            *piOffset = iSize - iLast;
+            *piLength = iLast;
+            iRet = iSize ? 1 : -1;
+         }
+      }
+      else if (isdigit(*p))
+      {
+         iFirst = strtoimax(p, &p, 10);
+         if (*p == '-')
+         {
+            p++;
+            if (*p)
+               iLast = strtoimax(p, &p, 10);
+            else
+               iLast = iSize - 1;
+            if (!*p && iLast >= iFirst)
+            {
+               if (iFirst >= iSize)
+                  iRet = -1;
+               else
+               {
+                  if (iLast >= iSize)
+                     iLast = iSize - 1;
+                  *piOffset = iFirst;
+                  *piLength = iLast - iFirst + 1;
+                  iRet = 1;
+               }
+            }
+         }
+      }
+   }
+
+   return(iRet);
+}
+
+
+/*
+ *  ServeRequestInternal
+ *
+ *  Parse a complete request and prepare its response.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeRequestInternal(CONN *pConn)
+{
+   int         i = 0,
+               iErr = 0,
+               iFd,
+               iHead,
+               iRange;
+   char        szDate[LNSERVEDATE],
+               szHeaders[LNSZ],
+               szValue[LNSZ],
+               *pEnd,
+               *pRequest,
+               *pTarget;
+   off_t       iLength,
+               iOffset;
+   FILENAME    szPath;
+   struct stat sPathStats;
+   struct tm   sTm;
+
+
+   pRequest = pConn->sRequest.p;
+   pEnd = strstr(pRequest, "\r\n\r\n");
+   pConn->iRequest = pEnd + 4 - pRequest;
+   *(pEnd + 2) = 0;   // Keep the last "\r\n" for ServeHeaderInternal
+
+   // Request line: METHOD SP TARGET SP VERSION
+   pTarget = strchr(pRequest, ' ');
+   if (pTarget)
+   {
+      pTarget++;
+      i = strcspn(pTarget, " \r");
+   }
+   iHead = !strncmp(pRequest, "HEAD ", 5);
+   pConn->iKeepAlive = 1;
+   if (pTarget && pTarget[i] == ' ')
+   {
+      if (!strncmp(pTarget + i + 1, "HTTP/1.0", 8))
+         pConn->iKeepAlive = ServeHeaderInternal(pRequest, "Connection",
+                                                 szValue, LNSZ)
+                             && !strcasecmp(szValue, "keep-alive");
+      else if (ServeHeaderInternal(pRequest, "Connection", szValue, LNSZ))
+         pConn->iKeepAlive = strcasecmp(szValue, "close");
+   }
+
+#ifdef PKGCACHE_VERBOSE
+printf("ServeRequestInternal: %.*s\n", (int)strcspn(pRequest, "\r"), pRequest);
+#endif
+
+   if (!pTarget)
+   {
+      pConn->iKeepAlive = 0;
+      iErr = ServeErrorInternal(pConn, "400 Bad Request", NULL, 0);
+   }
+   else if (strncmp(pRequest, "GET ", 4) && !iHead)
+      iErr = ServeErrorInternal(pConn, "501 Not Implemented", NULL, 0);
+   else if (!ServePathInternal(pTarget, i,     szPath))
+      iErr = ServeErrorInternal(pConn, "404 Not Found", NULL, iHead);
+   else
+   {
+      iFd = openat(giServeDirFd, *szPath ? szPath : ".", O_RDONLY);
+      if (iFd < 0 && errno == ENOENT && *gszServeRepoUrl && *szPath
+          && szPath[strlen(szPath)-1] != '/')
+         iErr = ServeProxyAttachInternal(pConn, szPath, iHead);
+      else if (iFd < 0 || fstat(iFd, &sPathStats))
+         iErr = ServeErrorInternal(pConn, "404 Not Found", NULL, iHead);
+      else if (S_ISDIR(sPathStats.st_mode))
+      {
+         i = strlen(szPath);
+         if (i && szPath[i-1] != '/')
+         {
+            snprintf(szHeaders, LNSZ, "Location: /%s/\r\n", szPath);
+            iErr = ServeErrorInternal(pConn, "301 Moved Permanently",
+                                      szHeaders, iHead);
+         }
+         else
+            iErr = ServeListingInternal(pConn, iFd, szPath, iHead);
+      }
+      else if (!S_ISREG(sPathStats.st_mode))
+         iErr = ServeErrorInternal(pConn, "404 Not Found", NULL, iHead);
+      else
+      {
+         gmtime_r(&(sPathStats.st_mtime), &sTm);
+         strftime(szDate, LNSERVEDATE, "%a, %d %b %Y %H:%M:%S GMT", &sTm);
+         iOffset = 0;
+         iLength = sPathStats.st_size;
+         iRange = 0;
+         if (ServeHeaderInternal(pRequest, "Range", szValue, LNSZ))
+            iRange = ServeRangeInternal(szValue, sPathStats.st_size,
+                                        &iOffset, &iLength);
+         if (iRange < 0)
+         {
+            snprintf(szHeaders, LNSZ, "Content-Range: bytes */%jd\r\n",
+                     (intmax_t)sPathStats.st_size);
+            iErr = ServeErrorInternal(pConn, "416 Range Not Satisfiable",
+                                      szHeaders, iHead);
+         }
+         else
+         {
+            i = snprintf(szHeaders, LNSZ,
+                         "Content-Type: application/octet-stream\r\n"
+                         "Accept-Ranges: bytes\r\n"
+                         "Last-Modified: %s\r\n", szDate);
+            if (iRange)
+               snprintf(szHeaders + i, LNSZ - i,
+                        "Content-Range: bytes %jd-%jd/%jd\r\n",
+                        (intmax_t)iOffset, (intmax_t)(iOffset + iLength - 1),
+                        (intmax_t)sPathStats.st_size);
+            iErr = ServeResponseInternal(pConn,
+                                         iRange ? "206 Partial Content"
+                                                : "200 OK",
+                                         szHeaders, iLength, NULL);
+            if (!iErr && !iHead && iLength)
+            {
+               pConn->iFdFile = iFd;
+               pConn->iOffset = iOffset;
+               pConn->iRemaining = iLength;
+               iFd = -1;
+            }
+         }
+      }
+      if (iFd >= 0)
+         close(iFd);
+   }
+
+   if (pConn->pProxy)
+      pConn->iState = PKGCACHE_SERVE_WAIT;
+   else
+      pConn->iState = PKGCACHE_SERVE_WRITE;
+
+   return(iErr);
+}
+
+
+/*
+ *  ServeSendInternal
+ *
+ *  Send as much of the response as the socket takes.
+ *
+ *  Return: TRUE if the response is completely sent.
+ */
+
+int
+ServeSendInternal(CONN *pConn)
+{
+   int            iBool = 0,
+                  iBlocked = 0,
+                  iDone,
+                  iFdFile,
+                  iProxyErr,
+                  iWaiting = 0;
+   off_t          iLimit,
+                  iSent;
+   ssize_t        iCountW;
+   struct kevent  sEvent;
+
+
+   // Headers and in memory body
+   while (!iBlocked && pConn->iFd >= 0
+          && pConn->iResponseSent < pConn->sResponse.iLength)
+   {
+      iCountW = write(pConn->iFd,
+                      pConn->sResponse.p + pConn->iResponseSent,
+                      pConn->sResponse.iLength - pConn->iResponseSent);
+      if (iCountW > 0)
+         pConn->iResponseSent += iCountW;
+      else if (iCountW < 0 && errno == EAGAIN)
+         iBlocked = 1;
+      else
+         ServeCloseInternal(pConn);
+   }
+
+   // File body, a bounded amount at a time to be fair between clients
+   while (!iBlocked && !iWaiting && pConn->iFd >= 0 && pConn->iRemaining)
+   {
+      iFdFile = pConn->iFdFile;
+      iLimit = pConn->iRemaining;
+      if (pConn->pProxy)
+      {
+         // Only what the proxy thread already wrote
+         pthread_mutex_lock(&gsServeMutex);
+         iFdFile = pConn->pProxy->iFdR;
+         iLimit = pConn->pProxy->iAvailable - pConn->iOffset;
+         iDone = pConn->pProxy->iDone;
+         iProxyErr = pConn->pProxy->iErr;
+         pthread_mutex_unlock(&gsServeMutex);
+
+         if (iProxyErr)
+            ServeCloseInternal(pConn);
+         else if (!iLimit)
+         {
+            if (iDone)
+               pConn->iRemaining = 0;
+            else
+               iWaiting = 1;
+         }
+         else if (pConn->iRemaining > 0 && iLimit > pConn->iRemaining)
+            iLimit = pConn->iRemaining;
+      }
+
+      if (pConn->iFd >= 0 && pConn->iRemaining && !iWaiting)
+      {
+         iSent = 0;
+         if (sendfile(iFdFile, pConn->iFd, pConn->iOffset,
+                      MIN(iLimit, LNSERVESENDFILE), NULL, &iSent, 0) < 0)
+         {
+            if (errno == EAGAIN || errno == EBUSY || errno == EINTR)
+               iBlocked = 1;
+            else
+               ServeCloseInternal(pConn);
+         }
+         else if (!iSent)
+            ServeCloseInternal(pConn);     // The file got shorter
+         pConn->iOffset += iSent;
+         if (pConn->iRemaining > 0)
+            pConn->iRemaining -= iSent;
+         if (!iBlocked && pConn->iRemaining)
+            iBlocked = 1;     // Give the others a chance, then continue
+      }
+   }
+
+   if (pConn->iFd >= 0)
+   {
+      pConn->iActivity = time(NULL);
+      if (iBlocked)
+      {
+         EV_SET(&sEvent, pConn->iFd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0,
+                pConn);
+         kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+      }
+      else if (!iWaiting)     // Else the proxy thread will wake us up
+         iBool = 1;
+   }
+
+   return(iBool);
+}
+
+
+/*
+ *  ServeProcessInternal
+ *
+ *  Serve the pending requests of a connection, one at a time.
+ */
+
+void
+ServeProcessInternal(CONN *pConn)
+{
+   int iLoop = 1;
+
+
+   while (iLoop && pConn->iFd >= 0)
+   {
+      iLoop = 0;
+      if (pConn->iState == PKGCACHE_SERVE_READ)
+      {
+         if (pConn->sRequest.iLength
+             && strstr(pConn->sRequest.p, "\r\n\r\n"))
+         {
+            if (ServeRequestInternal(pConn))
+               ServeCloseInternal(pConn);
+            else
+               iLoop = 1;
+         }
+         else if (pConn->sRequest.iLength >= LNSERVEREQUEST)
+            ServeCloseInternal(pConn);    // Request too large
+      }
+      else if (pConn->iState == PKGCACHE_SERVE_WAIT)
+      {
+         if (ServeProxyHeadersInternal(pConn))
+            ServeCloseInternal(pConn);
+         else
+            iLoop = (pConn->iState == PKGCACHE_SERVE_WRITE);
+      }
+      else if (ServeSendInternal(pConn))
+      {
+         // Done with this response
+         if (pConn->iFdFile >= 0)
+         {
+            close(pConn->iFdFile);
+            pConn->iFdFile = -1;
+         }
+         ServeProxyReleaseInternal(pConn);
+         if (pConn->iKeepAlive)
+         {
+            pConn->sRequest.iLength -= pConn->iRequest;
+            memmove(pConn->sRequest.p, pConn->sRequest.p + pConn->iRequest,
+                    pConn->sRequest.iLength + 1);
+            pConn->iState = PKGCACHE_SERVE_READ;
+            iLoop = 1;
+         }
+         else
+            ServeCloseInternal(pConn);
+      }
+   }
+}
+
+
+/*
+ *  ServeReadInternal
+ */
+
+void
+ServeReadInternal(CONN *pConn)
+{
+   ssize_t iCountR;
+
+
+   if (BufferReserve(&(pConn->sRequest), LNSZ))
+      ServeCloseInternal(pConn);
+   else
+   {
+      iCountR = read(pConn->iFd, pConn->sRequest.p + pConn->sRequest.iLength,
+                     LNSZ);
+      if (iCountR > 0 && pConn->sRequest.iLength + iCountR > LNSERVEREQUEST
+          && pConn->iState != PKGCACHE_SERVE_READ)
+         ServeCloseInternal(pConn);    // Too much pipelining
+      else if (iCountR > 0)
+      {
+         pConn->sRequest.iLength += iCountR;
+         pConn->sRequest.p[pConn->sRequest.iLength] = 0;
+         pConn->iActivity = time(NULL);
+
+         // A response in progress is completed by the write events
+         if (pConn->iState == PKGCACHE_SERVE_READ)
+            ServeProcessInternal(pConn);
+      }
+      else if (!iCountR || errno != EAGAIN)
+         ServeCloseInternal(pConn);
+   }
+}
+
+
+/*
+ *  ServeAcceptInternal
+ */
+
+void
+ServeAcceptInternal(const int iFdListen)
+{
+   int            iFd;
+   CONN           *pConn;
+   struct kevent  sEvent;
+
+
+   while ((iFd = accept(iFdListen, NULL, NULL)) >= 0)
+   {
+      pConn = calloc(1, sizeof(CONN));
+      if (pConn && fcntl(iFd, F_SETFL, O_NONBLOCK) >= 0)
+      {
+         pConn->iFd = iFd;
+         pConn->iFdFile = -1;
+         pConn->iState = PKGCACHE_SERVE_READ;
+         pConn->iActivity = time(NULL);
+         pConn->pNext = gpServeConns;
+         if (gpServeConns)
+            gpServeConns->pPrev = pConn;
+         gpServeConns = pConn;
+
+         EV_SET(&sEvent, iFd, EVFILT_READ, EV_ADD, 0, 0, pConn);
+         if (kevent(giServeKq, &sEvent, 1, NULL, 0, NULL) < 0)
+            ServeCloseInternal(pConn);
+      }
+      else
+      {
+         if (pConn)
+            free(pConn);
+         close(iFd);
+      }
+   }
+}
+
+
+/*
+ *  ServeListenInternal
+ *
+ *  Listen on "[address:]port".
+ *
+ *  Return: the socket, or -1.
+ */
+
+int
+ServeListenInternal(const char *szListen)
+{
+   int               iFd = -1,
+                     iOn = 1;
+   char              *pAddress,
+                     *pPort;
+   FILENAME          szAddress;
+   struct addrinfo   sHints,
+                     *pInfo = NULL;
+
+
+   StrnCopy(szAddress, szListen, LNFILENAME);
+   pPort = strrchr(szAddress, ':');
+   if (pPort)
+   {
+      *pPort = 0;
+      pPort++;
+   }
+   else
+      pPort = szAddress + strlen(szAddress);
+   pAddress = szAddress;
+   if (*pAddress == '[' && pPort - pAddress > 2 && *(pPort - 2) == ']')
+   {
+      // IPv6 address
+      pAddress++;
+      *(pPort - 2) = 0;
+   }
+
+   memset(&sHints, 0, sizeof(sHints));
+   sHints.ai_family = AF_UNSPEC;
+   sHints.ai_socktype = SOCK_STREAM;
+   sHints.ai_flags = AI_PASSIVE;
+   if (*pPort)
+   {
+      // Without an address, listen on all the IPv4 ones
+      if (!*pAddress)
+      {
+         pAddress = NULL;
+         sHints.ai_family = AF_INET;
+      }
+   }
+   else
+   {
+      // Just a port number
+      pPort = pAddress;
+      pAddress = NULL;
+      sHints.ai_family = AF_INET;
+   }
+   if (!getaddrinfo(pAddress, pPort, &sHints, &pInfo))
+   {
+      iFd = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+      if (iFd >= 0)
+      {
+         setsockopt(iFd, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+         if (bind(iFd, pInfo->ai_addr, pInfo->ai_addrlen)
+             || listen(iFd, PKGCACHE_SERVE_BACKLOG)
+             || fcntl(iFd, F_SETFL, O_NONBLOCK) < 0)
+         {
+            close(iFd);
+            iFd = -1;
+         }
+      }
+      freeaddrinfo(pInfo);
+   }
+
+   return(iFd);
+}
+
+
+/*
+ *  ServeRun
+ *
+ *  Serve the packages directory until SIGINT or SIGTERM.  With a
+ *  repository URL, the missing files are proxied from it, and the
+ *  proxied packages are added to the szPkglistFilename list.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+ServeRun(const char *szPkgcachePathname, const char *szListen,
+         const char *szRepoUrl, const char *szNavFilter,
+         const char *szPathFilter, const char *szPkglistFilename)
+{
+   int            i,
+                  iCount,
+                  iErr = 0,
+                  iFdListen = -1,
+                  iStop = 0;
+   time_t         iNow;
+   CONN           *pConn,
+                  *pNext;
+   struct kevent  sEvent,
+                  events[LNSERVEEVENTS];
+
+
+   signal(SIGPIPE, SIG_IGN);
+   signal(SIGINT, SIG_IGN);
+   signal(SIGTERM, SIG_IGN);
+
+   StrnCopy(gszServeDirname, szPkgcachePathname, LNFILENAME);
+   StrnCopy(gszServeRepoUrl, szRepoUrl ? szRepoUrl : "", LNFILENAME);
+   StrnCopy(gszServeNavFilter, szNavFilter ? szNavFilter : "", LNFILENAME);
+   StrnCopy(gszServePathFilter, szPathFilter ? szPathFilter : "", LNFILENAME);
+   StrnCopy(gszServePkglistFilename, szPkglistFilename ? szPkglistFilename : "",
+            LNFILENAME);
+
+   giServeDirFd = open(szPkgcachePathname, O_RDONLY | O_DIRECTORY);
+   if (giServeDirFd < 0)
+      iErr = ERROR_PKGCACHE_ACCESS;
+   if (!iErr)
+   {
+      iFdListen = ServeListenInternal(szListen);
+      if (iFdListen < 0)
+         iErr = ERROR_PKGCACHE_SERVE;
+   }
+   if (!iErr)
+   {
+      giServeKq = kqueue();
+      if (giServeKq < 0)
+         iErr = ERROR_PKGCACHE_SERVE;
+   }
+   if (!iErr)
+   {
+      EV_SET(&sEvent, iFdListen, EVFILT_READ, EV_ADD, 0, 0, NULL);
+      iCount = kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      iCount |= kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+      iCount |= kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, 1, EVFILT_TIMER, EV_ADD, 0, PKGCACHE_SERVE_TIMER, NULL);
+      iCount |= kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+      EV_SET(&sEvent, PKGCACHE_SERVE_USER, EVFILT_USER, EV_ADD | EV_CLEAR, 0,
+             0, NULL);
+      iCount |= kevent(giServeKq, &sEvent, 1, NULL, 0, NULL);
+      if (iCount < 0)
+         iErr = ERROR_PKGCACHE_SERVE;
+   }
+
+   if (!iErr)
+   {
+      printf("Serving %s on %s, interrupt to quit.\n", szPkgcachePathname,
+             szListen);
+      if (*gszServeRepoUrl)
+         printf("Proxying missing files from %s\n", gszServeRepoUrl);
+   }
+   while (!iErr && !iStop)
+   {
+      iCount = kevent(giServeKq, NULL, 0, events, LNSERVEEVENTS, NULL);
+      if (iCount < 0 && errno != EINTR)
+         iErr = ERROR_PKGCACHE_SERVE;
+      for (i = 0 ; i < iCount ; i++)
+      {
+         pConn = events[i].udata;
+         if (events[i].filter == EVFILT_SIGNAL)
+            iStop = 1;
+         else if (events[i].filter == EVFILT_TIMER)
+         {
+            // Close the idle connections
+            iNow = time(NULL);
+            for (pConn = gpServeConns ; pConn ; pConn = pNext)
+            {
+               pNext = pConn->pNext;
+               if (iNow - pConn->iActivity > PKGCACHE_SERVE_IDLE)
+                  ServeCloseInternal(pConn);
+            }
+            ServeProxyEventsInternal();
+         }
+         else if (events[i].filter == EVFILT_USER)
+            ServeProxyEventsInternal();
+         else if (!pConn)
+            ServeAcceptInternal(iFdListen);
+         else if (pConn->iFd < 0)
+            ;  // Closed earlier in this batch
+         else if (events[i].filter == EVFILT_READ)
+         {
+            if (events[i].flags & EV_EOF && !events[i].data)
+               ServeCloseInternal(pConn);
+            else
+               ServeReadInternal(pConn);
+         }
+         else if (events[i].filter == EVFILT_WRITE)
+            ServeProcessInternal(pConn);
+      }
+      ServeFreeDeadInternal();
+   }
+
+   // Done!  Proxy transfers still running are left behind, the
+   // temporary files are hidden and overwritten by the next transfer.
+   while (gpServeConns)
+      ServeCloseInternal(gpServeConns);
+   ServeFreeDeadInternal();
+   if (giServeKq >= 0)
+      close(giServeKq);
+   if (iFdListen >= 0)
+      close(iFdListen);
+   if (giServeDirFd >= 0)
+      close(giServeDirFd);
+   giServeDirFd = -1;
+   giServeKq = -1;
+
+   signal(SIGINT, SIG_DFL);
+   signal(SIGTERM, SIG_DFL);
+
+   return(iErr);
+}
@@ -0,0 +1,399 @@
+/* 
+ * File:    snapshot.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Cache snapshots. Tested under FreeBSD 11.2.
+ *
+ *          A snapshot freezes the packages directory as it is, under
+ *          snapshots/<name>/, for the clients that must stay on a
+ *          known set of packages during a rollout.  The files are hard
+ *          links to the cached ones: a snapshot costs directory entries
+ *          only, and the later downloads replace the cached files
+ *          without touching it.  When a link can't be made, like on
+ *          another file system, the file is copied with
+ *          copy_file_range(2), which clones the blocks where the file
+ *          system supports it.  A snapshot is built under a hidden
+ *          name and renamed once complete, so the server never exposes
+ *          a partial one.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "snapshot.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_SNAPSHOT_TEMP      ".pkgcachetemp"
+
+
+/*
+ *  Types
+ */
+
+typedef struct
+{
+   int         iCopied,
+               iFiles,
+               iLength;
+   const char  *szDst,
+               *szPkgcachePathname;
+} SNAPSHOT;
+
+
+/*
+ *  SnapshotCopyInternal
+ *
+ *  Copy a file that can't be linked into the snapshot.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+SnapshotCopyInternal(const char *szPathname, const char *szDst)
+{
+   int         iErr,
+               iFdR,
+               iFdW = -1;
+   off_t       iCount;
+
+
+   iFdR = open(szPathname, O_RDONLY);
+   if (iFdR < 0)
+      iErr = ERROR_PKGCACHE_FILE_R;
+   else
+   {
+      iFdW = open(szDst, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+      if (iFdW < 0)
+         iErr = ERROR_PKGCACHE_FILE_W;
+      else
+         iErr = CopyFd(iFdR, iFdW,     &iCount);
+   }
+   if (iFdW >= 0)
+   {
+      if (close(iFdW) && !iErr)
+         iErr = ERROR_PKGCACHE_FILE_W;
+      if (iErr)
+         unlink(szDst);
+   }
+   if (iFdR >= 0)
+      close(iFdR);
+
+   return(iErr);
+}
+
+
+/*
+ *  SnapshotCloneInternal
+ *
+ *  Hard link a file of the cache into the snapshot.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+SnapshotCloneInternal(const char *szPathname, const int iPathType,
+                      void *pData)
+{
+   int         iErr = 0;
+   const char  *p;
+   SNAPSHOT    *pSnapshot = pData;
+   FILENAME    sz;
+
+
+   p = szPathname + pSnapshot->iLength;
+
+   // The other snapshots aren't part of this one
+   if (iPathType == PKGCACHE_EXIST_DIR
+       && SnapshotIsDir(pSnapshot->szPkgcachePathname, szPathname))
+      iErr = PKGCACHE_WALK_PRUNE;
+   else if (*p)
+   {
+      if (strlen(pSnapshot->szDst) + strlen(p) < LNFILENAME)
+      {
+         sprintf(sz, "%s%s", pSnapshot->szDst, p);
+         if (iPathType == PKGCACHE_EXIST_DIR)
+         {
+            if (mkdir(sz, 0775))
+               iErr = ERROR_PKGCACHE_FILE_W;
+         }
+         else
+         {
+            pSnapshot->iFiles++;
+            if (link(szPathname, sz))
+            {
+               pSnapshot->iCopied++;
+               iErr = SnapshotCopyInternal(szPathname, sz);
+            }
+         }
+      }
+      else
+         iErr = ERROR_PKGCACHE_MEM;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  SnapshotCreate
+ *
+ *  Freeze the cache under snapshots/<szName>/, or under a name made of
+ *  the date and time if szName is empty.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+SnapshotCreate(const char *szPkgcachePathname, const char *szName)
+{
+   int         iErr = 0;
+   time_t      iTime;
+   FILENAME    sz,
+               szDst,
+               szTemp;
+   SNAPSHOT    sSnapshot;
+
+
+   if (*szName)
+   {
+      // The name is a single path segment, not hidden
+      if (*szName == '.' || strchr(szName, '/'))
+      {
+         printf("ERROR: Invalid snapshot name %s!\n", szName);
+         iErr = ERROR_PKGCACHE_SNAPSHOT;
+      }
+      else
+         StrnCopy(sz, szName, LNFILENAME);
+   }
+   else
+   {
+      iTime = time(NULL);
+      strftime(sz, LNFILENAME, "%Y%m%d-%H%M%S", localtime(&iTime));
+   }
+   if (!iErr)
+   {
+      if (strlen(szPkgcachePathname) + strlen(sz) + 30 >= LNFILENAME)
+         iErr = ERROR_PKGCACHE_MEM;
+      else
+      {
+         sprintf(szDst, "%s" PKGCACHE_SNAPSHOT_DIR "%s", szPkgcachePathname,
+                 sz);
+         sprintf(szTemp, "%s" PKGCACHE_SNAPSHOT_DIR ".%s"
+                 PKGCACHE_SNAPSHOT_TEMP "/", szPkgcachePathname, sz);
+         if (Exist(szDst, PKGCACHE_EXIST_ANY))
+         {
+            printf("ERROR: Snapshot %s already exists!\n", sz);
+            iErr = ERROR_PKGCACHE_SNAPSHOT;
+         }
+      }
+   }
+   if (!iErr)
+   {
+      // Left behind by an interrupted snapshot
+      iErr = DirRemove(szTemp);
+      if (!iErr)
+         iErr = MakePath(szTemp);
+   }
+   if (!iErr)
+   {
+      memset(&sSnapshot, 0, sizeof(sSnapshot));
+      sSnapshot.iLength = strlen(szPkgcachePathname);
+      sSnapshot.szDst = szTemp;
+      sSnapshot.szPkgcachePathname = szPkgcachePathname;
+      iErr = DirWalk(szPkgcachePathname, SnapshotCloneInternal, &sSnapshot);
+      if (!iErr && rename(szTemp, szDst))
+         iErr = ERROR_PKGCACHE_FILE_W;
+      if (iErr)
+         DirRemove(szTemp);
+      else
+      {
+         printf("Snapshot %s created: %d file(s)", sz, sSnapshot.iFiles);
+         if (sSnapshot.iCopied)
+            printf(", %d copied", sSnapshot.iCopied);
+         printf(".\n");
+      }
+   }
+
+#ifdef PKGCACHE_VERBOSE
+printf("SnapshotCreate(%s, %s): iErr=%d\n", szPkgcachePathname, szName, iErr);
+#endif
+
+   return(iErr);
+}
+
+
+/*
+ *  SnapshotExpire
+ *
+ *  Remove the snapshots older than iDays days.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+SnapshotExpire(const char *szPkgcachePathname, const int iDays)
+{
+   int            iErr = 0;
+   time_t         iTime;
+   DIR            *pDir;
+   FILENAME       sz;
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   iTime = time(NULL) - (time_t)iDays * 86400;
+   if (strlen(szPkgcachePathname) + 20 >= LNFILENAME)
+      iErr = ERROR_PKGCACHE_MEM;
+   else
+   {
+      sprintf(sz, "%s" PKGCACHE_SNAPSHOT_DIR, szPkgcachePathname);
+      pDir = opendir(sz);
+      if (pDir)
+      {
+         while (!iErr && (pEntry = readdir(pDir)))
+         {
+            if (*(pEntry->d_name) != '.')
+            {
+               if (strlen(szPkgcachePathname) + strlen(pEntry->d_name) + 20
+                   >= LNFILENAME)
+                  iErr = ERROR_PKGCACHE_MEM;
+               else
+               {
+                  sprintf(sz, "%s" PKGCACHE_SNAPSHOT_DIR "%s",
+                          szPkgcachePathname, pEntry->d_name);
+                  if (!lstat(sz, &sPathStats) && S_ISDIR(sPathStats.st_mode)
+                      && sPathStats.st_mtime < iTime)
+                  {
+                     iErr = DirRemove(sz);
+                     if (!iErr)
+                        printf("Snapshot %s expired.\n", pEntry->d_name);
+                  }
+               }
+            }
+         }
+         closedir(pDir);
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  SnapshotIsDir
+ *
+ *  Return: TRUE if szPathname is the snapshots directory, which the
+ *          walks through the cache skip.
+ */
+
+int
+SnapshotIsDir(const char *szPkgcachePathname, const char *szPathname)
+{
+   int   i;
+
+
+   i = strlen(szPkgcachePathname);
+
+   return(!strncmp(szPathname, szPkgcachePathname, i)
+          && !strcmp(szPathname + i, PKGCACHE_SNAPSHOT_DIR));
+}
+
+
+/*
+ *  SnapshotList
+ *
+ *  Print the snapshots, sorted by name.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+SnapshotList(const char *szPkgcachePathname)
+{
+   int            i,
+                  iErr = 0;
+   DIR            *pDir;
+   FILENAME       sz;
+   STRSET         sNames = {0, 0, NULL};
+   struct dirent  *pEntry;
+   struct stat    sPathStats;
+
+
+   if (strlen(szPkgcachePathname) + 20 >= LNFILENAME)
+      iErr = ERROR_PKGCACHE_MEM;
+   else
+   {
+      sprintf(sz, "%s" PKGCACHE_SNAPSHOT_DIR, szPkgcachePathname);
+      pDir = opendir(sz);
+      if (pDir)
+      {
+         while (!iErr && (pEntry = readdir(pDir)))
+         {
+            if (*(pEntry->d_name) != '.')
+               iErr = StrSetAdd(&sNames, pEntry->d_name);
+         }
+         closedir(pDir);
+      }
+   }
+
+   if (!iErr)
+   {
+      if (sNames.iCount)
+         printf("Snapshots:\n");
+      else
+         printf("No snapshot.\n");
+   }
+   for (i = 0 ; !iErr && i < sNames.iCount ; i++)
+   {
+      if (strlen(szPkgcachePathname) + strlen(sNames.ppStr[i]) + 20
+          >= LNFILENAME)
+         iErr = ERROR_PKGCACHE_MEM;
+      else
+      {
+         sprintf(sz, "%s" PKGCACHE_SNAPSHOT_DIR "%s", szPkgcachePathname,
+                 sNames.ppStr[i]);
+         if (!stat(sz, &sPathStats))
+         {
+            strftime(sz, LNFILENAME, "%Y-%m-%d %H:%M",
+                     localtime(&(sPathStats.st_mtime)));
+            printf("  %-30s %s\n", sNames.ppStr[i], sz);
+         }
+      }
+   }
+   StrSetClear(&sNames);
+
+   return(iErr);
+}
@@ -0,0 +1,50 @@
+/* 
+ * File:    snapshot.h
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Cache snapshots header file. Tested under FreeBSD 11.2.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef PKGCACHE_SNAPSHOT_H
+#define PKGCACHE_SNAPSHOT_H
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_SNAPSHOT_DIR       "snapshots/"
+
+
+/*
+ *  Prototypes
+ */
+
+int  SnapshotCreate(const char *szPkgcachePathname, const char *szName);
+int  SnapshotExpire(const char *szPkgcachePathname, const int iDays);
+int  SnapshotIsDir(const char *szPkgcachePathname, const char *szPathname);
+int  SnapshotList(const char *szPkgcachePathname);
+
+
+#endif  // PKGCACHE_SNAPSHOT_H
@@ -0,0 +1,245 @@
+/* 
+ * File:    throttle.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Download concurrency and rate control. Tested under
+ *          FreeBSD 11.2.
+ *
+ *          A run talks to a single host, the repository of the
+ *          package list.  The number of jobs allowed to transfer at
+ *          once, the window, follows AIMD: after a window's worth of
+ *          transfers, it grows by one while the throughput grows, and
+ *          it's halved on errors or when the time to first byte
+ *          inflates, a sign that the server or the link is queueing.
+ *          The -jobs option is the hard cap.
+ *          The optional global rate limit is a token bucket holding up
+ *          to a second of bytes.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "throttle.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_THROTTLE_GAIN      105      // % of the last throughput
+#define PKGCACHE_THROTTLE_LATENCY   4        // Times the best TTFB...
+#define PKGCACHE_THROTTLE_SLACK     100000   // ...plus 100 ms, in us
+#define PKGCACHE_THROTTLE_START     4
+
+
+/*
+ *  Object variables
+ */
+
+int               giThrottleCap = 1,
+                  giThrottleCount = 0,
+                  giThrottleErrors = 0,
+                  giThrottleWindow = 1;
+int64_t           giThrottleBytes = 0,
+                  giThrottleEpoch = 0,
+                  giThrottleLastRate = 0,
+                  giThrottleRate = 0,       // Bytes per second, 0 if none
+                  giThrottleRefill = 0,
+                  giThrottleTokens = 0,
+                  giThrottleTtfbMin = 0,
+                  giThrottleTtfbSum = 0;
+pthread_mutex_t   gsThrottleMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ *  ThrottleClock
+ *
+ *  Return: Monotonic time in microseconds
+ */
+
+int64_t
+ThrottleClock(void)
+{
+   struct timespec   sNow;
+
+
+   clock_gettime(CLOCK_MONOTONIC, &sNow);
+
+   return((int64_t)sNow.tv_sec * 1000000 + sNow.tv_nsec / 1000);
+}
+
+
+/*
+ *  ThrottleInit
+ *
+ *  Start a run with at most iCap jobs and iRate bytes per second.
+ */
+
+void
+ThrottleInit(const int iCap, const int64_t iRate)
+{
+   pthread_mutex_lock(&gsThrottleMutex);
+   giThrottleCap = (iCap > 0) ? iCap : 1;
+   giThrottleWindow = (giThrottleCap < PKGCACHE_THROTTLE_START)
+                      ? giThrottleCap : PKGCACHE_THROTTLE_START;
+   giThrottleCount = 0;
+   giThrottleErrors = 0;
+   giThrottleBytes = 0;
+   giThrottleLastRate = 0;
+   giThrottleTtfbMin = 0;
+   giThrottleTtfbSum = 0;
+   giThrottleEpoch = ThrottleClock();
+   giThrottleRate = (iRate > 0) ? iRate : 0;
+   giThrottleRefill = giThrottleEpoch;
+   giThrottleTokens = giThrottleRate;
+   pthread_mutex_unlock(&gsThrottleMutex);
+}
+
+
+/*
+ *  ThrottleReport
+ *
+ *  Account for a finished transfer, the times are in microseconds.
+ */
+
+void
+ThrottleReport(const int64_t iTtfb, const int64_t iBytes,
+               const int iErr)
+{
+   int      iOk;
+   int64_t  i,
+            iNow;
+
+
+   pthread_mutex_lock(&gsThrottleMutex);
+   giThrottleCount++;
+   giThrottleBytes += iBytes;
+   if (iErr)
+      giThrottleErrors++;
+   else
+   {
+      giThrottleTtfbSum += iTtfb;
+      if (!giThrottleTtfbMin || iTtfb < giThrottleTtfbMin)
+         giThrottleTtfbMin = iTtfb;
+   }
+
+   // One adjustment per window's worth of transfers
+   if (giThrottleCount >= giThrottleWindow)
+   {
+      iNow = ThrottleClock();
+      i = iNow - giThrottleEpoch;
+      i = i ? giThrottleBytes * 1000000 / i : 0;
+      iOk = giThrottleCount - giThrottleErrors;
+      if (giThrottleErrors
+          || (iOk && giThrottleTtfbSum / iOk
+                     > giThrottleTtfbMin * PKGCACHE_THROTTLE_LATENCY
+                       + PKGCACHE_THROTTLE_SLACK))
+      {
+         giThrottleWindow /= 2;
+         if (!giThrottleWindow)
+            giThrottleWindow = 1;
+      }
+      else if (i * 100 >= giThrottleLastRate * PKGCACHE_THROTTLE_GAIN
+               && giThrottleWindow < giThrottleCap)
+         giThrottleWindow++;
+
+#ifdef PKGCACHE_VERBOSE
+printf("ThrottleReport: %lld B/s, %d errors, window=%d\n", (long long)i,
+       giThrottleErrors, giThrottleWindow);
+#endif
+
+      giThrottleLastRate = i;
+      giThrottleCount = 0;
+      giThrottleErrors = 0;
+      giThrottleBytes = 0;
+      giThrottleTtfbSum = 0;
+      giThrottleEpoch = iNow;
+   }
+   pthread_mutex_unlock(&gsThrottleMutex);
+}
+
+
+/*
+ *  ThrottleTake
+ *
+ *  Take l bytes from the token bucket, waiting for them if needed.
+ */
+
+void
+ThrottleTake(const size_t l)
+{
+   int64_t           i,
+                     iWait = 0;
+   struct timespec   sWait;
+
+
+   pthread_mutex_lock(&gsThrottleMutex);
+   if (giThrottleRate)
+   {
+      // The bucket holds up to a second of bytes
+      i = ThrottleClock();
+      if (i - giThrottleRefill < 1000000)
+         giThrottleTokens += (i - giThrottleRefill) * giThrottleRate / 1000000;
+      else
+         giThrottleTokens += giThrottleRate;
+      if (giThrottleTokens > giThrottleRate)
+         giThrottleTokens = giThrottleRate;
+      giThrottleRefill = i;
+
+      // Taken on credit, the debt is slept off
+      giThrottleTokens -= l;
+      if (giThrottleTokens < 0)
+         iWait = -giThrottleTokens * 1000000 / giThrottleRate;
+   }
+   pthread_mutex_unlock(&gsThrottleMutex);
+
+   if (iWait)
+   {
+      sWait.tv_sec = iWait / 1000000;
+      sWait.tv_nsec = (iWait % 1000000) * 1000;
+      nanosleep(&sWait, NULL);
+   }
+}
+
+
+/*
+ *  ThrottleWindow
+ *
+ *  Return: The number of jobs allowed to transfer at once
+ */
+
+int
+ThrottleWindow(void)
+{
+   int   i;
+
+
+   pthread_mutex_lock(&gsThrottleMutex);
+   i = giThrottleWindow;
+   pthread_mutex_unlock(&gsThrottleMutex);
+
+   return(i);
+}
@@ -0,0 +1,420 @@
+/* 
+ * File:    verify.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Cache verification. Tested under FreeBSD 11.2.
+ *
+ *          Every repository directory of the cache holding a
+ *          'packagesite.txz' catalog is checked against it: each
+ *          package file must have the catalog's "pkgsize" and its
+ *          SHA-256 must be the catalog's "sum".  The files are mapped
+ *          in memory and hashed by one thread per CPU.  Reported are:
+ *            Corrupted : Wrong size or checksum.
+ *            Missing   : A package of the list is absent.
+ *            Orphaned  : A package file the catalog doesn't describe.
+ *          With the -requeue option, the corrupted files are deleted
+ *          and their package name added to the list, so that the next
+ *          DOWNLOAD, or the PROXY, fetches them again.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "common.h"
+#include "list.h"
+#include "snapshot.h"
+#include "verify.h"
+
+
+/*
+ *  Constants
+ */
+
+#define LNVERIFYSUM                 LNSHA256SUM
+#define PKGCACHE_VERIFY_JOBS_MAX    64
+
+#define PKGCACHE_VERIFY_OK          0
+#define PKGCACHE_VERIFY_CORRUPTED   1
+#define PKGCACHE_VERIFY_MISSING     2
+#define PKGCACHE_VERIFY_UNWANTED    3     // Absent, but not on the list
+
+
+/*
+ *  Types
+ */
+
+typedef struct
+{
+   int      iResult;
+   char     *szPathname,
+            szSum[LNVERIFYSUM];
+   off_t    iSize;
+} VERIFYFILE;
+
+typedef struct
+{
+   int         iCount,
+               iNext,
+               iRequeue,
+               iSize,
+               iStatCorrupted,
+               iStatMissing,
+               iStatOk,
+               iStatOrphaned;
+   const char  *szDir,
+               *szPkgcachePathname;
+   VERIFYFILE  *pFiles;
+   STRSET      sPathnames;       // Described by the current catalog
+} VERIFY;
+
+
+/*
+ *  Object variables
+ */
+
+pthread_mutex_t   gsVerifyMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ *  VerifyFileInternal
+ *
+ *  Return: PKGCACHE_VERIFY_xyz
+ */
+
+int
+VerifyFileInternal(const VERIFYFILE *pFile)
+{
+   int            iFd,
+                  iResult = PKGCACHE_VERIFY_OK;
+   char           *szName,
+                  szSum[LNVERIFYSUM];
+   unsigned char  *p = MAP_FAILED;
+   SHA256SUM      sSum;
+   struct stat    sStats;
+
+
+   iFd = open(pFile->szPathname, O_RDONLY);
+   if (iFd < 0 || fstat(iFd, &sStats))
+   {
+      szName = strrchr(pFile->szPathname, '/') + 1;
+      if (iFd < 0 && (IsDownloadAlways(szName) || ListIsFound(szName)))
+         iResult = PKGCACHE_VERIFY_MISSING;
+      else
+         iResult = PKGCACHE_VERIFY_UNWANTED;
+   }
+   else if (pFile->iSize >= 0 && sStats.st_size != pFile->iSize)
+      iResult = PKGCACHE_VERIFY_CORRUPTED;
+   else if (*(pFile->szSum))
+   {
+      if (Sha256Init(&sSum))
+         iResult = PKGCACHE_VERIFY_CORRUPTED;
+      else if (sStats.st_size)
+      {
+         p = mmap(NULL, sStats.st_size, PROT_READ, MAP_SHARED, iFd, 0);
+         if (p == MAP_FAILED)
+            iResult = PKGCACHE_VERIFY_CORRUPTED;
+         else
+         {
+            madvise(p, sStats.st_size, MADV_SEQUENTIAL);
+            if (Sha256Update(&sSum, p, sStats.st_size))
+               iResult = PKGCACHE_VERIFY_CORRUPTED;
+            munmap(p, sStats.st_size);
+         }
+      }
+      if (Sha256Final(&sSum,     szSum) || strcasecmp(szSum, pFile->szSum))
+         iResult = PKGCACHE_VERIFY_CORRUPTED;
+   }
+
+   if (iFd >= 0)
+      close(iFd);
+
+   return(iResult);
+}
+
+
+/*
+ *  VerifyWorkerInternal
+ *
+ *  Check the files of the catalog until none is left.
+ */
+
+void *
+VerifyWorkerInternal(void *pData)
+{
+   int      i;
+   VERIFY   *pVerify = pData;
+
+
+   do
+   {
+      pthread_mutex_lock(&gsVerifyMutex);
+      i = pVerify->iNext;
+      pVerify->iNext++;
+      pthread_mutex_unlock(&gsVerifyMutex);
+
+      if (i < pVerify->iCount)
+         pVerify->pFiles[i].iResult = VerifyFileInternal(pVerify->pFiles + i);
+   }
+   while (i < pVerify->iCount) ;
+
+   return(NULL);
+}
+
+
+/*
+ *  VerifySiteInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+VerifySiteInternal(char *pLine, const int iLength, void *pData)
+{
+   int         iErr = 0;
+   char        szValue[LNSZ];
+   VERIFY      *pVerify = pData;
+   VERIFYFILE  *pFile;
+
+
+   if (CatalogGetValue(pLine, "repopath", szValue, LNSZ)
+       && *szValue != '/' && !strstr(szValue, "..")
+       && strlen(pVerify->szDir) + strlen(szValue) < LNFILENAME)
+   {
+      if (pVerify->iCount == pVerify->iSize)
+      {
+         pFile = realloc(pVerify->pFiles, sizeof(VERIFYFILE)
+                         * (pVerify->iSize ? pVerify->iSize * 2 : LNSZ));
+         if (pFile)
+         {
+            pVerify->pFiles = pFile;
+            pVerify->iSize = pVerify->iSize ? pVerify->iSize * 2 : LNSZ;
+         }
+         else
+            iErr = ERROR_PKGCACHE_MEM;
+      }
+      if (!iErr)
+      {
+         pFile = pVerify->pFiles + pVerify->iCount;
+         pFile->szPathname = malloc(strlen(pVerify->szDir)
+                                    + strlen(szValue) + 1);
+         if (pFile->szPathname)
+         {
+            sprintf(pFile->szPathname, "%s%s", pVerify->szDir, szValue);
+            iErr = StrSetAdd(&(pVerify->sPathnames), pFile->szPathname);
+            pVerify->iCount++;
+         }
+         else
+            iErr = ERROR_PKGCACHE_MEM;
+      }
+      if (!iErr)
+      {
+         CatalogGetValue(pLine, "sum", pFile->szSum, LNVERIFYSUM);
+         if (CatalogGetValue(pLine, "pkgsize", szValue, LNSZ))
+            pFile->iSize = strtoll(szValue, NULL, 10);
+         else
+            pFile->iSize = -1;
+         pFile->iResult = PKGCACHE_VERIFY_OK;
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  VerifyOrphanInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+VerifyOrphanInternal(const char *szPathname, const int iPathType,
+                     void *pData)
+{
+   int         i,
+               iErr = 0;
+   const char  *p;
+   VERIFY      *pVerify = pData;
+
+
+   i = strlen(szPathname);
+   p = strrchr(szPathname, '/');
+   if (iPathType == PKGCACHE_EXIST_DIR
+       && SnapshotIsDir(pVerify->szPkgcachePathname, szPathname))
+      iErr = PKGCACHE_WALK_PRUNE;
+   else if (iPathType == PKGCACHE_EXIST_FILE && i > 4
+       && !strcasecmp(szPathname + i - 4, ".txz")
+       && !IsDownloadAlways(p ? p + 1 : szPathname)
+       && !StrSetIsFound(&(pVerify->sPathnames), szPathname))
+   {
+      printf("  Orphaned: %s\n", szPathname);
+      pVerify->iStatOrphaned++;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  VerifyCatalogInternal
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+VerifyCatalogInternal(const char *szPathname, const int iPathType,
+                      void *pData)
+{
+   int         i,
+               iErr = 0,
+               iJobs,
+               iThreads = 0;
+   FILENAME    szArchive;
+   pthread_t   sThreads[PKGCACHE_VERIFY_JOBS_MAX];
+   VERIFY      *pVerify = pData;
+   VERIFYFILE  *pFile;
+
+
+   // The snapshots are hard links to the verified files
+   if (iPathType == PKGCACHE_EXIST_DIR
+       && SnapshotIsDir(pVerify->szPkgcachePathname, szPathname))
+      iErr = PKGCACHE_WALK_PRUNE;
+   else if (iPathType == PKGCACHE_EXIST_DIR
+            && strlen(szPathname) + strlen(PKGCACHE_CATALOG_SITE)
+               < LNFILENAME)
+   {
+      sprintf(szArchive, "%s%s", szPathname, PKGCACHE_CATALOG_SITE);
+      if (Exist(szArchive, PKGCACHE_EXIST_FILE))
+      {
+         pVerify->szDir = szPathname;
+         pVerify->iCount = 0;
+         pVerify->iNext = 0;
+         iErr = CatalogRead(szArchive, VerifySiteInternal, pVerify);
+         if (iErr == ERROR_PKGCACHE_FILE_R)
+         {
+            printf("WARNING: Skipping %s, unknown catalog format!\n",
+                   szArchive);
+            iErr = 0;
+         }
+         else if (!iErr)
+         {
+            printf("Verifying %s\n", szPathname);
+
+            // Hash the files...
+            iJobs = sysconf(_SC_NPROCESSORS_ONLN);
+            for (i = 1 ; i < iJobs && i < PKGCACHE_VERIFY_JOBS_MAX ; i++)
+            {
+               if (!pthread_create(sThreads + iThreads, NULL,
+                                   VerifyWorkerInternal, pVerify))
+                  iThreads++;
+            }
+            VerifyWorkerInternal(pVerify);
+            for (i = 0 ; i < iThreads ; i++)
+               pthread_join(sThreads[i], NULL);
+
+            // ...then report.
+            for (i = 0 ; !iErr && i < pVerify->iCount ; i++)
+            {
+               pFile = pVerify->pFiles + i;
+               switch (pFile->iResult)
+               {
+                  case PKGCACHE_VERIFY_OK:
+                     pVerify->iStatOk++;
+                     break;
+
+                  case PKGCACHE_VERIFY_CORRUPTED:
+                     printf("  Corrupted: %s\n", pFile->szPathname);
+                     pVerify->iStatCorrupted++;
+                     if (pVerify->iRequeue)
+                     {
+                        remove(pFile->szPathname);
+                        iErr = ListAdd(strrchr(pFile->szPathname, '/') + 1);
+                     }
+                     break;
+
+                  case PKGCACHE_VERIFY_MISSING:
+                     printf("  Missing: %s\n", pFile->szPathname);
+                     pVerify->iStatMissing++;
+                     break;
+               }
+            }
+
+            if (!iErr)
+               iErr = DirWalk(szPathname, VerifyOrphanInternal, pVerify);
+         }
+
+         for (i = 0 ; i < pVerify->iCount ; i++)
+            free(pVerify->pFiles[i].szPathname);
+         StrSetClear(&(pVerify->sPathnames));
+      }
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  VerifyAll
+ *
+ *  Verify every repository directory of the cache, and requeue the
+ *  corrupted files if iRequeue.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+VerifyAll(const char *szPkgcachePathname, const int iRequeue)
+{
+   int      iErr;
+   VERIFY   sVerify;
+
+
+   memset(&sVerify, 0, sizeof(sVerify));
+   sVerify.iRequeue = iRequeue;
+   sVerify.szPkgcachePathname = szPkgcachePathname;
+   iErr = DirWalk(szPkgcachePathname, VerifyCatalogInternal, &sVerify);
+   if (sVerify.pFiles)
+      free(sVerify.pFiles);
+
+   if (!iErr)
+   {
+      printf("Verify: %d file(s) OK, %d corrupted", sVerify.iStatOk,
+             sVerify.iStatCorrupted);
+      if (iRequeue && sVerify.iStatCorrupted)
+         printf(" (requeued)");
+      printf(", %d missing, %d orphaned.\n", sVerify.iStatMissing,
+             sVerify.iStatOrphaned);
+      if (sVerify.iStatCorrupted || sVerify.iStatMissing)
+         iErr = ERROR_PKGCACHE_VERIFY;
+   }
+
+   return(iErr);
+}
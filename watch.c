@@ -0,0 +1,362 @@
+/* 
+ * File:    watch.c
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Transfer watchdog. Tested under FreeBSD 11.2.
+ *
+ *          A transfer registers its thread in a slot while it runs.
+ *          Once a second, the watchdog thread checks the slots:
+ *            - Until the response arrives, the request is given the
+ *              first byte timeout (-firstbyte).
+ *            - Then, the throughput over each stall window must stay
+ *              above the low speed limit (-stall <bytes/s>:<sec.>).
+ *          A transfer over its limits is aborted: its thread is sent
+ *          SIGUSR1, and since fetchRestartCalls is cleared, the fetch
+ *          system call in progress fails instead of being restarted.
+ *          The signal is sent again every second until the transfer
+ *          gives up, in case it was between system calls.  The
+ *          connect and read timeouts stay with fetch, see -timeout.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fetch.h>
+
+#include "common.h"
+#include "throttle.h"
+#include "watch.h"
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_WATCH_SLOTS        65    // The download jobs, plus one
+
+#define PKGCACHE_WATCH_IDLE         0
+#define PKGCACHE_WATCH_REQUEST      1
+#define PKGCACHE_WATCH_BODY         2
+
+
+/*
+ *  Types
+ */
+
+typedef struct
+{
+   int         iAborted,
+               iPhase;
+   int64_t     iBytes,
+               iThrottled,       // Held back since, in us, or 0
+               iWindowBytes,
+               iWindowStart;     // Or the request start, in us
+   pthread_t   sThread;
+} SLOT;
+
+
+/*
+ *  Object variables
+ */
+
+int               giWatchAttempts = PKGCACHE_WATCH_ATTEMPTS,
+                  giWatchFirstByte = PKGCACHE_WATCH_FIRSTBYTE,
+                  giWatchQuit = 0,
+                  giWatchRunning = 0,
+                  giWatchStallSpeed = PKGCACHE_WATCH_STALLSPEED,
+                  giWatchStallTime = PKGCACHE_WATCH_STALLTIME;
+pthread_mutex_t   gsWatchMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t         gsWatchThread;
+SLOT              gsWatchSlots[PKGCACHE_WATCH_SLOTS];
+
+
+/*
+ *  WatchSignalInternal
+ *
+ *  Nothing to do, the point is to interrupt the system call.
+ */
+
+void
+WatchSignalInternal(int iSignal)
+{
+   (void)iSignal;
+}
+
+
+/*
+ *  WatchThreadInternal
+ */
+
+void *
+WatchThreadInternal(void *pData)
+{
+   int      i;
+   int64_t  iNow;
+   SLOT     *pSlot;
+
+
+   pthread_mutex_lock(&gsWatchMutex);
+   while (!giWatchQuit)
+   {
+      pthread_mutex_unlock(&gsWatchMutex);
+      sleep(1);
+      pthread_mutex_lock(&gsWatchMutex);
+
+      iNow = ThrottleClock();
+      for (i = 0 ; i < PKGCACHE_WATCH_SLOTS ; i++)
+      {
+         pSlot = gsWatchSlots + i;
+         if (pSlot->iPhase == PKGCACHE_WATCH_REQUEST && giWatchFirstByte
+             && iNow - pSlot->iWindowStart
+                > (int64_t)giWatchFirstByte * 1000000)
+            pSlot->iAborted = 1;
+         else if (pSlot->iPhase == PKGCACHE_WATCH_BODY && giWatchStallSpeed
+                  && !(pSlot->iThrottled)
+                  && iNow - pSlot->iWindowStart
+                     >= (int64_t)giWatchStallTime * 1000000)
+         {
+            if ((pSlot->iBytes - pSlot->iWindowBytes) * 1000000
+                < (int64_t)giWatchStallSpeed * (iNow - pSlot->iWindowStart))
+               pSlot->iAborted = 1;
+            else
+            {
+               pSlot->iWindowBytes = pSlot->iBytes;
+               pSlot->iWindowStart = iNow;
+            }
+         }
+
+         if (pSlot->iPhase != PKGCACHE_WATCH_IDLE && pSlot->iAborted)
+            pthread_kill(pSlot->sThread, SIGUSR1);
+      }
+   }
+   pthread_mutex_unlock(&gsWatchMutex);
+
+   return(NULL);
+}
+
+
+/*
+ *  WatchAttempts
+ *
+ *  Return: The number of attempts of a transfer
+ */
+
+int
+WatchAttempts(void)
+{
+   return(giWatchAttempts);
+}
+
+
+/*
+ *  WatchBegin
+ *
+ *  Register the calling thread's transfer, its request is sent.
+ *
+ *  Return: The slot, -1 if none is left
+ */
+
+int
+WatchBegin(void)
+{
+   int   i,
+         iSlot = -1;
+
+
+   pthread_mutex_lock(&gsWatchMutex);
+   for (i = 0 ; iSlot < 0 && i < PKGCACHE_WATCH_SLOTS ; i++)
+   {
+      if (gsWatchSlots[i].iPhase == PKGCACHE_WATCH_IDLE)
+      {
+         iSlot = i;
+         gsWatchSlots[i].iAborted = 0;
+         gsWatchSlots[i].iBytes = 0;
+         gsWatchSlots[i].iThrottled = 0;
+         gsWatchSlots[i].iWindowBytes = 0;
+         gsWatchSlots[i].iWindowStart = ThrottleClock();
+         gsWatchSlots[i].iPhase = PKGCACHE_WATCH_REQUEST;
+         gsWatchSlots[i].sThread = pthread_self();
+      }
+   }
+   pthread_mutex_unlock(&gsWatchMutex);
+
+   return(iSlot);
+}
+
+
+/*
+ *  WatchBytes
+ *
+ *  Account for l bytes received.
+ */
+
+void
+WatchBytes(const int iSlot, const size_t l)
+{
+   if (iSlot >= 0)
+   {
+      pthread_mutex_lock(&gsWatchMutex);
+      gsWatchSlots[iSlot].iBytes += l;
+      pthread_mutex_unlock(&gsWatchMutex);
+   }
+}
+
+
+/*
+ *  WatchEnd
+ *
+ *  Release the slot.
+ *
+ *  Return: TRUE if the transfer was aborted
+ */
+
+int
+WatchEnd(const int iSlot)
+{
+   int   iAborted = 0;
+
+
+   if (iSlot >= 0)
+   {
+      pthread_mutex_lock(&gsWatchMutex);
+      iAborted = gsWatchSlots[iSlot].iAborted;
+      gsWatchSlots[iSlot].iPhase = PKGCACHE_WATCH_IDLE;
+      pthread_mutex_unlock(&gsWatchMutex);
+   }
+
+   return(iAborted);
+}
+
+
+/*
+ *  WatchFirstByte
+ *
+ *  The response arrived, the low speed limit applies from now on.
+ */
+
+void
+WatchFirstByte(const int iSlot)
+{
+   if (iSlot >= 0)
+   {
+      pthread_mutex_lock(&gsWatchMutex);
+      gsWatchSlots[iSlot].iWindowStart = ThrottleClock();
+      gsWatchSlots[iSlot].iPhase = PKGCACHE_WATCH_BODY;
+      pthread_mutex_unlock(&gsWatchMutex);
+   }
+}
+
+
+/*
+ *  WatchInit
+ *
+ *  Start the watchdog with the limits of the run, in seconds and bytes
+ *  per second, 0 for none.
+ *
+ *  Return: ERROR_PKGCACHE_xyz
+ */
+
+int
+WatchInit(const int iFirstByte, const int iStallSpeed, const int iStallTime,
+          const int iAttempts)
+{
+   int               iErr = 0;
+   struct sigaction  sAction;
+
+
+   giWatchAttempts = (iAttempts > 0) ? iAttempts : 1;
+   giWatchFirstByte = iFirstByte;
+   giWatchStallSpeed = iStallSpeed;
+   giWatchStallTime = (iStallTime > 0) ? iStallTime : 1;
+
+   if (!giWatchRunning)
+   {
+      // No SA_RESTART, the interrupted system call must fail
+      memset(&sAction, 0, sizeof(sAction));
+      sAction.sa_handler = WatchSignalInternal;
+      sigemptyset(&(sAction.sa_mask));
+      sigaction(SIGUSR1, &sAction, NULL);
+      fetchRestartCalls = 0;
+
+      giWatchQuit = 0;
+      if (pthread_create(&gsWatchThread, NULL, WatchThreadInternal, NULL))
+         iErr = ERROR_PKGCACHE_MEM;
+      else
+         giWatchRunning = 1;
+   }
+
+   return(iErr);
+}
+
+
+/*
+ *  WatchQuit
+ */
+
+void
+WatchQuit(void)
+{
+   if (giWatchRunning)
+   {
+      pthread_mutex_lock(&gsWatchMutex);
+      giWatchQuit = 1;
+      pthread_mutex_unlock(&gsWatchMutex);
+      pthread_join(gsWatchThread, NULL);
+      giWatchRunning = 0;
+   }
+}
+
+
+/*
+ *  WatchThrottle
+ *
+ *  The transfer is held back by the -bandwidth limit, or not anymore.
+ *  The time held back is left out of the low speed window, so that a
+ *  rate limit below the low speed limit doesn't abort every transfer.
+ */
+
+void
+WatchThrottle(const int iSlot, const int iThrottled)
+{
+   int64_t  iNow;
+
+
+   if (iSlot >= 0)
+   {
+      iNow = ThrottleClock();
+      pthread_mutex_lock(&gsWatchMutex);
+      if (iThrottled)
+         gsWatchSlots[iSlot].iThrottled = iNow;
+      else if (gsWatchSlots[iSlot].iThrottled)
+      {
+         gsWatchSlots[iSlot].iWindowStart += iNow
+                                             - gsWatchSlots[iSlot].iThrottled;
+         gsWatchSlots[iSlot].iThrottled = 0;
+      }
+      pthread_mutex_unlock(&gsWatchMutex);
+   }
+}
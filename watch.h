@@ -0,0 +1,58 @@
+/* 
+ * File:    watch.h
+ * 
+ * Author:  fossette
+ * 
+ * Date:    2019/02/04
+ *
+ * Version: 1.1
+ * 
+ * Descr:   Transfer watchdog header file. Tested under FreeBSD 11.2.
+ *
+ * Web:     https://github.com/fossette/pkgcache/wiki
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef PKGCACHE_WATCH_H
+#define PKGCACHE_WATCH_H
+
+
+/*
+ *  Constants
+ */
+
+#define PKGCACHE_WATCH_ATTEMPTS     3
+#define PKGCACHE_WATCH_FIRSTBYTE    60    // Seconds
+#define PKGCACHE_WATCH_STALLSPEED   1024  // Bytes per second...
+#define PKGCACHE_WATCH_STALLTIME    30    // ...over that many seconds
+
+
+/*
+ *  Prototypes
+ */
+
+int  WatchAttempts(void);
+int  WatchBegin(void);
+void WatchBytes(const int iSlot, const size_t l);
+int  WatchEnd(const int iSlot);
+void WatchFirstByte(const int iSlot);
+int  WatchInit(const int iFirstByte, const int iStallSpeed,
+               const int iStallTime, const int iAttempts);
+void WatchQuit(void);
+void WatchThrottle(const int iSlot, const int iThrottled);
+
+
+#endif  // PKGCACHE_WATCH_H